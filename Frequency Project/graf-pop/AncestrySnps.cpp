@@ -1,140 +1,322 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "AncestrySnps.h"
 
-AncestrySnp::AncestrySnp(int id, int rsNum, int ch, int g37, int g38, char a1, char a2, float* refPops, float *vtxPops)
+
+// Checksum of the data of a panel file, whose length is a multiple of 8. Four words are mixed at a time, so
+// that checking the file takes a few milliseconds.
+static uint64_t GetPanelChecksum(const char *data, long numBytes)
 {
-    snpId = id;
-    rs = rsNum;
-    chr = ch;
-    posG37 = g37;
-    posG38 = g38;
-    ref = a1;
-    alt = a2;
+    uint64_t sums[4] = {1, 2, 3, 4};
+    long numWords = numBytes / 8;
+
+    for (long wordNo = 0; wordNo < numWords; wordNo++) {
+        uint64_t word;
+        memcpy(&word, data + wordNo * 8, 8);
+        uint64_t& sum = sums[wordNo & 3];
+        sum = (sum ^ word) * 0x9e3779b97f4a7c15ULL;
+        sum ^= sum >> 29;
+    }
 
-    for (int i = 0; i < numRefPops; i++) refPopAfs[i] = refPops[i];
-    for (int i = 0; i < numVtxPops; i++) vtxPopAfs[i] = vtxPops[i];
+    uint64_t checksum = numBytes;
+    for (int i = 0; i < 4; i++) {
+        checksum = (checksum ^ sums[i]) * 0xbf58476d1ce4e5b9ULL;
+        checksum ^= checksum >> 31;
+    }
+
+    return checksum;
 }
 
-AncestrySnps::AncestrySnps()
+static void AddPanelArray(vector<char> *data, const void *values, long numBytes)
 {
+    uint64_t arrayLen = numBytes;
+    data->insert(data->end(), (const char*)&arrayLen, (const char*)&arrayLen + 8);
+    data->insert(data->end(), (const char*)values, (const char*)values + numBytes);
+    data->resize((data->size() + 7) / 8 * 8, 0);
+}
+
+// Returns the next array of the panel data, and its number of values, or NULL if the array is cut short,
+// or its length isn't a multiple of the value size.
+static const char* GetPanelArray(const char **dataPos, const char *dataEnd, int valueSize, long *numValues)
+{
+    if (dataEnd - *dataPos < 8) return NULL;
+
+    uint64_t arrayLen;
+    memcpy(&arrayLen, *dataPos, 8);
+    uint64_t paddedLen = (arrayLen + 7) / 8 * 8;
+    if (paddedLen > uint64_t(dataEnd - *dataPos - 8) || arrayLen % valueSize != 0) return NULL;
 
-    refPopNames[0] = "African";
-    refPopNames[1] = "European";
-    refPopNames[2] = "Asian";
-    refPopNames[3] = "Mexican";
-    refPopNames[4] = "Indian-Pakistani";
+    const char *values = *dataPos + 8;
+    *dataPos = values + paddedLen;
+    *numValues = arrayLen / valueSize;
 
-    snps = {};
+    return values;
 }
 
-AncestrySnps::~AncestrySnps()
+AncSnpLookupTable::AncSnpLookupTable()
 {
-    snps.clear();
-    rsToAncSnpId.clear();
-    pos37ToAncSnpId.clear();
-    pos38ToAncSnpId.clear();
+    slotShift = 63;
+    slotMask = 1;
+    slotKeys.values = {0, 0};
+    slotSnpIds.values = {-1, -1};
+    filterBits.values.assign((1 << ANC_SNP_FILTER_BITS) / 64, 0);
+    slotKeys.UseValues();
+    slotSnpIds.UseValues();
+    filterBits.UseValues();
 }
 
-int AncestrySnps::ReadAncestrySnpsFromFile(string ancSnpFile)
+// Key No. i is for the SNP with ID i. If a key is found more than once, the last SNP is kept.
+void AncSnpLookupTable::Build(const vector<uint64_t>& keys)
 {
-    ASSERT(FileExists(ancSnpFile.c_str()), "File " << ancSnpFile << " does not exist!\n");
-
-    double popExpPfSums[numRefPops];
-    double popExpPaSums[numRefPops];
-    double popExpPeSums[numRefPops];
-
-    for (int popId = 0; popId < numRefPops; popId++) {
-        popExpPeSums[popId] = 0;
-        popExpPfSums[popId] = 0;
-        popExpPaSums[popId] = 0;
+    int numSlotBits = 1;
+    while ((1L << numSlotBits) < keys.size() * 2) numSlotBits++;
+
+    long numSlots = 1L << numSlotBits;
+    slotShift = 64 - numSlotBits;
+    slotMask = numSlots - 1;
+    vector<uint64_t>& keyValues = slotKeys.values;
+    vector<int>& snpIdValues = slotSnpIds.values;
+    vector<uint64_t>& filterValues = filterBits.values;
+    keyValues.assign(numSlots, 0);
+    snpIdValues.assign(numSlots, -1);
+    filterValues.assign((1 << ANC_SNP_FILTER_BITS) / 64, 0);
+
+    for (int snpId = 0; snpId < keys.size(); snpId++) {
+        uint64_t key = keys[snpId];
+        uint64_t bitNo = Hash2(key) >> (64 - ANC_SNP_FILTER_BITS);
+        filterValues[bitNo >> 6] |= uint64_t(1) << (bitNo & 63);
+
+        uint64_t slot = Hash1(key) >> slotShift;
+        while (snpIdValues[slot] >= 0 && keyValues[slot] != key) slot = (slot + 1) & slotMask;
+        keyValues[slot] = key;
+        snpIdValues[slot] = snpId;
     }
 
-    int lineLen = 300;
-    char snpLine[lineLen];
+    slotKeys.UseValues();
+    slotSnpIds.UseValues();
+    filterBits.UseValues();
+}
 
-    FILE *ifp = fopen(ancSnpFile.c_str(), "r");
-    ASSERT(ifp, "Couldn't open file " << ancSnpFile << ".\n");
+long AncSnpLookupTable::GetMemoryBytes() const
+{
+    return slotKeys.size * sizeof(uint64_t) + slotSnpIds.size * sizeof(int) + filterBits.size * sizeof(uint64_t);
+}
 
-    int lineNo = 0;
-    bool fileIsValid = true;
+// Key No. i is for the SNP with ID i. Same as the lookup tables, the last SNP is kept for a duplicate key.
+void AncestrySnps::SortPositionKeys(const vector<uint64_t>& keys, int b)
+{
+    vector<int> snpIds(keys.size());
+    for (int snpId = 0; snpId < keys.size(); snpId++) snpIds[snpId] = snpId;
+    stable_sort(snpIds.begin(), snpIds.end(), [&keys](int id1, int id2) { return keys[id1] < keys[id2]; });
+
+    vector<uint64_t>& sortedKeys = sortedPosKeys[b].values;
+    vector<int>& sortedSnpIds = sortedPosSnpIds[b].values;
+    sortedKeys.clear();
+    sortedSnpIds.clear();
+    for (int i = 0; i < snpIds.size(); i++) {
+        uint64_t key = keys[snpIds[i]];
+        if (i + 1 < snpIds.size() && keys[snpIds[i+1]] == key) continue;
+        sortedKeys.push_back(key);
+        sortedSnpIds.push_back(snpIds[i]);
+    }
 
-    int numSnps = 0;
-    int rsNum, chr, g37, g38;
-    char a1, a2;
-    float rfEur, rfAfa, rfAsn, rfLat, rfSas, vtEur, vtAfr, vtEas;
+    // Sentinel, so that the cursor never moves past the end
+    sortedKeys.push_back(UINT64_MAX);
+    sortedSnpIds.push_back(-1);
+    sortedPosKeys[b].UseValues();
+    sortedPosSnpIds[b].UseValues();
+}
 
-    while (fgets(snpLine, lineLen, ifp) != NULL && fileIsValid == true) {
-        if (lineNo == 0) {
-            if (snpLine[0] != 'c' || snpLine[1] != 'h' || snpLine[2] != 'r') {
-                fileIsValid = false;
+void AncestrySnps::SetGenoLogLikelihoods()
+{
+    vector<double>& logLikes = snpGenoLogLikes.values;
+    vector<uint32_t>& validMasks = snpPopValidMasks.values;
+    logLikes.assign(long(numSnps) * 3 * numRefPops, 0);
+    validMasks.assign(numSnps, 0);
+
+    for (int popId = 0; popId < numRefPops; popId++) {
+        const float *popAfs = GetRefPopAfs(popId);
+
+        for (int snpId = 0; snpId < numSnps; snpId++) {
+            double pv = popAfs[snpId];
+            if (pv > 0 && pv < 1) {
+                double qv = 1 - pv;
+                long tableNo = long(snpId) * 3 * numRefPops + popId;
+                logLikes[tableNo] = log(pv) * 2;
+                logLikes[tableNo + numRefPops] = log(pv * qv * 2);
+                logLikes[tableNo + 2 * numRefPops] = log(qv) * 2;
+                validMasks[snpId] |= uint32_t(1) << popId;
             }
         }
-        else {
-            sscanf(snpLine, "%d %d %d %d %c %c %f %f %f %f %f %f %f %f",
-            &chr, &g37, &g38, &rsNum, &a1, &a2, &rfEur, &rfAfa, &rfAsn, &rfLat, &rfSas, &vtEur, &vtAfr, &vtEas);
-
-            float* refPopAfs = new float[numRefPops];
-            float* vtxPopAfs = new float[numVtxPops];
+    }
 
-            refPopAfs[0] = rfEur;
-            refPopAfs[1] = rfAfa;
-            refPopAfs[2] = rfAsn;
-            refPopAfs[3] = rfLat;
-            refPopAfs[4] = rfSas;
+    snpGenoLogLikes.UseValues();
+    snpPopValidMasks.UseValues();
+}
 
-            vtxPopAfs[0] = vtEur;
-            vtxPopAfs[1] = vtAfr;
-            vtxPopAfs[2] = vtEas;
+AncSnpPosCursor::AncSnpPosCursor(AncestrySnps *aSnps)
+{
+    ancSnps = aSnps;
+    for (int b = 0; b < 2; b++) {
+        snpNos[b] = 0;
+        lastKeys[b] = 0;
+        numFinds[b] = 0;
+        numSeeks[b] = 0;
+        useHash[b] = false;
+    }
+}
 
-            AncestrySnp ancSnp(numSnps, rsNum, chr, g37, g38, a1, a2, refPopAfs, vtxPopAfs);
+// Moves the cursor of build b to the first ancestry SNP with key >= the given key. Returns the new position, or
+// -1 if the positions are taken as not sorted and the hash tables should be used from now on.
+long AncSnpPosCursor::Seek(int b, uint64_t key)
+{
+    const uint64_t *keys = ancSnps->sortedPosKeys[b].data;
+    long numKeys = ancSnps->sortedPosKeys[b].size;
+    long snpNo = snpNos[b];
+
+    if (key < lastKeys[b]) {
+        // A sorted file only goes back at the start of some chromosomes
+        numSeeks[b]++;
+        if (numSeeks[b] > 64 && numSeeks[b] * 16 > numFinds[b]) {
+            useHash[b] = true;
+            return -1;
+        }
+        snpNo = lower_bound(keys, keys + numKeys, key) - keys;
+    }
+    else {
+        // Usually the next ancestry SNP is close by
+        int numSteps = 0;
+        while (keys[snpNo] < key && numSteps < 8) {
+            snpNo++;
+            numSteps++;
+        }
+        if (keys[snpNo] < key) snpNo = lower_bound(keys + snpNo, keys + numKeys, key) - keys;
+    }
 
-            snps.push_back(ancSnp);
+    snpNos[b] = snpNo;
+    return snpNo;
+}
 
-            long int chrPos37 = (long)chr * 1000000000 + g37;
-            long int chrPos38 = (long)chr * 1000000000 + g38;
+AncestrySnps::AncestrySnps()
+{
+    numSnps = 0;
+    numRefPops = 0;
+    numVtxPops = 0;
+    refPopNames = {};
+    vtxPopNames = {};
+    vtxPopExpGds = {};
+
+    panelData = NULL;
+    panelLen = 0;
+}
 
-            rsToAncSnpId[rsNum] = numSnps;
-            pos37ToAncSnpId[chrPos37] = numSnps;
-            pos38ToAncSnpId[chrPos38] = numSnps;
+AncestrySnps::~AncestrySnps()
+{
+    if (panelData) munmap((void*)panelData, panelLen);
+}
 
-            double pev = refPopAfs[0];
-            double pfv = refPopAfs[1];
-            double pav = refPopAfs[2];
+// Population columns after chr, GB37, GB38, rs, Ref and Alt. Names of the vertex populations start with 'v'.
+// Returns false if the numbers of populations can't be used by GrafPop.
+bool AncestrySnps::SetPopulations(const vector<string>& popNames)
+{
+    refPopNames.clear();
+    vtxPopNames.clear();
 
-            double qev = 1 - pev;
-            double qfv = 1 - pfv;
-            double qav = 1 - pav;
+    for (int i = 0; i < popNames.size(); i++) {
+        if (popNames[i][0] == 'v') vtxPopNames.push_back(popNames[i]);
+        else if (vtxPopNames.empty()) refPopNames.push_back(popNames[i]);
+        else return false;
+    }
 
-            for (int vtxId = 0; vtxId < 3; vtxId++) {
-                double pv  = vtxPopAfs[vtxId];
-                double qv  = 1 - pv;
+    numRefPops = refPopNames.size();
+    numVtxPops = vtxPopNames.size();
 
-                double aaPev = log(pev) * 2;
-                double bbPev = log(qev) * 2;
-                double abPev = log(pev) + log(qev) + log(2);
+    return numRefPops >= ANC_SNP_MIN_REF_POPS && numRefPops <= ANC_SNP_MAX_REF_POPS &&
+           numVtxPops == ANC_SNP_NUM_VTX_POPS;
+}
 
-                double aaPfv = log(pfv) * 2;
-                double bbPfv = log(qfv) * 2;
-                double abPfv = log(pfv) + log(qfv) + log(2);
+// Reads the ancestry SNPs from a text file with a header line. The columns are chr, GB37, GB38, rs, Ref, Alt,
+// the allele frequencies of the reference populations, then those of the vertex populations. Any number of
+// SNPs and reference populations can be used, e.g., a smaller panel for fast screening.
+// Returns the number of SNPs, or 0 if the file isn't valid.
+int AncestrySnps::ReadAncestrySnpsFromFile(string ancSnpFile)
+{
+    FILE *ifp = fopen(ancSnpFile.c_str(), "r");
+    if (!ifp) {
+        cout << "\nERROR: Couldn't open file " << ancSnpFile << "\n";
+        return 0;
+    }
 
-                double aaPav = log(pav) * 2;
-                double bbPav = log(qav) * 2;
-                double abPav = log(pav) + log(qav) + log(2);
+    const int lineLen = 4096;
+    char snpLine[lineLen];
 
-                double eGd = aaPev * pv * pv + bbPev * qv * qv + abPev * 2 * pv * qv;
-                double fGd = aaPfv * pv * pv + bbPfv * qv * qv + abPfv * 2 * pv * qv;
-                double aGd = aaPav * pv * pv + bbPav * qv * qv + abPav * 2 * pv * qv;
+    int lineNo = 0;
+    bool fileIsValid = true;
+    numSnps = 0;
+
+    vector<uint64_t> rsKeys, pos37Keys, pos38Keys;
+    vector<float> snpRefAfs, snpVtxAfs;   // Allele frequencies of the SNPs, one row per SNP
+    vector<int>& rsNums = snpRsNums.values;
+    vector<int>& chrs = snpChrs.values;
+    vector<int>& pos37s = snpPos37s.values;
+    vector<int>& pos38s = snpPos38s.values;
+    vector<char>& refs = snpRefs.values;
+    vector<char>& alts = snpAlts.values;
+    rsNums.clear();
+    chrs.clear();
+    pos37s.clear();
+    pos38s.clear();
+    refs.clear();
+    alts.clear();
+
+    while (fileIsValid && fgets(snpLine, lineLen, ifp) != NULL) {
+        vector<char*> fields;
+        for (char *field = strtok(snpLine, " \t\r\n"); field; field = strtok(NULL, " \t\r\n")) {
+            fields.push_back(field);
+        }
 
-                vtxExpGenoDists[vtxId][0][numSnps] = eGd;
-                vtxExpGenoDists[vtxId][1][numSnps] = fGd;
-                vtxExpGenoDists[vtxId][2][numSnps] = aGd;
+        if (lineNo == 0) {
+            if (fields.size() < 6 || strncmp(fields[0], "chr", 3) != 0) {
+                cout << "\nERROR: First line of " << ancSnpFile << " should be the header, starting with chr\n";
+                fileIsValid = false;
+            }
+            else if (!SetPopulations(vector<string>(fields.begin() + 6, fields.end()))) {
+                cout << "\nERROR: " << ancSnpFile << " should have the allele frequencies of " << ANC_SNP_MIN_REF_POPS
+                     << " to " << ANC_SNP_MAX_REF_POPS << " reference populations, followed by "
+                     << ANC_SNP_NUM_VTX_POPS << " vertex populations whose names start with 'v'\n";
+                fileIsValid = false;
+            }
+        }
+        else if (!fields.empty()) {
+            if (fields.size() != 6 + numRefPops + numVtxPops) {
+                cout << "\nERROR: Line " << lineNo + 1 << " of " << ancSnpFile << " should have "
+                     << 6 + numRefPops + numVtxPops << " columns\n";
+                fileIsValid = false;
+                break;
+            }
 
-                popExpPeSums[vtxId] += eGd;
-                popExpPfSums[vtxId] += fGd;
-                popExpPaSums[vtxId] += aGd;
+            int chr = atoi(fields[0]);
+            int g37 = atoi(fields[1]);
+            int g38 = atoi(fields[2]);
+            int rsNum = atoi(fields[3]);
+
+            rsNums.push_back(rsNum);
+            chrs.push_back(chr);
+            pos37s.push_back(g37);
+            pos38s.push_back(g38);
+            refs.push_back(fields[4][0]);
+            alts.push_back(fields[5][0]);
+
+            for (int popId = 0; popId < numRefPops; popId++) snpRefAfs.push_back(strtof(fields[6 + popId], NULL));
+            for (int popId = 0; popId < numVtxPops; popId++) {
+                snpVtxAfs.push_back(strtof(fields[6 + numRefPops + popId], NULL));
             }
 
-            delete refPopAfs;
-            delete vtxPopAfs;
+            rsKeys.push_back(rsNum);
+            pos37Keys.push_back(uint64_t(chr) * 1000000000 + g37);
+            pos38Keys.push_back(uint64_t(chr) * 1000000000 + g38);
 
             numSnps++;
         }
@@ -143,77 +325,408 @@ int AncestrySnps::ReadAncestrySnpsFromFile(string ancSnpFile)
     }
     fclose(ifp);
 
-    ASSERT(numSnps == numAncSnps, "numSnps = " << numAncSnps << ".\n");
+    if (fileIsValid && numSnps == 0) {
+        cout << "\nERROR: No ancestry SNPs in " << ancSnpFile << "\n";
+        fileIsValid = false;
+    }
+    if (!fileIsValid) {
+        numSnps = 0;
+        return 0;
+    }
 
-    for (int vtxId = 0; vtxId < 3; vtxId++) {
-        vtxPopExpGds[vtxId].e = -1 * popExpPeSums[vtxId]/numSnps;
-        vtxPopExpGds[vtxId].f = -1 * popExpPfSums[vtxId]/numSnps;
-        vtxPopExpGds[vtxId].a = -1 * popExpPaSums[vtxId]/numSnps;
+    // Allele frequencies are kept in one column per population
+    refPopAfs.values.resize(long(numRefPops) * numSnps);
+    vtxPopAfs.values.resize(long(numVtxPops) * numSnps);
+    for (int snpId = 0; snpId < numSnps; snpId++) {
+        for (int popId = 0; popId < numRefPops; popId++) {
+            refPopAfs.values[long(popId) * numSnps + snpId] = snpRefAfs[long(snpId) * numRefPops + popId];
+        }
+        for (int popId = 0; popId < numVtxPops; popId++) {
+            vtxPopAfs.values[long(popId) * numSnps + snpId] = snpVtxAfs[long(snpId) * numVtxPops + popId];
+        }
     }
 
+    snpRsNums.UseValues();
+    snpChrs.UseValues();
+    snpPos37s.UseValues();
+    snpPos38s.UseValues();
+    snpRefs.UseValues();
+    snpAlts.UseValues();
+    refPopAfs.UseValues();
+    vtxPopAfs.UseValues();
+
+    rsToAncSnpId.Build(rsKeys);
+    pos37ToAncSnpId.Build(pos37Keys);
+    pos38ToAncSnpId.Build(pos38Keys);
+    SortPositionKeys(pos37Keys, 0);
+    SortPositionKeys(pos38Keys, 1);
+    SetVertexExpectedGeneticDists();
+    SetGenoLogLikelihoods();
+
     cout << "Read " << numSnps << " ancestry SNPs from file " << ancSnpFile << "\n\n";
     if (0) {
         cout << "Expected vertex genetic distances\n";
-        for (int vtxId = 0; vtxId < 3; vtxId++) {
+        for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
             cout << "\tVertex " << vtxId << "\n";
             cout << "\t\tEUR: " << vtxPopExpGds[vtxId].e << "\n";
             cout << "\t\tAFR: " << vtxPopExpGds[vtxId].f << "\n";
             cout << "\t\tEAS: " << vtxPopExpGds[vtxId].a << "\n";
         }
     }
+
+    return numSnps;
 }
 
-int AncestrySnps::FindSnpIdGivenRs(int rsNum)
+// For each SNP, the expected genetic distances from the vertices to the first 3 reference populations (E, F, A),
+// and the sums of all SNPs
+void AncestrySnps::SetVertexExpectedGeneticDists()
 {
-    int snpId = -1;
+    vector<double>& expDists = vtxExpGenoDists.values;
+    expDists.assign(long(numVtxPops) * numVtxPops * numSnps, 0);
+    vector<double> expDistSums(numVtxPops * numVtxPops, 0);
+
+    for (int snpId = 0; snpId < numSnps; snpId++) {
+        for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
+            double pv = vtxPopAfs[long(vtxId) * numSnps + snpId];
+            double qv = 1 - pv;
+
+            for (int popNo = 0; popNo < numVtxPops; popNo++) {
+                double pp = refPopAfs[long(popNo) * numSnps + snpId];
+                double qp = 1 - pp;
+
+                double aaPp = log(pp) * 2;
+                double bbPp = log(qp) * 2;
+                double abPp = log(pp) + log(qp) + log(2);
+
+                double gd = aaPp * pv * pv + bbPp * qv * qv + abPp * 2 * pv * qv;
 
-    if (rsToAncSnpId.find(rsNum) != rsToAncSnpId.end()) {
-        snpId = rsToAncSnpId[rsNum];
+                expDists[(long(vtxId) * numVtxPops + popNo) * numSnps + snpId] = gd;
+                expDistSums[vtxId * numVtxPops + popNo] += gd;
+            }
+        }
     }
+    vtxExpGenoDists.UseValues();
 
-    return snpId;
+    vtxPopExpGds.resize(numVtxPops);
+    for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
+        vtxPopExpGds[vtxId].e = -1 * expDistSums[vtxId * numVtxPops + 0]/numSnps;
+        vtxPopExpGds[vtxId].f = -1 * expDistSums[vtxId * numVtxPops + 1]/numSnps;
+        vtxPopExpGds[vtxId].a = -1 * expDistSums[vtxId * numVtxPops + 2]/numSnps;
+    }
 }
 
-int AncestrySnps::FindSnpIdGivenChrPos(int chr, int pos, int build)
+// Gets the size and modification time of the text file of the ancestry SNPs, and its checksum if checksum isn't NULL.
+// The bytes after the last whole word are mixed in separately.
+static bool GetSourceFileInfo(string ancSnpFile, uint64_t *fileSize, int64_t *fileMtime, uint64_t *checksum)
 {
-    int snpId = -1;
-
-    long int chrPos = long(chr) * 1000000000 + pos;
+    int fd = open(ancSnpFile.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
 
-    if (build == 37) {
-        if (pos37ToAncSnpId.find(chrPos) != pos37ToAncSnpId.end()) {
-            snpId = pos37ToAncSnpId[chrPos];
+    *fileSize = fileStat.st_size;
+    *fileMtime = fileStat.st_mtime;
+
+    bool readOk = true;
+    if (checksum) {
+        long fileLen = fileStat.st_size;
+        long wordBytes = fileLen & ~7L;
+        uint64_t tail = 0;
+
+        if (fileLen > 0) {
+            void *mapAddr = mmap(NULL, fileLen, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapAddr != MAP_FAILED) {
+                const char *fileData = (const char*)mapAddr;
+                *checksum = GetPanelChecksum(fileData, wordBytes);
+                memcpy(&tail, fileData + wordBytes, fileLen - wordBytes);
+                munmap(mapAddr, fileLen);
+            }
+            else {
+                readOk = false;
+            }
         }
-    }
-    else if (build == 38) {
-        if (pos38ToAncSnpId.find(chrPos) != pos38ToAncSnpId.end()) {
-            snpId = pos38ToAncSnpId[chrPos];
+        else {
+            *checksum = GetPanelChecksum(NULL, 0);
         }
+
+        *checksum = (*checksum ^ tail) * 0x94d049bb133111ebULL;
     }
+    close(fd);
 
-    return snpId;
+    return readOk;
 }
 
-AncestrySnp AncestrySnps::GetAncestrySnp(int snpId)
+// Saves the ancestry SNPs, the expected vertex genetic distances and the lookup tables in a binary panel file,
+// to be loaded by ReadPanelFile much faster than reading the text file. All arrays are saved in the same layout
+// as in memory, so that they can be used from the mapped file. The size, modification time and checksum of the
+// text file the SNPs were read from are saved, so that grafpop can tell if the panel is out of date.
+bool AncestrySnps::WritePanelFile(string panelFile, string ancSnpFile)
 {
-    return snps[snpId];
+    uint64_t srcFileSize, srcChecksum;
+    int64_t srcFileMtime;
+    if (!GetSourceFileInfo(ancSnpFile, &srcFileSize, &srcFileMtime, &srcChecksum)) {
+        cout << "\nERROR: Couldn't read file " << ancSnpFile << "\n";
+        return false;
+    }
+
+    vector<double> vtxGds;
+    for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
+        vtxGds.push_back(vtxPopExpGds[vtxId].e);
+        vtxGds.push_back(vtxPopExpGds[vtxId].f);
+        vtxGds.push_back(vtxPopExpGds[vtxId].a);
+    }
+
+    string popNames = "";
+    for (int popId = 0; popId < numRefPops; popId++) popNames += refPopNames[popId] + '\0';
+    for (int popId = 0; popId < numVtxPops; popId++) popNames += vtxPopNames[popId] + '\0';
+
+    vector<char> data;
+    AddPanelArray(&data, snpRsNums.data, numSnps * sizeof(int));
+    AddPanelArray(&data, snpChrs.data, numSnps * sizeof(int));
+    AddPanelArray(&data, snpPos37s.data, numSnps * sizeof(int));
+    AddPanelArray(&data, snpPos38s.data, numSnps * sizeof(int));
+    AddPanelArray(&data, snpRefs.data, numSnps);
+    AddPanelArray(&data, snpAlts.data, numSnps);
+    AddPanelArray(&data, refPopAfs.data, refPopAfs.size * sizeof(float));
+    AddPanelArray(&data, vtxPopAfs.data, vtxPopAfs.size * sizeof(float));
+    AddPanelArray(&data, vtxExpGenoDists.data, vtxExpGenoDists.size * sizeof(double));
+    AddPanelArray(&data, vtxGds.data(), vtxGds.size() * sizeof(double));
+
+    const AncSnpLookupTable *tables[3] = {&rsToAncSnpId, &pos37ToAncSnpId, &pos38ToAncSnpId};
+    for (int i = 0; i < 3; i++) {
+        const AncSnpLookupTable *table = tables[i];
+        AddPanelArray(&data, table->slotKeys.data, table->slotKeys.size * sizeof(uint64_t));
+        AddPanelArray(&data, table->slotSnpIds.data, table->slotSnpIds.size * sizeof(int));
+        AddPanelArray(&data, table->filterBits.data, table->filterBits.size * sizeof(uint64_t));
+    }
+    for (int b = 0; b < 2; b++) {
+        AddPanelArray(&data, sortedPosKeys[b].data, sortedPosKeys[b].size * sizeof(uint64_t));
+        AddPanelArray(&data, sortedPosSnpIds[b].data, sortedPosSnpIds[b].size * sizeof(int));
+    }
+    AddPanelArray(&data, snpGenoLogLikes.data, snpGenoLogLikes.size * sizeof(double));
+    AddPanelArray(&data, snpPopValidMasks.data, snpPopValidMasks.size * sizeof(uint32_t));
+    AddPanelArray(&data, popNames.data(), popNames.length());
+
+    AncSnpPanelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ANC_SNP_PANEL_MAGIC, 8);
+    header.version = ANC_SNP_PANEL_VERSION;
+    header.numSnps = numSnps;
+    header.numRefPops = numRefPops;
+    header.numVtxPops = numVtxPops;
+    header.filterBits = ANC_SNP_FILTER_BITS;
+    header.dataBytes = data.size();
+    header.dataChecksum = GetPanelChecksum(data.data(), data.size());
+    header.srcFileSize = srcFileSize;
+    header.srcFileMtime = srcFileMtime;
+    header.srcChecksum = srcChecksum;
+
+    FILE *ofp = fopen(panelFile.c_str(), "wb");
+    if (!ofp) {
+        cout << "\nERROR: Couldn't open file " << panelFile << " to write\n";
+        return false;
+    }
+
+    bool writeOk = fwrite(&header, sizeof(header), 1, ofp) == 1 && fwrite(data.data(), data.size(), 1, ofp) == 1;
+    if (fclose(ofp) != 0) writeOk = false;
+    if (!writeOk) cout << "\nERROR: Failed to write file " << panelFile << "\n";
+
+    return writeOk;
 }
 
-void AncestrySnps::ShowAncestrySnps()
+// Loads a panel file written by WritePanelFile. The file is memory mapped and checked with the checksum, and the
+// arrays are used in place. Returns the number of ancestry SNPs, or 0 if the file isn't a valid panel file of
+// this version, or wasn't compiled from the text file ancSnpFile (if not empty) as it is now. The text file is
+// only read for the checksum if its modification time has changed but not its size, e.g., after it was copied.
+int AncestrySnps::ReadPanelFile(string panelFile, string ancSnpFile)
 {
-    int numAncSnps = snps.size();
+    int fd = open(panelFile.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        if (fd >= 0) close(fd);
+        cout << "\nERROR: Couldn't open file " << panelFile << "\n";
+        return 0;
+    }
+    long fileLen = fileStat.st_size;
+
+    const char *fileData = NULL;
+    if (fileLen >= sizeof(AncSnpPanelHeader)) {
+        void *mapAddr = mmap(NULL, fileLen, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (mapAddr != MAP_FAILED) fileData = (const char*)mapAddr;
+    }
+    close(fd);
+
+    AncSnpPanelHeader header;
+    memset(&header, 0, sizeof(header));
+    if (fileData) memcpy(&header, fileData, sizeof(header));
+
+    string fileErr = "";
+    if (!fileData || memcmp(header.magic, ANC_SNP_PANEL_MAGIC, 8) != 0) {
+        fileErr = "not a GrafPop panel file";
+    }
+    else if (header.version != ANC_SNP_PANEL_VERSION) {
+        fileErr = "panel version " + to_string(header.version) + " can't be read by this version of grafpop, "
+                  "which reads version " + to_string(ANC_SNP_PANEL_VERSION) + ". Please compile the panel again";
+    }
+    else if (header.numSnps < 1 || header.numRefPops < ANC_SNP_MIN_REF_POPS ||
+             header.numRefPops > ANC_SNP_MAX_REF_POPS || header.numVtxPops != ANC_SNP_NUM_VTX_POPS ||
+             header.filterBits != ANC_SNP_FILTER_BITS) {
+        fileErr = "numbers of SNPs or populations can't be used by this version of grafpop";
+    }
+    else if (header.dataBytes != fileLen - sizeof(header) || header.dataBytes % 8 != 0) {
+        fileErr = "file is truncated";
+    }
+    else if (GetPanelChecksum(fileData + sizeof(header), header.dataBytes) != header.dataChecksum) {
+        fileErr = "checksum doesn't match";
+    }
 
-    cout << "Total " << numAncSnps << " Ancestry SNPs.\n";
+    long panelSnps = header.numSnps;
+    long panelRefPops = header.numRefPops;
+    long panelVtxPops = header.numVtxPops;
+    const char *dataPos = fileData + sizeof(header);
+    const char *dataEnd = fileData + fileLen;
+
+    // Arrays in the order saved by WritePanelFile: 0-7 SNP columns, 8-9 vertex distances, 10-18 three lookup
+    // tables, 19-22 sorted positions of the two builds, 23-24 genotype log likelihoods, 25 population names
+    const int numArrays = 26;
+    const int valueSizes[numArrays] = {4, 4, 4, 4, 1, 1, 4, 4, 8, 8, 8, 4, 8, 8, 4, 8, 8, 4, 8, 8, 4, 8, 4, 8, 4, 1};
+    const char *arrays[numArrays];
+    long arrayLens[numArrays];
+
+    bool arraysOk = fileErr == "";
+    for (int i = 0; i < numArrays && arraysOk; i++) {
+        arrays[i] = GetPanelArray(&dataPos, dataEnd, valueSizes[i], &arrayLens[i]);
+        if (!arrays[i]) arraysOk = false;
+    }
+
+    vector<string> popNames;
+    if (arraysOk) {
+        for (int i = 0; i < 6; i++) {
+            if (arrayLens[i] != panelSnps) arraysOk = false;
+        }
+        if (arrayLens[6] != panelRefPops * panelSnps || arrayLens[7] != panelVtxPops * panelSnps) arraysOk = false;
+        if (arrayLens[8] != panelVtxPops * panelVtxPops * panelSnps || arrayLens[9] != panelVtxPops * 3) arraysOk = false;
+
+        for (int i = 10; i < 19; i += 3) {
+            long numSlots = arrayLens[i];
+            if (numSlots < 2 || (numSlots & (numSlots - 1)) != 0 || arrayLens[i+1] != numSlots ||
+                arrayLens[i+2] != (1 << ANC_SNP_FILTER_BITS) / 64) arraysOk = false;
+        }
+
+        // The cursors need the sentinel at the end of the sorted positions
+        for (int i = 19; i < 23; i += 2) {
+            const uint64_t *keys = (const uint64_t*)arrays[i];
+            if (arrayLens[i] < 1 || arrayLens[i+1] != arrayLens[i] || keys[arrayLens[i] - 1] != UINT64_MAX) {
+                arraysOk = false;
+            }
+        }
+
+        if (arrayLens[23] != panelSnps * 3 * panelRefPops || arrayLens[24] != panelSnps) arraysOk = false;
+
+        for (const char *name = arrays[25]; name < arrays[25] + arrayLens[25]; name += strlen(name) + 1) {
+            const char *nameEnd = (const char*)memchr(name, '\0', arrays[25] + arrayLens[25] - name);
+            if (!nameEnd || nameEnd == name) {
+                arraysOk = false;
+                break;
+            }
+            popNames.push_back(name);
+        }
+        if (popNames.size() != panelRefPops + panelVtxPops) arraysOk = false;
+    }
+    if (fileErr == "" && !arraysOk) fileErr = "file is corrupted";
+
+    if (fileErr != "") {
+        cout << "\nERROR: Couldn't read panel file " << panelFile << ": " << fileErr << "\n";
+        if (fileData) munmap((void*)fileData, fileLen);
+        return 0;
+    }
+
+    if (ancSnpFile != "") {
+        uint64_t srcFileSize, srcChecksum;
+        int64_t srcFileMtime;
+        bool srcMatched = GetSourceFileInfo(ancSnpFile, &srcFileSize, &srcFileMtime, NULL) &&
+                          srcFileSize == header.srcFileSize;
+        if (srcMatched && srcFileMtime != header.srcFileMtime) {
+            srcMatched = GetSourceFileInfo(ancSnpFile, &srcFileSize, &srcFileMtime, &srcChecksum) &&
+                         srcChecksum == header.srcChecksum;
+        }
+
+        if (!srcMatched) {
+            cout << "\nWARNING: Panel file " << panelFile << " wasn't compiled from " << ancSnpFile
+                 << " as it is now. Reading the text file instead. Please compile the panel again.\n";
+            munmap((void*)fileData, fileLen);
+            return 0;
+        }
+    }
+
+    numSnps = panelSnps;
+    SetPopulations(popNames);
+
+    snpRsNums.UseMapped((const int*)arrays[0], numSnps);
+    snpChrs.UseMapped((const int*)arrays[1], numSnps);
+    snpPos37s.UseMapped((const int*)arrays[2], numSnps);
+    snpPos38s.UseMapped((const int*)arrays[3], numSnps);
+    snpRefs.UseMapped(arrays[4], numSnps);
+    snpAlts.UseMapped(arrays[5], numSnps);
+    refPopAfs.UseMapped((const float*)arrays[6], arrayLens[6]);
+    vtxPopAfs.UseMapped((const float*)arrays[7], arrayLens[7]);
+    vtxExpGenoDists.UseMapped((const double*)arrays[8], arrayLens[8]);
+
+    const double *vtxGds = (const double*)arrays[9];
+    vtxPopExpGds.resize(numVtxPops);
+    for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
+        vtxPopExpGds[vtxId].e = vtxGds[vtxId * 3];
+        vtxPopExpGds[vtxId].f = vtxGds[vtxId * 3 + 1];
+        vtxPopExpGds[vtxId].a = vtxGds[vtxId * 3 + 2];
+    }
+
+    AncSnpLookupTable *tables[3] = {&rsToAncSnpId, &pos37ToAncSnpId, &pos38ToAncSnpId};
+    for (int i = 0; i < 3; i++) {
+        AncSnpLookupTable *table = tables[i];
+        int arrayNo = 10 + i * 3;
+        long numSlots = arrayLens[arrayNo];
+
+        int numSlotBits = 1;
+        while ((1L << numSlotBits) < numSlots) numSlotBits++;
+        table->slotShift = 64 - numSlotBits;
+        table->slotMask = numSlots - 1;
+        table->slotKeys.UseMapped((const uint64_t*)arrays[arrayNo], numSlots);
+        table->slotSnpIds.UseMapped((const int*)arrays[arrayNo + 1], numSlots);
+        table->filterBits.UseMapped((const uint64_t*)arrays[arrayNo + 2], arrayLens[arrayNo + 2]);
+    }
+
+    for (int b = 0; b < 2; b++) {
+        long numKeys = arrayLens[19 + b * 2];
+        sortedPosKeys[b].UseMapped((const uint64_t*)arrays[19 + b * 2], numKeys);
+        sortedPosSnpIds[b].UseMapped((const int*)arrays[20 + b * 2], numKeys);
+    }
+
+    snpGenoLogLikes.UseMapped((const double*)arrays[23], arrayLens[23]);
+    snpPopValidMasks.UseMapped((const uint32_t*)arrays[24], arrayLens[24]);
+
+    // All arrays are read from the mapped file, so it's kept until the SNPs are deleted
+    if (panelData) munmap((void*)panelData, panelLen);
+    panelData = fileData;
+    panelLen = fileLen;
+
+    cout << "Read " << numSnps << " ancestry SNPs from panel file " << panelFile << "\n\n";
+
+    return numSnps;
+}
+
+void AncestrySnps::ShowAncestrySnps()
+{
+    cout << "Total " << numSnps << " Ancestry SNPs.\n";
     bool debug = 0;
 
     if (debug) {
-        for (int i = 0; i < 20; i++) {
-            int snpId = i * 5000;
-            AncestrySnp snp = snps[snpId];
-            cout << "SNP " << snpId << " rs " << snp.rs << " chr " << snp.chr << " pos " << snp.posG37
-            << " ref " << snp.ref << " alt " << snp.alt;
-            for (int j = 0; j < numRefPops; j++) cout << " Ref " << j << " = " << snp.refPopAfs[j];
-            for (int j = 0; j < numVtxPops; j++) cout << " Vtx " << j << " = " << snp.vtxPopAfs[j];
+        for (int snpId = 0; snpId < numSnps; snpId += 5000) {
+            cout << "SNP " << snpId << " rs " << snpRsNums[snpId] << " chr " << snpChrs[snpId]
+            << " pos " << snpPos37s[snpId] << " ref " << snpRefs[snpId] << " alt " << snpAlts[snpId];
+            for (int j = 0; j < numRefPops; j++) cout << " " << refPopNames[j] << " = " << GetRefPopAfs(j)[snpId];
+            for (int j = 0; j < numVtxPops; j++) cout << " " << vtxPopNames[j] << " = " << vtxPopAfs[j * numSnps + snpId];
             cout << "\n";
         }
     }
@@ -224,11 +737,11 @@ void AncestrySnps::ShowAncestrySnps()
     printf("\tA:  %5.4f  %5.4f  %5.4f\n", vtxPopExpGds[2].e, vtxPopExpGds[2].f, vtxPopExpGds[2].a);
 
     cout << "\nExpected genetic distances\n";
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
+    for (int i = 0; i < numVtxPops; i++) {
+        for (int j = 0; j < numVtxPops; j++) {
             cout << i << "-" << j << ": ";
-            for (int k = 0; k < 5; k++) {
-                cout << vtxExpGenoDists[i][j][k] << " ";
+            for (int k = 0; k < 5 && k < numSnps; k++) {
+                cout << GetVtxExpGenoDist(i, j, k) << " ";
             }
             cout << "\n";
         }
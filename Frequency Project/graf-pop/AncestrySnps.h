@@ -1,53 +1,213 @@
 #ifndef ANCESTRY_SNPS_H
 #define ANCESTRY_SNPS_H
 
+#include <stdint.h>
 #include "Util.h"
 
-static const int numAncSnps = 100437;
-static const int numRefPops = 5;
-static const int numVtxPops = 3;
+// The numbers of SNPs and populations are read from the file of the ancestry SNPs. GD1, GD2 and GD3 use the first 3
+// reference populations (EUR, AFR, ASN), and the 3 vertex populations, and GD4 uses the 4th and 5th (LAT, SAS).
+static const int ANC_SNP_MIN_REF_POPS = 5;
+static const int ANC_SNP_MAX_REF_POPS = 32;  // Bits of the masks of the populations with allele frequencies
+static const int ANC_SNP_NUM_VTX_POPS = 3;
 
-class AncestrySnp
+static const int ANC_SNP_FILTER_BITS = 20;   // log2 of the bits of the prefilter bitmap of each lookup table (128 KB)
+
+static const char ANC_SNP_PANEL_MAGIC[] = "GRAFPANL";
+static const int ANC_SNP_PANEL_VERSION  = 4;
+
+// Header of a binary panel file written by "grafpop-panel compile". The header is followed by the data: a list of
+// arrays, each saved as its length in bytes (8 bytes) and the values, padded to a multiple of 8 bytes.
+struct AncSnpPanelHeader
 {
-public:
-    int snpId;
-    int rs;
-    int chr;
-    int posG37;
-    int posG38;
-    char ref;
-    char alt;
-    float vtxPopAfs[numVtxPops]; // E, F, A, or EUR, AFR, EAS
-    float refPopAfs[numRefPops]; // EUR, AFA, ASN, LAT, SAS
+    char magic[8];
+    int32_t version;
+    int32_t numSnps;
+    int32_t numRefPops;
+    int32_t numVtxPops;
+    int32_t filterBits;          // ANC_SNP_FILTER_BITS of the lookup tables
+    int32_t reserved;
+    uint64_t dataBytes;
+    uint64_t dataChecksum;
+    uint64_t srcFileSize;        // Size, modification time and checksum of the text file the panel was compiled from
+    int64_t srcFileMtime;
+    uint64_t srcChecksum;
+};
+
+// Array that is either built in memory, or kept in a memory mapped panel file. Values are read through data.
+template <typename T>
+struct AncSnpPanelArray
+{
+    vector<T> values;
+    const T *data = NULL;
+    long size = 0;
+
+    AncSnpPanelArray() {};
+    AncSnpPanelArray(const AncSnpPanelArray&) = delete;
+    AncSnpPanelArray& operator=(const AncSnpPanelArray&) = delete;
+
+    void UseValues() { data = values.data(); size = values.size(); };
+    void UseMapped(const T *mapped, long numValues) { values.clear(); data = mapped; size = numValues; };
+    const T& operator[](long i) const { return data[i]; };
+};
+
+// Lookup table from the RS numbers, or chromosome positions, of the ancestry SNPs to the SNP IDs. The table is
+// built once after the SNPs are read, with open addressing (linear probing) in a power-of-two array that is at
+// most half full. Most variants of a genotype file aren't ancestry SNPs, so a bitmap of the hashed keys is checked
+// first, and rejects most of them without probing the table. It's only read after it's built, or loaded from a
+// panel file, so several threads can look up SNPs at the same time.
+class AncSnpLookupTable
+{
+    friend class AncestrySnps;   // Saves and loads the arrays of the tables in panel files
+
+private:
+    AncSnpPanelArray<uint64_t> slotKeys;
+    AncSnpPanelArray<int> slotSnpIds;        // -1 if the slot is empty
+    AncSnpPanelArray<uint64_t> filterBits;   // Bit (hash2(key) >> (64 - ANC_SNP_FILTER_BITS)) is set for each key
+    int slotShift;                   // 64 - log2(number of slots)
+    uint64_t slotMask;
+
+    static uint64_t Hash1(uint64_t key) { return key * 0x9e3779b97f4a7c15ULL; };
+    static uint64_t Hash2(uint64_t key) { return (key ^ (key >> 31)) * 0xbf58476d1ce4e5b9ULL; };
 
 public:
-    AncestrySnp(int, int, int, int, int, char, char, float*, float*);
+    AncSnpLookupTable();
+    void Build(const vector<uint64_t>&);
+    long GetMemoryBytes() const;
+
+    int Find(uint64_t key) const {
+        uint64_t bitNo = Hash2(key) >> (64 - ANC_SNP_FILTER_BITS);
+        if (((filterBits[bitNo >> 6] >> (bitNo & 63)) & 1) == 0) return -1;
+
+        for (uint64_t slot = Hash1(key) >> slotShift; ; slot = (slot + 1) & slotMask) {
+            if (slotSnpIds[slot] < 0) return -1;
+            if (slotKeys[slot] == key) return slotSnpIds[slot];
+        }
+    };
 };
 
+// Ancestry SNPs and the allele frequencies of the reference and vertex populations, read from AncInferSNPs.txt or
+// a custom panel with the same columns, or loaded from a binary panel file. The values of the SNPs are kept in
+// columns indexed by SNP ID, and the allele frequencies in one contiguous column per population.
 class AncestrySnps
 {
-    map<int, int> rsToAncSnpId;
-    map<long int, int> pos37ToAncSnpId;
-    map<long int, int> pos38ToAncSnpId;
+    int numSnps;
+    int numRefPops;
+    int numVtxPops;
+    vector<string> refPopNames;      // From the header of the file, e.g., EUR, AFR, ASN, LAT, SAS
+    vector<string> vtxPopNames;      // e.g., vEUR, vAFR, vEAS
+
+    AncSnpLookupTable rsToAncSnpId;
+    AncSnpLookupTable pos37ToAncSnpId;
+    AncSnpLookupTable pos38ToAncSnpId;
+
+    const char *panelData;           // Memory mapped panel file, if the SNPs are loaded from one
+    long panelLen;
+
+    bool SetPopulations(const vector<string>&);
+    void SetVertexExpectedGeneticDists();
+    void SortPositionKeys(const vector<uint64_t>&, int);
+    void SetGenoLogLikelihoods();
 
 public:
     AncestrySnps();
     ~AncestrySnps();
-    vector<AncestrySnp> snps;
-    // For each SNP, keeps the expected genetic distance from the 3 vertices to the 3 ref population
-    double vtxExpGenoDists[numVtxPops][numVtxPops][numAncSnps];
+
+    AncSnpPanelArray<int> snpRsNums;
+    AncSnpPanelArray<int> snpChrs;
+    AncSnpPanelArray<int> snpPos37s;
+    AncSnpPanelArray<int> snpPos38s;
+    AncSnpPanelArray<char> snpRefs;
+    AncSnpPanelArray<char> snpAlts;
+
+    // Allele frequencies, [popId * numSnps + snpId]
+    AncSnpPanelArray<float> refPopAfs;
+    AncSnpPanelArray<float> vtxPopAfs;
+
+    // Expected genetic distance from each vertex to each of the first 3 ref populations, for each SNP,
+    // [(vtxId * numVtxPops + popNo) * numSnps + snpId]
+    AncSnpPanelArray<double> vtxExpGenoDists;
     // Vertex genetic distances summed up using all ancestry SNPs
-    GenoDist vtxPopExpGds[numVtxPops];
+    vector<GenoDist> vtxPopExpGds;
+
+    // Chromosome position keys (chr * 1000000000 + pos) of the ancestry SNPs sorted by GRCh37 ([0]) and GRCh38 ([1])
+    // positions, without duplicates, and the SNP IDs of the keys. Used by AncSnpPosCursor.
+    AncSnpPanelArray<uint64_t> sortedPosKeys[2];
+    AncSnpPanelArray<int> sortedPosSnpIds[2];
 
-    string refPopNames[numRefPops];
+    // Log likelihoods of the genotypes of each SNP in each reference population, calculated once for all samples.
+    // [(snpId * 3 + geno) * numRefPops + popId], geno 0 = RR, 1 = RA, 2 = AA. Bit popId of snpPopValidMasks is set
+    // if the allele frequency of the population is between 0 and 1. Otherwise the log likelihoods are 0.
+    AncSnpPanelArray<double> snpGenoLogLikes;
+    AncSnpPanelArray<uint32_t> snpPopValidMasks;
 
     int ReadAncestrySnpsFromFile(string);
-    int FindSnpIdGivenRs(int);
-    int FindSnpIdGivenChrPos(int, int, int);
-    AncestrySnp GetAncestrySnp(int);
-    void SetVertexExpecteGeneticDists();
-    int GetNumAncestrySnps() { return snps.size(); };
+    bool WritePanelFile(string, string);
+    int ReadPanelFile(string, string);
+    // SNP ID of the ancestry SNP, or -1 if it's not an ancestry SNP
+    int FindSnpIdGivenRs(int rsNum) { return rsNum > 0 ? rsToAncSnpId.Find(rsNum) : -1; };
+    int FindSnpIdGivenChrPos(int chr, int pos, int build) {
+        uint64_t chrPos = uint64_t(chr) * 1000000000 + pos;
+        if (build == 37) return pos37ToAncSnpId.Find(chrPos);
+        if (build == 38) return pos38ToAncSnpId.Find(chrPos);
+        return -1;
+    };
+    int GetNumAncestrySnps() { return numSnps; };
+    int GetNumRefPops() { return numRefPops; };
+    int GetNumVtxPops() { return numVtxPops; };
+    string GetRefPopName(int popId) { return refPopNames[popId]; };
+    const float* GetRefPopAfs(int popId) { return refPopAfs.data + long(popId) * numSnps; };
+    double GetVtxExpGenoDist(int vtxId, int popNo, int snpId) {
+        return vtxExpGenoDists[(long(vtxId) * numVtxPops + popNo) * numSnps + snpId];
+    };
     void ShowAncestrySnps();
 };
 
+// Matches the positions of a genotype file to the ancestry SNPs when the file is sorted by position. A cursor is
+// kept into the ancestry SNPs sorted by the positions of each build, and is moved forward as the file positions
+// increase. Most variants of the file are between two ancestry SNPs, so they're matched with one compare to the
+// key under the cursor, instead of a hash lookup. Going back (e.g., from chromosome 9 to 10 in a file sorted as
+// 1, 10, 11, ..., 2, ...) moves the cursor with a binary search. If the file goes back too often, it's taken as
+// not sorted, and the hash tables of AncestrySnps are used for the rest of the file.
+//
+// A cursor should only be used by one thread, on variants in the order of the file.
+class AncSnpPosCursor
+{
+private:
+    AncestrySnps *ancSnps;
+    long snpNos[2];          // Position of the cursor in sortedPosKeys of each build
+    uint64_t lastKeys[2];
+    long numFinds[2];
+    long numSeeks[2];        // Times the cursor was moved back
+    bool useHash[2];
+
+    long Seek(int, uint64_t);
+
+public:
+    AncSnpPosCursor(AncestrySnps*);
+
+    int FindSnpIdGivenChrPos(int chr, int pos, int build) {
+        if (chr <= 0 || (build != 37 && build != 38)) return -1;
+
+        int b = build == 38 ? 1 : 0;
+        if (useHash[b]) return ancSnps->FindSnpIdGivenChrPos(chr, pos, build);
+
+        uint64_t key = uint64_t(chr) * 1000000000 + pos;
+        const uint64_t *keys = ancSnps->sortedPosKeys[b].data;
+        long snpNo = snpNos[b];
+        numFinds[b]++;
+
+        // sortedPosKeys ends with a key larger than any chromosome position
+        if (key < lastKeys[b] || keys[snpNo] < key) {
+            snpNo = Seek(b, key);
+            if (snpNo < 0) return ancSnps->FindSnpIdGivenChrPos(chr, pos, build);
+        }
+        lastKeys[b] = key;
+
+        return keys[snpNo] == key ? ancSnps->sortedPosSnpIds[b][snpNo] : -1;
+    };
+
+    bool IsSorted() const { return !useHash[0] && !useHash[1]; };
+    long GetNumSeeks() const { return numSeeks[0] + numSeeks[1]; };
+};
+
 #endif
@@ -0,0 +1,491 @@
+#include "BcfSampleAncestrySnpGeno.h"
+
+// Size in bytes of one value of the given type. 0 for the MISSING type, -1 if the type is invalid.
+static inline int GetBcfTypeSize(int type)
+{
+    switch (type) {
+        case 0:               return 0;
+        case BCF_TYPE_INT8:   return 1;
+        case BCF_TYPE_INT16:  return 2;
+        case BCF_TYPE_INT32:  return 4;
+        case BCF_TYPE_FLOAT:  return 4;
+        case BCF_TYPE_CHAR:   return 1;
+    }
+    return -1;
+}
+
+static inline bool IsBcfIntType(int type)
+{
+    return type == BCF_TYPE_INT8 || type == BCF_TYPE_INT16 || type == BCF_TYPE_INT32;
+}
+
+// BCF values are little-endian
+static inline uint32_t ReadBcfUint32(const uint8_t *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline int ReadBcfInt(const uint8_t *p, int type)
+{
+    if (type == BCF_TYPE_INT8) return int8_t(p[0]);
+    if (type == BCF_TYPE_INT16) return int16_t(uint16_t(p[0]) | (uint16_t(p[1]) << 8));
+    return int32_t(ReadBcfUint32(p));
+}
+
+// Reads the descriptor byte of a typed value, followed by a typed integer count if the count is 15 or more.
+// Returns the position of the values, or NULL if the data is truncated or invalid.
+static const uint8_t* ReadTypeDescriptor(const uint8_t *p, const uint8_t *end, int *type, int *count)
+{
+    if (p >= end) return NULL;
+
+    *type = p[0] & 0x0F;
+    *count = p[0] >> 4;
+    p++;
+    if (GetBcfTypeSize(*type) < 0) return NULL;
+
+    if (*count == 15) {
+        if (p >= end) return NULL;
+        int cntType = p[0] & 0x0F;
+        if ((p[0] >> 4) != 1 || !IsBcfIntType(cntType) || end - p < 1 + GetBcfTypeSize(cntType)) return NULL;
+
+        *count = ReadBcfInt(p + 1, cntType);
+        p += 1 + GetBcfTypeSize(cntType);
+        if (*count < 0) return NULL;
+    }
+
+    return p;
+}
+
+// Value of an attribute in a structured header line, e.g., ID in ##contig=<ID=1,length=249250621>
+static string GetHeaderAttribute(const string& line, const string& key)
+{
+    size_t keyPos = line.find("<" + key + "=");
+    if (keyPos == string::npos) keyPos = line.find("," + key + "=");
+    if (keyPos == string::npos) return "";
+
+    size_t valStart = keyPos + key.length() + 2;
+    size_t valEnd = line.find_first_of(",>", valStart);
+    if (valEnd == string::npos) valEnd = line.length();
+
+    return line.substr(valStart, valEnd - valStart);
+}
+
+BcfSampleAncestrySnpGeno::BcfSampleAncestrySnpGeno(string file, AncestrySnps *aSnps)
+: VcfSampleAncestrySnpGeno(file, aSnps), posCursor(aSnps)
+{
+    contigNames = {};
+    contigChrs = {};
+    gtKey = -1;
+    skipBytes = 0;
+    numSkippedRecs = 0;
+    skippedIndivBytes = 0;
+    gtBytes = 0;
+    dataBytes = 0;
+    readSecs = 0;
+    recordGenos = {};
+}
+
+bool BcfSampleAncestrySnpGeno::ReadDataFromFile()
+{
+    cout << "Reading data from BCF file " << vcfFile << "\n";
+    BgzfReader reader(vcfFile, numThreads);
+    if (!reader.Open()) {
+        cout << "\nERROR: Couldn't open file " << vcfFile << "\n";
+        return false;
+    }
+    if (reader.IsBgzf()) cout << "\tFile is BGZF compressed. Decompressing blocks with " << numThreads << " threads\n";
+
+    // Record offsets are not saved. The per-sample data of the other records is skipped quickly in each pass.
+    saveLineOffsets = false;
+
+    vcfLineNo = 0;
+    hasHeadRow = false;
+    skipBytes = 0;
+    posCursor = AncSnpPosCursor(ancSnps);
+
+    vector<char> recBuffer;   // The header, and records that span two or more chunks, are assembled here
+    bool readOk = true;
+    double t1 = GetWallSeconds();
+
+    while (readOk) {
+        const char *buffer;
+        int bytesRead = reader.ReadChunk(&buffer);
+        if (bytesRead < 0) readOk = false;
+        if (bytesRead <= 0) break;
+
+        dataBytes += bytesRead;
+        const char *buffPos = buffer;
+        long buffLen = bytesRead;
+
+        if (skipBytes > 0) {
+            long skipLen = skipBytes < buffLen ? skipBytes : buffLen;
+            buffPos += skipLen;
+            buffLen -= skipLen;
+            skipBytes -= skipLen;
+        }
+
+        // Records that are complete in the chunk are parsed in place
+        if (recBuffer.empty()) {
+            long usedBytes = ParseData(buffPos, buffLen);
+            if (usedBytes < 0) readOk = false;
+            else recBuffer.assign(buffPos + usedBytes, buffPos + buffLen);
+        }
+        else {
+            recBuffer.insert(recBuffer.end(), buffPos, buffPos + buffLen);
+            long usedBytes = ParseData(&recBuffer[0], recBuffer.size());
+            if (usedBytes < 0) readOk = false;
+            else recBuffer.erase(recBuffer.begin(), recBuffer.begin() + usedBytes);
+        }
+    }
+
+    readSecs = GetWallSeconds() - t1;
+    if (!posCursor.IsSorted()) posIsSorted = false;
+
+    if (readOk && !hasHeadRow) {
+        cout << "\nERROR: didn't find the header of BCF file " << vcfFile << "\n";
+        readOk = false;
+    }
+    else if (readOk && (!recBuffer.empty() || skipBytes > 0)) {
+        cout << "\nERROR: BCF file " << vcfFile << " is truncated after record #" << vcfLineNo << "\n";
+        readOk = false;
+    }
+
+    if (!readOk) return false;
+
+    cout << "Done. Checked " << vcfLineNo << " records. Found " << putativeAncSnps << " records with ancestry SNPs\n";
+    reader.ShowSummary();
+    reader.Close();
+
+    return true;
+}
+
+// Parses the header and the complete records at the start of the data. Returns the number of bytes used,
+// or -1 if there is an error. If the rest of a record is not needed, it is skipped in the next chunks.
+long BcfSampleAncestrySnpGeno::ParseData(const char *data, long dataLen)
+{
+    const uint8_t *dataStart = (const uint8_t*)data;
+    const uint8_t *dataEnd = dataStart + dataLen;
+    const uint8_t *p = dataStart;
+
+    if (!hasHeadRow) {
+        // Magic "BCF", major version 2, minor version, length of the header text, then the text
+        if (dataLen < 9) return 0;
+        if (memcmp(data, "BCF\2", 4) != 0) {
+            cout << "\nERROR: " << vcfFile << " is not a BCF version 2 file\n";
+            return -1;
+        }
+
+        uint32_t textLen = ReadBcfUint32(p + 5);
+        if (dataLen < 9L + textLen) return 0;
+        if (!ReadHeader(data + 9, data + 9 + textLen)) return -1;
+        p += 9L + textLen;
+    }
+
+    while (dataEnd - p >= 8) {
+        uint32_t sharedLen = ReadBcfUint32(p);
+        uint32_t indivLen = ReadBcfUint32(p + 4);
+        long recLen = 8L + sharedLen + indivLen;
+
+        if (dataEnd - p >= recLen) {
+            if (!ParseRecord(p + 8, sharedLen, indivLen)) return -1;
+            p += recLen;
+            continue;
+        }
+
+        // Skip the rest of a long record as soon as the shared fields show that it is not an ancestry SNP
+        if (dataEnd - p >= 8L + sharedLen) {
+            int rsSnpId, gb37SnpId, gb38SnpId;
+            if (CheckSharedFields(p + 8, p + 8 + sharedLen, &rsSnpId, &gb37SnpId, &gb38SnpId) == 0) {
+                CountRecord();
+                numSkippedRecs++;
+                skippedIndivBytes += indivLen;
+                skipBytes = recLen - (dataEnd - p);
+                p = dataEnd;
+            }
+        }
+        break;
+    }
+
+    return p - dataStart;
+}
+
+void BcfSampleAncestrySnpGeno::CountRecord()
+{
+    vcfLineNo++;
+    totVcfSnps++;
+    if (vcfLineNo % 1000000 == 0) {
+        cout << "\tChecked " << vcfLineNo << " records. Found " << putativeAncSnps << " records with ancestry SNPs\n";
+    }
+}
+
+// Gets the samples, the contig dictionary, and the index of GT in the string dictionary of FILTER, INFO
+// and FORMAT IDs. PASS is always the first string. IDX attributes, if any, give the indices explicitly.
+bool BcfSampleAncestrySnpGeno::ReadHeader(const char *text, const char *textEnd)
+{
+    const char *nulPos = (const char*)memchr(text, '\0', textEnd - text);
+    if (nulPos) textEnd = nulPos;
+
+    vector<string> dictStrs = {"PASS"};
+
+    const char *line = text;
+    while (line < textEnd) {
+        const char *lineEnd = (const char*)memchr(line, '\n', textEnd - line);
+        if (!lineEnd) lineEnd = textEnd;
+        const char *nextLine = lineEnd + 1;
+        if (lineEnd > line && lineEnd[-1] == '\r') lineEnd--;
+
+        if (lineEnd - line >= 6 && strncmp(line, "#CHROM", 6) == 0) {
+            if (!ReadHeaderRow(line, lineEnd)) return false;
+        }
+        else if (lineEnd - line > 2 && line[0] == '#' && line[1] == '#') {
+            string headLine = string(line, lineEnd - line);
+            bool isContig = headLine.compare(0, 10, "##contig=<") == 0;
+            bool isDictStr = headLine.compare(0, 8, "##INFO=<") == 0 ||
+                             headLine.compare(0, 10, "##FILTER=<") == 0 ||
+                             headLine.compare(0, 10, "##FORMAT=<") == 0;
+
+            if (isContig || isDictStr) {
+                string id = GetHeaderAttribute(headLine, "ID");
+                string idxStr = GetHeaderAttribute(headLine, "IDX");
+                int idx = idxStr == "" ? -1 : atoi(idxStr.c_str());
+
+                vector<string>& dict = isContig ? contigNames : dictStrs;
+                if (idx > -1) {
+                    if (idx >= dict.size()) dict.resize(idx + 1);
+                    dict[idx] = id;
+                }
+                else if (isContig || find(dict.begin(), dict.end(), id) == dict.end()) {
+                    dict.push_back(id);
+                }
+            }
+        }
+
+        line = nextLine;
+    }
+
+    if (!hasHeadRow) {
+        cout << "\nERROR: didn't find #CHROM row in the header of BCF file " << vcfFile << "\n";
+        return false;
+    }
+
+    for (int i = 0; i < dictStrs.size(); i++) {
+        if (dictStrs[i] == "GT") gtKey = i;
+    }
+    if (gtKey < 0) {
+        cout << "\nERROR: FORMAT field GT is not defined in the header of BCF file " << vcfFile << "\n";
+        return false;
+    }
+
+    for (int i = 0; i < contigNames.size(); i++) contigChrs.push_back(GetChromosomeFromString(contigNames[i].c_str()));
+
+    return true;
+}
+
+// Finds ancestry SNP IDs using the CHROM, POS and ID fields at the start of the shared data.
+// Returns -1 if these fields are invalid, 1 if any of the IDs is found, otherwise 0.
+int BcfSampleAncestrySnpGeno::CheckSharedFields(const uint8_t *shared, const uint8_t *sharedEnd,
+int *rsSnpId, int *gb37SnpId, int *gb38SnpId)
+{
+    if (sharedEnd - shared < BCF_SHARED_START) return -1;
+
+    int contigNo = int32_t(ReadBcfUint32(shared));
+    int pos = int32_t(ReadBcfUint32(shared + 4)) + 1;   // POS is 0-based in BCF
+    int chr = contigNo > -1 && contigNo < contigChrs.size() ? contigChrs[contigNo] : 0;
+    if (pos < 1 || pos > 300000000) pos = 0;
+
+    int idType, idLen;
+    const uint8_t *id = ReadTypeDescriptor(shared + BCF_SHARED_START, sharedEnd, &idType, &idLen);
+    if (!id || (idLen > 0 && idType != BCF_TYPE_CHAR) || sharedEnd - id < idLen) return -1;
+    const uint8_t *idNul = (const uint8_t*)memchr(id, '\0', idLen);
+    if (idNul) idLen = idNul - id;
+
+    int rsNum = GetRsNumFromString((const char*)id, idLen);
+
+    *rsSnpId = ancSnps->FindSnpIdGivenRs(rsNum);
+    *gb37SnpId = posCursor.FindSnpIdGivenChrPos(chr, pos, 37);
+    *gb38SnpId = posCursor.FindSnpIdGivenChrPos(chr, pos, 38);
+
+    return *rsSnpId > -1 || *gb37SnpId > -1 || *gb38SnpId > -1 ? 1 : 0;
+}
+
+// Chromosome, position and ID of a record, for error messages
+string BcfSampleAncestrySnpGeno::GetRecordDesc(const uint8_t *shared, const uint8_t *sharedEnd)
+{
+    int contigNo = int32_t(ReadBcfUint32(shared));
+    int pos = int32_t(ReadBcfUint32(shared + 4)) + 1;
+
+    string chrStr = contigNo > -1 && contigNo < contigNames.size() ? contigNames[contigNo] : to_string(contigNo);
+    string snpStr = ".";
+
+    int idType, idLen;
+    const uint8_t *id = ReadTypeDescriptor(shared + BCF_SHARED_START, sharedEnd, &idType, &idLen);
+    if (id && idLen > 0 && sharedEnd - id >= idLen) snpStr = string((const char*)id, strnlen((const char*)id, idLen));
+
+    return "chr " + chrStr + ", pos " + to_string(pos) + ", snp " + snpStr;
+}
+
+// Checks the site fields first. Only reads the alleles and the GT vector of the records with ancestry SNPs.
+bool BcfSampleAncestrySnpGeno::ParseRecord(const uint8_t *shared, uint32_t sharedLen, uint32_t indivLen)
+{
+    CountRecord();
+
+    const uint8_t *sharedEnd = shared + sharedLen;
+    const uint8_t *indiv = sharedEnd;
+    const uint8_t *indivEnd = indiv + indivLen;
+
+    int rsSnpId, gb37SnpId, gb38SnpId;
+    int check = CheckSharedFields(shared, sharedEnd, &rsSnpId, &gb37SnpId, &gb38SnpId);
+    if (check < 0) {
+        cout << "\nERROR at record #" << vcfLineNo << ": invalid CHROM, POS or ID field\n";
+        return false;
+    }
+    if (check == 0) {
+        numSkippedRecs++;
+        skippedIndivBytes += indivLen;
+        return true;
+    }
+
+    int numAlleles = ReadBcfUint32(shared + 16) >> 16;
+    uint32_t fmtSample = ReadBcfUint32(shared + 20);
+    int numFmts = fmtSample >> 24;
+    int numRecSmps = fmtSample & 0xFFFFFF;
+
+    if (numRecSmps != numFileSamples) {
+        cout << "\nERROR at record #" << vcfLineNo << ": " << GetRecordDesc(shared, sharedEnd) << ". #genotypes ("
+             << numRecSmps << ") is different from #samples (" << numFileSamples << ").\n";
+        return false;
+    }
+
+    // Skip the ID, which has been checked, then read the alleles as REF and comma-separated ALT strings
+    int type, count;
+    const uint8_t *p = ReadTypeDescriptor(shared + BCF_SHARED_START, sharedEnd, &type, &count);
+    p += count;
+
+    string vcfRef = "";
+    string vcfAlt = numAlleles > 1 ? "" : ".";
+    for (int alleleNo = 0; alleleNo < numAlleles; alleleNo++) {
+        p = ReadTypeDescriptor(p, sharedEnd, &type, &count);
+        if (!p || (count > 0 && type != BCF_TYPE_CHAR) || sharedEnd - p < count) {
+            cout << "\nERROR at record #" << vcfLineNo << ": " << GetRecordDesc(shared, sharedEnd) << ". Invalid alleles\n";
+            return false;
+        }
+
+        string allele = string((const char*)p, strnlen((const char*)p, count));
+        if (alleleNo == 0) {
+            vcfRef = allele;
+        }
+        else {
+            if (alleleNo > 1) vcfAlt += ",";
+            vcfAlt += allele;
+        }
+        p += count;
+    }
+
+    // Find the GT vector. Each FORMAT field is a typed integer key, then one typed vector per sample.
+    const uint8_t *gtData = NULL;
+    int gtType = 0, ploidy = 0;
+    p = indiv;
+
+    for (int fmtNo = 0; fmtNo < numFmts; fmtNo++) {
+        int keyType, keyCount;
+        p = ReadTypeDescriptor(p, indivEnd, &keyType, &keyCount);
+        bool fmtOk = p && keyCount == 1 && IsBcfIntType(keyType) && indivEnd - p >= GetBcfTypeSize(keyType);
+
+        int key = -1;
+        long valBytes = 0;
+        if (fmtOk) {
+            key = ReadBcfInt(p, keyType);
+            p = ReadTypeDescriptor(p + GetBcfTypeSize(keyType), indivEnd, &type, &count);
+            if (p) valBytes = long(GetBcfTypeSize(type)) * count * numFileSamples;
+            fmtOk = p && indivEnd - p >= valBytes;
+        }
+
+        if (!fmtOk) {
+            cout << "\nERROR at record #" << vcfLineNo << ": " << GetRecordDesc(shared, sharedEnd)
+                 << ". Invalid FORMAT fields\n";
+            return false;
+        }
+
+        if (key == gtKey) {
+            gtData = p;
+            gtType = type;
+            ploidy = count;
+            break;
+        }
+        p += valBytes;
+    }
+
+    // Records without GT are not used, as with vcf lines
+    if (!gtData) return true;
+
+    VcfPutativeSnp putSnp;
+    int expRefIdxs[NUM_SNP_ID_TYPES];
+    int expAltIdxs[NUM_SNP_ID_TYPES];
+    SetPutativeSnpRows(&putSnp, rsSnpId, gb37SnpId, gb38SnpId, vcfRef, vcfAlt, expRefIdxs, expAltIdxs);
+
+    for (int typeNo = 0; typeNo < NUM_SNP_ID_TYPES; typeNo++) {
+        if (!OwnsPutativeSnpRow(putSnp, typeNo)) continue;
+        if (recordGenos.size() < numSamples) recordGenos.resize(numSamples);
+        DecodeGtVectors(gtData, gtType, ploidy, expRefIdxs[typeNo], expAltIdxs[typeNo], &recordGenos[0]);
+        vcfAncSnpGenos.PackRow(&recordGenos[0], putSnp.codedGenos[typeNo]);
+        gtBytes += long(GetBcfTypeSize(gtType)) * ploidy * numSamples;
+    }
+
+    AddPutativeSnp(putSnp);
+
+    return true;
+}
+
+// Decodes the GT vectors of all samples into the number of expected alt alleles, i.e.,
+// 0 = RR, 1 = RA, 2 = AA, 3 = unknown. Each value is (allele index + 1) << 1 | phased, and 0 is missing.
+// Missing values, and the end-of-vector values padding haploid calls, give negative allele indices.
+// As with vcf lines, only the first two alleles are used, and haploid calls are unknown.
+// With keep/remove lists, only the vectors of the selected samples are read.
+void BcfSampleAncestrySnpGeno::DecodeGtVectors(const uint8_t *gtData, const int gtType, const int ploidy,
+const int expRefIdx, const int expAltIdx, char *smpGenos)
+{
+    if (ploidy < 2 || !IsBcfIntType(gtType)) {
+        memset(smpGenos, 3, numSamples);
+        return;
+    }
+
+    int typeSize = GetBcfTypeSize(gtType);
+    long stride = long(typeSize) * ploidy;
+    const int *smpNos = selSmpNos.empty() ? NULL : &selSmpNos[0];
+
+    if (gtType == BCF_TYPE_INT8 && expRefIdx < 63 && expAltIdx < 63) {
+        // Compare the bytes with the phase bit cleared to the values of the expected alleles
+        const uint8_t refVal = (expRefIdx + 1) << 1;
+        const uint8_t altVal = (expAltIdx + 1) << 1;
+
+        for (int smpNo = 0; smpNo < numSamples; smpNo++) {
+            const uint8_t *p = gtData + (smpNos ? smpNos[smpNo] : smpNo) * stride;
+            uint8_t g1 = p[0] & 0xFE;
+            uint8_t g2 = p[1] & 0xFE;
+            bool isValid = (g1 == refVal || g1 == altVal) && (g2 == refVal || g2 == altVal);
+            smpGenos[smpNo] = isValid ? (g1 == altVal) + (g2 == altVal) : 3;
+        }
+    }
+    else {
+        for (int smpNo = 0; smpNo < numSamples; smpNo++) {
+            const uint8_t *p = gtData + (smpNos ? smpNos[smpNo] : smpNo) * stride;
+            int g1Num = (ReadBcfInt(p, gtType) >> 1) - 1;
+            int g2Num = (ReadBcfInt(p + typeSize, gtType) >> 1) - 1;
+            smpGenos[smpNo] = VcfGtTokenizer::CodeGenotype(expRefIdx, expAltIdx, g1Num, g2Num);
+        }
+    }
+}
+
+void BcfSampleAncestrySnpGeno::ShowSummary()
+{
+    VcfSampleAncestrySnpGeno::ShowSummary();
+
+    cout << "\nSkipped the per-sample data of " << numSkippedRecs << " records without ancestry SNPs ("
+         << long(skippedIndivBytes / 1048576.0) << " MB)\n";
+
+    cout << "Decoded " << long(gtBytes / 1048576.0) << " MB of GT vectors\n";
+
+    printf("Read and parsed %ld MB of BCF data in %.2f seconds", long(dataBytes / 1048576.0), readSecs);
+    if (readSecs > 0) printf(", %.1f MB/second", dataBytes / 1048576.0 / readSecs);
+    printf("\n");
+}
@@ -0,0 +1,49 @@
+#ifndef BCF_SAMPLE_ANCESTRY_SNP_GENO_H
+#define BCF_SAMPLE_ANCESTRY_SNP_GENO_H
+
+#include "VcfSampleAncestrySnpGeno.h"
+
+#define BCF_SHARED_START 24   // Typed fields start after CHROM, POS, rlen, QUAL, n_allele_info and n_fmt_sample
+
+// Types of the typed values in BCF records
+#define BCF_TYPE_INT8  1
+#define BCF_TYPE_INT16 2
+#define BCF_TYPE_INT32 3
+#define BCF_TYPE_FLOAT 5
+#define BCF_TYPE_CHAR  7
+
+// Reads genotypes from a BCF (binary vcf, version 2) file. Each record is checked using the binary CHROM,
+// POS and ID fields first, and the per-sample data of the records without ancestry SNPs are skipped without
+// being parsed. GT vectors of the other records are decoded from the binary integers straight into the
+// coded genotype rows. The putative SNPs are kept the same way as for vcf files.
+class BcfSampleAncestrySnpGeno : public VcfSampleAncestrySnpGeno
+{
+private:
+    vector<string> contigNames;  // Contig dictionary of the header
+    vector<int> contigChrs;      // Chromosome number of each contig, 0 if not 1-23
+    int gtKey;                   // Index of GT in the header string dictionary
+    long skipBytes;              // Bytes of the current record still to be skipped in the next chunks
+    long numSkippedRecs;         // Records whose per-sample data was skipped
+    long skippedIndivBytes;
+    long gtBytes;                // Bytes of GT vectors decoded
+    long dataBytes;              // Bytes of decompressed data, and the time used to read and parse them
+    double readSecs;
+    vector<char> recordGenos;    // Genotype codes of one record, before they are packed
+    AncSnpPosCursor posCursor;
+
+    long ParseData(const char*, long);
+    void CountRecord();
+    bool ReadHeader(const char*, const char*);
+    int CheckSharedFields(const uint8_t*, const uint8_t*, int*, int*, int*);
+    bool ParseRecord(const uint8_t*, uint32_t, uint32_t);
+    string GetRecordDesc(const uint8_t*, const uint8_t*);
+    void DecodeGtVectors(const uint8_t*, const int, const int, const int, const int, char*);
+
+public:
+    BcfSampleAncestrySnpGeno(string, AncestrySnps*);
+
+    bool ReadDataFromFile();
+    void ShowSummary();
+};
+
+#endif
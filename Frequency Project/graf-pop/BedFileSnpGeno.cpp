@@ -1,5 +1,55 @@
 #include "BedFileSnpGeno.h"
 
+#if defined(__x86_64__)
+#define BED_X86_BMI2
+#define BED_X86_AVX2
+#include <immintrin.h>
+#endif
+
+// PEXT (BMI2) extracts the bits of the selected samples from a 64-bit word in one instruction
+static bool DetectBmi2()
+{
+#ifdef BED_X86_BMI2
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2");
+#endif
+    return false;
+}
+
+// AVX2 expands 32 bytes of a SNP row (128 samples) at a time
+static bool DetectAvx2()
+{
+#ifdef BED_X86_AVX2
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+    return false;
+}
+
+static const bool hasBmi2 = DetectBmi2();
+static bool useAvx2 = DetectAvx2();
+
+// Genotype code of each 2-bit value in the bed file: 00 = AA, 01 = missing, 10 = AB, 11 = BB
+static const char bedGenoCodes[4] = {0, 3, 1, 2};
+static const char bedSwapCodes[4] = {2, 3, 1, 0};
+
+// The 4 genotype codes of each byte of a SNP row, in the order of the samples
+struct BedByteTable
+{
+    uint32_t genos[256];
+
+    BedByteTable(const char *codes) {
+        for (int b = 0; b < 256; b++) {
+            char byteGenos[4];
+            for (int i = 0; i < 4; i++) byteGenos[i] = codes[(b >> (i * 2)) & 3];
+            memcpy(&genos[b], byteGenos, 4);
+        }
+    }
+};
+
+static const BedByteTable bedByteTable(bedGenoCodes);
+static const BedByteTable bedSwapByteTable(bedSwapCodes);
+
 BedFileSnpGeno::BedFileSnpGeno(string bFile, AncestrySnps *aSnps, BimFileAncestrySnps *bSnps, FamFileSamples *fSmps)
 {
     bedFile = bFile;
@@ -7,18 +57,18 @@ BedFileSnpGeno::BedFileSnpGeno(string bFile, AncestrySnps *aSnps, BimFileAncestr
     bimSnps = bSnps;
     famSmps = fSmps;
 
-    unsigned long base = 1;
-    for (int i = 0; i < 64; i++) {
-        baseNums[i] = base;
-        base = base << 1;
-    }
-
     numAncSnps = ancSnps->GetNumAncestrySnps();
     numBimSnps = bimSnps->GetNumBimSnps();
     numBimAncSnps = bimSnps->GetNumBimAncestrySnps();
     numSamples = famSmps->GetNumFamSamples();
+    numSelSmps = famSmps->GetNumSelSamples();
+    SetSelectedWords();
+
+    numDecodedGenos = 0;
+    decodeSecs = 0;
+    numThreads = 1;
 
-    ancSnpSmpGenos = {};
+    ancSnpGenos.SetNumSamples(numSelSmps);
     ancSnpSnpIds = {};
 
     vtxExpGd0 = new SampleGenoDist(&aSnps->vtxPopExpGds[0], &aSnps->vtxPopExpGds[1],
@@ -29,10 +79,7 @@ BedFileSnpGeno::BedFileSnpGeno(string bFile, AncestrySnps *aSnps, BimFileAncestr
 
 BedFileSnpGeno::~BedFileSnpGeno()
 {
-    for (int i = 0; i < ancSnpSmpGenos.size(); i++) {
-        delete ancSnpSmpGenos[i];
-    }
-    ancSnpSmpGenos.clear();
+    ancSnpGenos.DeleteRows();
     ancSnpSnpIds.clear();
 }
 
@@ -47,112 +94,619 @@ char BedFileSnpGeno::GetCompAllele(char a)
     return c;
 }
 
-char* BedFileSnpGeno::RecodeBedSnpGeno(char *snpBedGenos, int numBytes, bool swap)
+// Finds the byte range of the selected samples, and the bit masks of the selected samples in each 64-bit word
+// of the range
+void BedFileSnpGeno::SetSelectedWords()
+{
+    selWords.clear();
+    const vector<int>& selSmpNos = famSmps->selSmpNos;
+
+    rangeStartByte = 0;
+    rangeNumBytes = (numSamples - 1) / 4 + 1;
+    if (selSmpNos.empty()) return;
+
+    rangeStartByte = selSmpNos.front() / 4;
+    rangeNumBytes = selSmpNos.back() / 4 - rangeStartByte + 1;
+    int rangeStartSmp = rangeStartByte * 4;
+
+    for (int i = 0; i < selSmpNos.size(); i++) {
+        int smpNo = selSmpNos[i] - rangeStartSmp;
+        int wordNo = smpNo / 32;
+        if (selWords.empty() || selWords.back().wordNo != wordNo) {
+            BedSelectedWord selWord = {wordNo, 0, 0};
+            selWords.push_back(selWord);
+        }
+
+        selWords.back().mask |= uint64_t(3) << (smpNo % 32 * 2);
+        selWords.back().numSmps++;
+    }
+}
+
+#ifdef BED_X86_BMI2
+__attribute__((target("bmi2")))
+static void GatherGenosBmi2(const char *bedGenos, const vector<BedSelectedWord>& selWords, const char *codes,
+char *smpGenos)
+{
+    char *geno = smpGenos;
+
+    for (int i = 0; i < selWords.size(); i++) {
+        uint64_t word;
+        memcpy(&word, bedGenos + selWords[i].wordNo * 8L, 8);
+        uint64_t smpBits = _pext_u64(word, selWords[i].mask);
+
+        for (int j = 0; j < selWords[i].numSmps; j++, smpBits >>= 2) *geno++ = codes[smpBits & 3];
+    }
+}
+#endif
+
+// Gets the genotypes of the selected samples only. snpBedGenos starts from rangeStartByte of the SNP,
+// and should be padded to whole 64-bit words.
+void BedFileSnpGeno::GatherSelectedBedSnpGeno(const char *snpBedGenos, bool swap, char *snpGenos)
+{
+    const char *codes = swap ? bedSwapCodes : bedGenoCodes;
+
+#ifdef BED_X86_BMI2
+    if (hasBmi2) {
+        GatherGenosBmi2(snpBedGenos, selWords, codes, snpGenos);
+        return;
+    }
+#endif
+
+    const vector<int>& selSmpNos = famSmps->selSmpNos;
+    for (int i = 0; i < numSelSmps; i++) {
+        int smpNo = selSmpNos[i] - rangeStartByte * 4;
+        snpGenos[i] = codes[(uint8_t(snpBedGenos[smpNo / 4]) >> (smpNo % 4 * 2)) & 3];
+    }
+}
+
+#ifdef BED_X86_AVX2
+// Expands numBlocks blocks of 32 bytes into 128 genotype codes each. The four 2-bit fields of the bytes are
+// separated by shifts and masks, mapped to the genotype codes with a byte shuffle, then interleaved back into
+// the order of the samples. Unpacking works within the 128-bit lanes, so the lanes are put in order at the end.
+__attribute__((target("avx2")))
+static void ExpandBedBytesAvx2(const char *snpBedGenos, int numBlocks, const char *codes, char *snpGenos)
+{
+    const __m256i lowBits = _mm256_set1_epi8(3);
+    const __m256i codeLut = _mm256_setr_epi8(codes[0], codes[1], codes[2], codes[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             codes[0], codes[1], codes[2], codes[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    for (int blockNo = 0; blockNo < numBlocks; blockNo++) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(snpBedGenos + blockNo * 32));
+
+        __m256i g0 = _mm256_shuffle_epi8(codeLut, _mm256_and_si256(bytes, lowBits));
+        __m256i g1 = _mm256_shuffle_epi8(codeLut, _mm256_and_si256(_mm256_srli_epi16(bytes, 2), lowBits));
+        __m256i g2 = _mm256_shuffle_epi8(codeLut, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), lowBits));
+        __m256i g3 = _mm256_shuffle_epi8(codeLut, _mm256_and_si256(_mm256_srli_epi16(bytes, 6), lowBits));
+
+        __m256i g01Lo = _mm256_unpacklo_epi8(g0, g1);
+        __m256i g01Hi = _mm256_unpackhi_epi8(g0, g1);
+        __m256i g23Lo = _mm256_unpacklo_epi8(g2, g3);
+        __m256i g23Hi = _mm256_unpackhi_epi8(g2, g3);
+
+        __m256i q0 = _mm256_unpacklo_epi16(g01Lo, g23Lo);   // Bytes 0-3 in the low lane, 16-19 in the high lane
+        __m256i q1 = _mm256_unpackhi_epi16(g01Lo, g23Lo);   // Bytes 4-7, 20-23
+        __m256i q2 = _mm256_unpacklo_epi16(g01Hi, g23Hi);   // Bytes 8-11, 24-27
+        __m256i q3 = _mm256_unpackhi_epi16(g01Hi, g23Hi);   // Bytes 12-15, 28-31
+
+        __m256i *out = (__m256i*)(snpGenos + blockNo * 128);
+        _mm256_storeu_si256(out,     _mm256_permute2x128_si256(q0, q1, 0x20));
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+        _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+        _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+    }
+}
+#endif
+
+// Uses the AVX2 decoder of SNP rows if useAvx2 is true and the CPU has AVX2, or the lookup table otherwise, e.g.,
+// to compare them in grafpop-bench. Returns whether AVX2 is used.
+bool BedFileSnpGeno::SetUseAvx2(bool avx2)
+{
+    useAvx2 = avx2 && DetectAvx2();
+    return useAvx2;
+}
+
+// Decodes all the samples of a SNP row, 4 genotypes per byte from a lookup table, or 128 genotypes at a time with AVX2
+void BedFileSnpGeno::DecodeBedRow(const char *snpBedGenos, int numSamples, bool swap, char *snpGenos)
 {
-    char *snpGenos = new char[numSamples]; // char only takes one byte
-    for (int i = 0; i < numSamples; i++) snpGenos[i] = 3;
+    const uint32_t *byteGenos = swap ? bedSwapByteTable.genos : bedByteTable.genos;
 
-    int smpNo = 0;
+    int numFullBytes = numSamples / 4;
     int byteNo = 0;
 
-    for (byteNo = 0; byteNo < numBytes; byteNo++) {
-        char genoByte = snpBedGenos[byteNo];
-        int val = int(genoByte);
+#ifdef BED_X86_AVX2
+    if (useAvx2) {
+        int numBlocks = numFullBytes / 32;
+        ExpandBedBytesAvx2(snpBedGenos, numBlocks, swap ? bedSwapCodes : bedGenoCodes, snpGenos);
+        byteNo = numBlocks * 32;
+    }
+#endif
+
+    for (; byteNo < numFullBytes; byteNo++) {
+        memcpy(snpGenos + byteNo * 4, &byteGenos[uint8_t(snpBedGenos[byteNo])], 4);
+    }
+
+    // The last byte might be partly filled
+    for (int smpNo = numFullBytes * 4; smpNo < numSamples; smpNo++) {
+        snpGenos[smpNo] = ((const char*)&byteGenos[uint8_t(snpBedGenos[byteNo])])[smpNo % 4];
+    }
+}
+
+void BedFileSnpGeno::RecodeBedSnpGeno(const char *snpBedGenos, bool swap, char *snpGenos)
+{
+    double t1 = GetWallSeconds();
+    DecodeBedRow(snpBedGenos, numSamples, swap, snpGenos);
+    decodeSecs += GetWallSeconds() - t1;
+    numDecodedGenos += numSamples;
+}
+
+// Tells the kernel which pages of the next rows will be needed. Rows in the same or adjacent pages are merged.
+void BedFileSnpGeno::AdviseRows(const char *bedData, const vector<int>& bimPoses, int firstRowNo, long snpNumBytes)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    long advStart = -1, advEnd = -1;
+
+    int lastRowNo = min(firstRowNo + BED_PREFETCH_ROWS, int(bimPoses.size()));
+    for (int rowNo = firstRowNo; rowNo < lastRowNo; rowNo++) {
+        long rowStart = 3 + bimPoses[rowNo] * snpNumBytes + rangeStartByte;
+        long pageStart = rowStart / pageSize * pageSize;
+        long pageEnd = rowStart + rangeNumBytes;
+
+        if (advEnd >= pageStart) {
+            advEnd = pageEnd;
+            continue;
+        }
 
-        for (int byteSmpNo = 0; byteSmpNo < 4; byteSmpNo++) {
-            int bit1Pos = byteSmpNo * 2;
-            int bit2Pos = bit1Pos + 1;;
+        if (advStart > -1) madvise((void*)(bedData + advStart), advEnd - advStart, MADV_WILLNEED);
+        advStart = pageStart;
+        advEnd = pageEnd;
+    }
 
-            int bit1 = genoByte & baseNums[bit1Pos];
-            int bit2 = genoByte & baseNums[bit2Pos];
+    if (advStart > -1) madvise((void*)(bedData + advStart), advEnd - advStart, MADV_WILLNEED);
+}
 
-            int intGeno = 3;
-            if      ( bit1 &&  bit2) intGeno = 2;
-            else if (!bit1 &&  bit2) intGeno = 1;
-            else if (!bit1 && !bit2) intGeno = 0;
+// Moves the even bits of a word to the low 32 bits, and the odd bits to the high 32 bits
+static uint64_t SplitEvenOddBits(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 1))  & 0x2222222222222222ULL; x ^= t ^ (t << 1);
+    t = (x ^ (x >> 2))  & 0x0C0C0C0C0C0C0C0CULL; x ^= t ^ (t << 2);
+    t = (x ^ (x >> 4))  & 0x00F000F000F000F0ULL; x ^= t ^ (t << 4);
+    t = (x ^ (x >> 8))  & 0x0000FF000000FF00ULL; x ^= t ^ (t << 8);
+    t = (x ^ (x >> 16)) & 0x00000000FFFF0000ULL; x ^= t ^ (t << 16);
+
+    return x;
+}
+
+// Reads the 16 bytes of a tile from a sample row, and prefetches the tiles further on in the row.
+// The last tile of a row might be shorter.
+static inline void LoadTileWords(const uint8_t *tileBytes, long tileNumBytes, uint64_t *words)
+{
+    words[0] = words[1] = 0;
+    if (tileNumBytes == 16) memcpy(words, tileBytes, 16);
+    else memcpy(words, tileBytes, tileNumBytes);
+    __builtin_prefetch(tileBytes + BED_TILE_PREFETCH);
+}
+
+#ifdef BED_X86_BMI2
+__attribute__((target("bmi2")))
+static void SplitTileBitsBmi2(const uint8_t **smpRows, int numSmps, long tileStart, long tileNumBytes,
+uint64_t *lowBits, uint64_t *highBits)
+{
+    const uint64_t evenBits = 0x5555555555555555ULL;
+
+    for (int i = 0; i < GENO_WORD_BITS; i++) {
+        uint64_t words[2] = {0, 0};
+        if (i < numSmps) LoadTileWords(smpRows[i] + tileStart, tileNumBytes, words);
+
+        lowBits[i] = _pext_u64(words[0], evenBits) | _pext_u64(words[1], evenBits) << 32;
+        highBits[i] = _pext_u64(words[0], evenBits << 1) | _pext_u64(words[1], evenBits << 1) << 32;
+    }
+}
+#endif
+
+// Splits the 2-bit values of the 64 SNPs of a tile in each sample row into a word of the low bits and a word of
+// the high bits. Rows after the last sample are 0.
+static void SplitTileBits(const uint8_t **smpRows, int numSmps, long tileStart, long tileNumBytes,
+uint64_t *lowBits, uint64_t *highBits)
+{
+#ifdef BED_X86_BMI2
+    if (hasBmi2) {
+        SplitTileBitsBmi2(smpRows, numSmps, tileStart, tileNumBytes, lowBits, highBits);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < GENO_WORD_BITS; i++) {
+        uint64_t words[2] = {0, 0};
+        if (i < numSmps) LoadTileWords(smpRows[i] + tileStart, tileNumBytes, words);
+
+        uint64_t split0 = SplitEvenOddBits(words[0]);
+        uint64_t split1 = SplitEvenOddBits(words[1]);
+        lowBits[i] = (split0 & 0xFFFFFFFFULL) | split1 << 32;
+        highBits[i] = split0 >> 32 | (split1 >> 32) << 32;
+    }
+}
+
+// An individual-major bed file has one row per sample, with the genotypes of 4 SNPs in each byte. It is transposed
+// in tiles of 64 samples (one word of the packed rows) by 64 SNPs (16 bytes of each sample row). The low and high
+// bits of the 2-bit values of a tile are split into two 64 x 64 bit matrices, which are transposed to one word of
+// 64 samples per SNP, and the words of the ancestry SNPs are copied to the packed rows. With a .bed value of
+// b1 b0 (00 = AA, 01 = missing, 10 = AB, 11 = BB), the high bit of the genotype code is b0 (~b1 if the alleles are
+// swapped), and the low bit is b0 ^ b1. Tiles with only a few ancestry SNPs are gathered one SNP at a time instead.
+// The sample rows are read in order, and only the bytes from the first to the last ancestry SNP of the selected
+// samples are read. Returns the number of pages touched.
+long BedFileSnpGeno::ReadSampleMajorGenotypes(const char *bedData, long smpNumBytes)
+{
+    double t1 = GetWallSeconds();
 
-            if (swap) {
-                if      (intGeno == 0) intGeno = 2;
-                else if (intGeno == 2) intGeno = 0;
+    const vector<int>& ancBimPoses = bimSnps->GetAncSnpBimPositions();
+    const vector<int>& selSmpNos = famSmps->selSmpNos;
+    int numRows = ancBimPoses.size();
+    if (numRows == 0) return 0;
+
+    vector<bool> rowSwaps(numRows);
+    for (int rowNo = 0; rowNo < numRows; rowNo++) {
+        int bimPos = ancBimPoses[rowNo];
+        int match = bimSnps->GetAlleleMatchGivenBimSnpPos(bimPos);
+        rowSwaps[rowNo] = match == 2 || match == -2;
+
+        ancSnpGenos.rows.push_back(ancSnpGenos.NewRow());
+        ancSnpSnpIds.push_back(bimSnps->GetAncSnpIdGivenBimSnpPos(bimPos));
+    }
+
+    long spanStart = ancBimPoses.front() / 4;
+    long spanNumBytes = ancBimPoses.back() / 4 - spanStart + 1;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    long numPagesTouched = 0;
+    long lastPageNo = -1;
+
+    int numWords = ancSnpGenos.GetNumWords();
+    uint64_t lowBits[GENO_WORD_BITS], highBits[GENO_WORD_BITS];
+    vector<const uint8_t*> smpRows(GENO_WORD_BITS);
+
+    for (int wordNo = 0; wordNo < numWords; wordNo++) {
+        int firstSelNo = wordNo * GENO_WORD_BITS;
+        int numWordSmps = min(GENO_WORD_BITS, numSelSmps - firstSelNo);
+        uint64_t smpMask = numWordSmps < GENO_WORD_BITS ? (uint64_t(1) << numWordSmps) - 1 : ~uint64_t(0);
+
+        for (int i = 0; i < numWordSmps; i++) {
+            int smpNo = selSmpNos.empty() ? firstSelNo + i : selSmpNos[firstSelNo + i];
+            long rowStart = 3 + smpNo * smpNumBytes;
+            smpRows[i] = (const uint8_t*)bedData + rowStart;
+
+            long firstPageNo = (rowStart + spanStart) / pageSize;
+            long endPageNo = (rowStart + spanStart + spanNumBytes - 1) / pageSize;
+            numPagesTouched += endPageNo - max(firstPageNo, lastPageNo + 1) + 1;
+            lastPageNo = endPageNo;
+        }
+
+        for (int firstRowNo = 0; firstRowNo < numRows; ) {
+            // Ancestry SNPs in the same tile of 64 SNPs
+            long tileNo = ancBimPoses[firstRowNo] / GENO_WORD_BITS;
+            int endRowNo = firstRowNo + 1;
+            while (endRowNo < numRows && ancBimPoses[endRowNo] / GENO_WORD_BITS == tileNo) endRowNo++;
+
+            if (endRowNo - firstRowNo >= BED_TILE_MIN_SNPS) {
+                long tileStart = tileNo * 16;
+                long tileNumBytes = min(16L, smpNumBytes - tileStart);
+
+                SplitTileBits(&smpRows[0], numWordSmps, tileStart, tileNumBytes, lowBits, highBits);
+                PackedGenoMatrix::TransposeBits64(lowBits);
+                PackedGenoMatrix::TransposeBits64(highBits);
+
+                for (int rowNo = firstRowNo; rowNo < endRowNo; rowNo++) {
+                    int k = ancBimPoses[rowNo] % GENO_WORD_BITS;
+                    uint64_t *snpRow = ancSnpGenos.rows[rowNo];
+                    snpRow[wordNo] = (rowSwaps[rowNo] ? ~highBits[k] : lowBits[k]) & smpMask;
+                    snpRow[numWords + wordNo] = lowBits[k] ^ highBits[k];
+                }
+            }
+            else {
+                for (int rowNo = firstRowNo; rowNo < endRowNo; rowNo++) {
+                    int byteNo = ancBimPoses[rowNo] / 4;
+                    int shift = ancBimPoses[rowNo] % 4 * 2;
+                    uint64_t low = 0, high = 0;
+
+                    for (int i = 0; i < numWordSmps; i++) {
+                        uint64_t bedBits = smpRows[i][byteNo] >> shift;
+                        low |= (bedBits & 1) << i;
+                        high |= (bedBits >> 1 & 1) << i;
+                    }
+
+                    uint64_t *snpRow = ancSnpGenos.rows[rowNo];
+                    snpRow[wordNo] = (rowSwaps[rowNo] ? ~high : low) & smpMask;
+                    snpRow[numWords + wordNo] = low ^ high;
+                }
             }
 
-            if (smpNo < numSamples) snpGenos[smpNo] = intGeno;
-            smpNo++;
+            firstRowNo = endRowNo;
         }
     }
 
-    return snpGenos;
+    decodeSecs += GetWallSeconds() - t1;
+    numDecodedGenos += long(numRows) * numSelSmps;
+
+    return numPagesTouched;
 }
 
-bool BedFileSnpGeno::ReadGenotypesFromBedFile()
+// The bed file is memory mapped. Only the rows of the ancestry SNPs (or the byte range of the selected samples
+// in these rows) are touched, and the genotypes are decoded straight from the mapping.
+// Decodes the genotypes of one ancestry SNP from its row in the bed file, starting from rangeStartByte,
+// and adds them to the packed genotypes
+void BedFileSnpGeno::AddAncSnpRow(const char *rowData, int bimPos, char *snpGenos)
 {
-    bool hasErr = false;
+    int ancSnpId = bimSnps->GetAncSnpIdGivenBimSnpPos(bimPos);
+    int match = bimSnps->GetAlleleMatchGivenBimSnpPos(bimPos);
+    bool swap = match ==  2 || match == -2 ? true : false;
 
-    char header[2];
-    char mode[1];
+    if (selWords.empty()) {
+        RecodeBedSnpGeno(rowData, swap, snpGenos);
+    }
+    else {
+        GatherSelectedBedSnpGeno(rowData, swap, snpGenos);
+    }
 
-    ifstream bedFilePtr (bedFile, ios::in | ios::binary);
+    uint64_t *snpRow = ancSnpGenos.NewRow();
+    ancSnpGenos.PackRow(snpGenos, snpRow);
+    ancSnpGenos.rows.push_back(snpRow);
+    ancSnpSnpIds.push_back(ancSnpId);
+}
 
+// Reads a gzip or zstd compressed bed file in SNP mode. The file is inflated as a stream, BGZF blocks by
+// numThreads threads, and only the byte range of the selected samples in the rows of the ancestry SNPs is kept.
+// The other rows are dropped as they are inflated, so memory use doesn't grow with the size of the file,
+// and no temporary file is written.
+bool BedFileSnpGeno::ReadGenotypesFromBedStream()
+{
     long snpNumBytes = (numSamples - 1) / 4 + 1;
     long expFileLen = snpNumBytes * numBimSnps + 3;
 
-    bedFilePtr.seekg (0, bedFilePtr.end);
-    long fileLen = bedFilePtr.tellg();
-    bedFilePtr.seekg(0, bedFilePtr.beg);
+    BgzfReader reader(bedFile, numThreads);
+    if (!reader.Open()) {
+        cout << "ERROR: Couldn't open file " << bedFile << "\n";
+        return true;
+    }
+    cout << "Reading genotypes from " << bedFile << "\n";
+    if (!selWords.empty()) cout << "\tReading " << rangeNumBytes << " of " << snpNumBytes << " bytes of each ancestry SNP\n";
+
+    const vector<int>& ancBimPoses = bimSnps->GetAncSnpBimPositions();
+    int numRows = ancBimPoses.size();
 
-    bedFilePtr.read (header, 2);
-    bedFilePtr.read (mode, 1);
+    vector<char> rowBuff((rangeNumBytes + 7) / 8 * 8, 0);  // Genotypes of the selected samples of one ancestry SNP
+    vector<char> snpGenos(numSelSmps);
+    unsigned char header[3];
 
-    if (header[0] != 108 || header[1] != 27) {
+    bool hasErr = false;
+    bool headerChecked = false;
+    long filePos = 0;           // Position in the bed file of the next inflated byte
+    int rowNo = 0;              // Next ancestry SNP row
+    long rowStart = numRows > 0 ? 3 + ancBimPoses[0] * snpNumBytes + rangeStartByte : expFileLen;
+    long rowFilled = 0;         // Bytes of the row copied to rowBuff
+
+    const char *chunk;
+    int chunkLen;
+    while ((chunkLen = reader.ReadChunk(&chunk)) > 0) {
+        const char *chunkEnd = chunk + chunkLen;
+
+        while (filePos < 3 && chunk < chunkEnd) header[filePos++] = *chunk++;
+        if (filePos < 3) continue;
+
+        if (!headerChecked) {
+            headerChecked = true;
+            if (header[0] != BYTE1_IN_BED_FILE || header[1] != BYTE2_IN_BED_FILE) {
+                cout << "ERROR: File " << bedFile << " is not a valid PLINK bed file!\n";
+                hasErr = true;
+            }
+            else if (header[2] == BYTE_OF_SMP_MODE) {
+                cout << "ERROR: File " << bedFile << " is an individual-major bed file, which can't be read compressed. "
+                     << "Please decompress it.\n";
+                hasErr = true;
+            }
+            else if (header[2] != BYTE_OF_SNP_MODE) {
+                cout << "ERROR: File " << bedFile << " is neither in SNP mode nor in individual mode!\n";
+                hasErr = true;
+            }
+            if (hasErr) break;
+        }
+
+        // Skip to the next ancestry SNP row, or copy the part of the row in this chunk
+        while (chunk < chunkEnd && rowNo < numRows) {
+            if (filePos < rowStart) {
+                long skipLen = min(long(chunkEnd - chunk), rowStart - filePos);
+                chunk += skipLen;
+                filePos += skipLen;
+                continue;
+            }
+
+            long copyLen = min(long(chunkEnd - chunk), rangeNumBytes - rowFilled);
+            memcpy(&rowBuff[rowFilled], chunk, copyLen);
+            chunk += copyLen;
+            filePos += copyLen;
+            rowFilled += copyLen;
+
+            if (rowFilled == rangeNumBytes) {
+                ASSERT(rowNo < numAncSnps, "bim ancestry SNP ID " << rowNo << " not less than " << numAncSnps << "\n");
+                AddAncSnpRow(&rowBuff[0], ancBimPoses[rowNo], &snpGenos[0]);
+                rowNo++;
+                rowFilled = 0;
+                if (rowNo < numRows) rowStart = 3 + ancBimPoses[rowNo] * snpNumBytes + rangeStartByte;
+            }
+        }
+
+        filePos += chunkEnd - chunk;
+    }
+
+    if (!hasErr && (chunkLen < 0 || reader.HasError())) {
+        cout << "ERROR: Failed to inflate file " << bedFile << "\n";
+        hasErr = true;
+    }
+    else if (!hasErr && filePos < 3) {
         cout << "ERROR: File " << bedFile << " is not a valid PLINK bed file!\n";
         hasErr = true;
     }
-    else if (mode[0] != 1) {
-        cout << "ERROR: File " << bedFile << " is not in SNP mode!\n";
+    else if (!hasErr && filePos != expFileLen) {
+        cout << "ERROR: Number of genotypes in bed file doesn't match fam and bim File!\n";
+        cout << "\tFam file has " << numSamples << " samples.  Bim file has " << numBimSnps << " SNPs. ";
+        cout << "Each SNP should have " << snpNumBytes << " bytes.  Expected total " << expFileLen << " bytes.\n";
+        cout << "\tBed file has " << filePos << " bytes after decompression.\n";
         hasErr = true;
     }
 
-    if (fileLen != expFileLen) {
+    reader.ShowSummary();
+    reader.Close();
+    if (hasErr) return hasErr;
+
+    numBimAncSnps = rowNo;
+    printf("\tKept %.1f MB of ancestry SNP genotypes from %.1f MB of inflated genotypes\n",
+           numRows * rangeNumBytes / 1048576.0, filePos / 1048576.0);
+
+    if (numDecodedGenos > 0) {
+        cout << "\tDecoded " << numDecodedGenos << " genotypes using " << (useAvx2 ? "AVX2" : "table lookup");
+        if (decodeSecs > 0) printf(", %.1f million genotypes/second", numDecodedGenos / 1000000.0 / decodeSecs);
+        cout << "\n";
+    }
+
+    cout << "Read genotypes of " << numBimAncSnps << " Ancestry SNPs from total " << numBimSnps << " SNPs.\n";
+    cout << "Bed file has genotypes of " << numBimSnps << " SNPs. Read genotypes of "
+         << numBimAncSnps << " ancestry SNPs for " << numSelSmps << " samples.\n";
+
+    return hasErr;
+}
+
+bool BedFileSnpGeno::ReadGenotypesFromBedFile()
+{
+    if (IsCompressedFile(bedFile)) return ReadGenotypesFromBedStream();
+
+    bool hasErr = false;
+
+    long snpNumBytes = (numSamples - 1) / 4 + 1;
+    long smpNumBytes = (numBimSnps - 1) / 4 + 1;
+
+    int fd = open(bedFile.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        cout << "ERROR: Couldn't open file " << bedFile << "\n";
+        if (fd >= 0) close(fd);
+        return true;
+    }
+    long fileLen = fileStat.st_size;
+
+    const char *bedData = NULL;
+    if (fileLen >= 3) {
+        void *mapAddr = mmap(NULL, fileLen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapAddr != MAP_FAILED) bedData = (const char*)mapAddr;
+    }
+    close(fd);
+
+    if (!bedData) {
+        cout << "ERROR: File " << bedFile << " is not a valid PLINK bed file!\n";
+        return true;
+    }
+
+    if (bedData[0] != BYTE1_IN_BED_FILE || bedData[1] != BYTE2_IN_BED_FILE) {
+        cout << "ERROR: File " << bedFile << " is not a valid PLINK bed file!\n";
+        hasErr = true;
+    }
+    else if (bedData[2] != BYTE_OF_SNP_MODE && bedData[2] != BYTE_OF_SMP_MODE) {
+        cout << "ERROR: File " << bedFile << " is neither in SNP mode nor in individual mode!\n";
+        hasErr = true;
+    }
+
+    bool isSmpMode = !hasErr && bedData[2] == BYTE_OF_SMP_MODE;
+    long expFileLen = isSmpMode ? smpNumBytes * numSamples + 3 : snpNumBytes * numBimSnps + 3;
+
+    if (!hasErr && fileLen != expFileLen) {
         cout << "ERROR: Number of genotypes in bed file doesn't match fam and bim File!\n";
-        cout << "\tFam file has " << numSamples << " samples.  Bim file has "
-        << numBimSnps << " SNPs. Each SNP should have "
-        << snpNumBytes << " bytes.  Expected total " << expFileLen << " bytes.\n";
+        cout << "\tFam file has " << numSamples << " samples.  Bim file has " << numBimSnps << " SNPs. ";
+        if (isSmpMode) cout << "Each sample should have " << smpNumBytes << " bytes.";
+        else           cout << "Each SNP should have " << snpNumBytes << " bytes.";
+        cout << "  Expected total " << expFileLen << " bytes.\n";
         cout << "\tBed file has " << fileLen << " bytes.\n";
         hasErr = true;
     }
 
-    if (hasErr) return hasErr;
+    if (hasErr) {
+        munmap((void*)bedData, fileLen);
+        return hasErr;
+    }
     cout << "Reading genotypes from " << bedFile << "\n";
 
-    char buff[snpNumBytes];             // Reusable memory to keep the genotypes
+    if (isSmpMode) {
+        long numPagesTouched = ReadSampleMajorGenotypes(bedData, smpNumBytes);
+        munmap((void*)bedData, fileLen);
+        numBimAncSnps = ancSnpSnpIds.size();
+
+        double touchedMb = min(numPagesTouched * sysconf(_SC_PAGESIZE), fileLen) / 1048576.0;
+        printf("\tTouched %.1f MB of the %.1f MB individual-major bed file (%.1f%%)\n", touchedMb, fileLen / 1048576.0,
+               touchedMb * 100 / (fileLen / 1048576.0));
+        cout << "\tTransposed " << numDecodedGenos << " genotypes";
+        if (decodeSecs > 0) printf(", %.1f million genotypes/second", numDecodedGenos / 1000000.0 / decodeSecs);
+        cout << "\n";
+
+        cout << "Bed file has genotypes of " << numBimSnps << " SNPs. Read genotypes of "
+             << numBimAncSnps << " ancestry SNPs for " << numSelSmps << " samples.\n";
+
+        return 0;
+    }
+
+    // With keep/remove lists or sample blocks, only the byte range of the selected samples of each ancestry SNP is read
+    if (!selWords.empty()) cout << "\tReading " << rangeNumBytes << " of " << snpNumBytes << " bytes of each ancestry SNP\n";
+
+    // A panel of ancestry SNPs is read in order. Otherwise the kernel shouldn't read ahead around each row,
+    // and is told which rows will be needed next.
+    const vector<int>& ancBimPoses = bimSnps->GetAncSnpBimPositions();
+    int numRows = ancBimPoses.size();
+    bool isSparse = numRows * 4L < numBimSnps;
+    madvise((void*)bedData, fileLen, isSparse ? MADV_RANDOM : MADV_SEQUENTIAL);
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    long numPagesTouched = 0;
+    long lastPageNo = -1;
+
+    vector<char> buff((rangeNumBytes + 7) / 8 * 8, 0);   // Only for the last rows, whose words might end past the mapping
+    vector<char> snpGenos(numSelSmps);                      // Genotype codes of one SNP, before they are packed
     int bimAncSnpNo = 0;
 
-    for (int i = 0; i < numBimSnps; i++) {
-        bedFilePtr.read (buff, snpNumBytes);
-        int ancSnpId = bimSnps->GetAncSnpIdGivenBimSnpPos(i);
-        int match = bimSnps->GetAlleleMatchGivenBimSnpPos(i);
-        bool swap = match ==  2 || match == -2 ? true : false;
+    for (int rowNo = 0; rowNo < numRows; rowNo++) {
+        if (isSparse && rowNo % BED_PREFETCH_ROWS == 0) AdviseRows(bedData, ancBimPoses, rowNo, snpNumBytes);
+
+        int bimPos = ancBimPoses[rowNo];
 
-        if (ancSnpId >= 0) {
-            char* snpGenoStr = new char[snpNumBytes];
-            for (int j = 0; j < snpNumBytes; j++) snpGenoStr[j] = buff[j];
-            ASSERT(bimAncSnpNo < numAncSnps, "bim ancestry SNP ID " << bimAncSnpNo << " not less than " << numAncSnps << "\n");
+        ASSERT(bimAncSnpNo < numAncSnps, "bim ancestry SNP ID " << bimAncSnpNo << " not less than " << numAncSnps << "\n");
 
-            char *snpSmpGeno = RecodeBedSnpGeno(snpGenoStr, snpNumBytes, swap);
+        long rowStart = 3 + bimPos * snpNumBytes + rangeStartByte;
+        const char *rowData = bedData + rowStart;
 
-            ancSnpSmpGenos.push_back(snpSmpGeno);
-            ancSnpSnpIds.push_back(ancSnpId);
+        long firstPageNo = rowStart / pageSize;
+        long endPageNo = (rowStart + rangeNumBytes - 1) / pageSize;
+        numPagesTouched += endPageNo - max(firstPageNo, lastPageNo + 1) + 1;
+        lastPageNo = endPageNo;
 
-            bimAncSnpNo++;
+        if (!selWords.empty() && rowStart + long(buff.size()) > fileLen) {
+            memcpy(&buff[0], rowData, rangeNumBytes);
+            rowData = &buff[0];
         }
+        AddAncSnpRow(rowData, bimPos, &snpGenos[0]);
+
+        bimAncSnpNo++;
     }
 
-    bedFilePtr.close();
+    munmap((void*)bedData, fileLen);
     numBimAncSnps = bimAncSnpNo;
 
+    double touchedMb = min(numPagesTouched * pageSize, fileLen) / 1048576.0;
+    printf("\tTouched %.1f MB of the %.1f MB bed file (%.1f%%)\n", touchedMb, fileLen / 1048576.0,
+           touchedMb * 100 / (fileLen / 1048576.0));
+
+    if (numDecodedGenos > 0) {
+        cout << "\tDecoded " << numDecodedGenos << " genotypes using " << (useAvx2 ? "AVX2" : "table lookup");
+        if (decodeSecs > 0) printf(", %.1f million genotypes/second", numDecodedGenos / 1000000.0 / decodeSecs);
+        cout << "\n";
+    }
+
     cout << "Read genotypes of " << bimAncSnpNo << " Ancestry SNPs from total " << numBimSnps << " SNPs.\n";
     cout << "Bed file has genotypes of " << numBimSnps << " SNPs. Read genotypes of "
-         << numBimAncSnps << " ancestry SNPs for " << numSamples << " samples.\n";
+         << numBimAncSnps << " ancestry SNPs for " << numSelSmps << " samples.\n";
 
     return 0;
 }
@@ -179,6 +733,7 @@ void BedFileSnpGeno::ShowSummary()
 {
     cout << "\n";
     cout << "Total " << numSamples << " samples\n";
+    if (numSelSmps < numSamples) cout << "Selected " << numSelSmps << " samples\n";
     cout << "Total " << numAncSnps << " Ancestry SNPs\n";
     cout << "Total " << numBimAncSnps << " Ancestry SNPs in bim file\n\n";
 }
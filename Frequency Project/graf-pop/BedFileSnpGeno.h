@@ -1,24 +1,39 @@
 #ifndef BED_FILE_SNP_GENO_H
 #define BED_FILE_SNP_GENO_H
 
-#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "Util.h"
 #include "AncestrySnps.h"
 #include "BimFileAncestrySnps.h"
 #include "FamFileSamples.h"
 #include "SampleGenoDist.h"
+#include "PackedGenoMatrix.h"
+#include "BgzfReader.h"
 
 static const int BYTE1_IN_BED_FILE = 108;
 static const int BYTE2_IN_BED_FILE = 27;
 static const int BYTE_OF_SNP_MODE  = 1;
+static const int BYTE_OF_SMP_MODE  = 0;     // Individual-major bed file, one row per sample
+static const int BED_PREFETCH_ROWS = 256;   // Number of ancestry SNP rows passed to madvise(MADV_WILLNEED) at a time
+static const int BED_TILE_MIN_SNPS = 2;     // Ancestry SNPs in a tile of 64 x 64 genotypes for it to be bit transposed
+static const int BED_TILE_PREFETCH = 256;   // Bytes ahead in each sample row to prefetch while transposing tiles
+
+// The 2-bit genotypes of the selected samples in one 64-bit word (32 samples) of a SNP's genotypes
+struct BedSelectedWord
+{
+    int wordNo;
+    uint64_t mask;      // Both bits of each selected sample
+    int numSmps;
+};
 
 class BedFileSnpGeno
 {
 public:
-    unsigned long baseNums[64];    // bits 1, 10, 100 ... for decoding genos in bed file
-
     int numAncSnps;
-    int numSamples;
+    int numSamples;               // Samples in the fam file
+    int numSelSmps;               // Samples whose genotypes are read
     int numBimSnps;
     int numBimAncSnps;
 
@@ -29,11 +44,14 @@ public:
     SampleGenoDist *vtxExpGd0;    // Genetic distances from 3 vertices to ref populations when all SNPs have genotypes
 
 public:
-    vector<char*> ancSnpSmpGenos; // Genotypes of Ancestry SNPs in an array of chars (0 = AA, 1 = AB; 2 = BB) of chars
+    PackedGenoMatrix ancSnpGenos; // Genotypes of Ancestry SNPs (0 = AA, 1 = AB; 2 = BB, 3 = unknown), 2 bits per sample
     vector<int> ancSnpSnpIds;     // Genotypes of Ancestry SNPs in an array of SNP IDs
 
     BedFileSnpGeno(string, AncestrySnps*, BimFileAncestrySnps*, FamFileSamples*);
     ~BedFileSnpGeno();
+    void SetNumThreads(int threads) { numThreads = threads > 0 ? threads : 1; };
+    static bool SetUseAvx2(bool);
+    static void DecodeBedRow(const char*, int, bool, char*);
     bool ReadGenotypesFromBedFile();
     void ShowSummary();
     void InitPopPvalues();
@@ -41,10 +59,23 @@ public:
 private:
     int genoFileLineLen;         // Max length of one sample geno line (with sample info)
     int smpNameLen;
+    vector<BedSelectedWord> selWords;   // With keep/remove lists, the words that have selected samples
+    long rangeStartByte;          // Only this byte range of each SNP, from the first to the last selected sample,
+    long rangeNumBytes;           // is read. Word numbers in selWords start from rangeStartByte.
+    long numDecodedGenos;         // Genotypes decoded from whole SNP rows, and the time used
+    double decodeSecs;
+    int numThreads;               // Threads to inflate a BGZF compressed bed file
+
+    void SetSelectedWords();
+    void AddAncSnpRow(const char*, int, char*);
+    bool ReadGenotypesFromBedStream();
+    long ReadSampleMajorGenotypes(const char*, long);
+    void AdviseRows(const char*, const vector<int>&, int, long);
+    void GatherSelectedBedSnpGeno(const char*, bool, char*);
 
     char GetCompAllele(char);
     int  GetSnpGenoInt(bool, bool);
-    char* RecodeBedSnpGeno(char*, int, bool);
+    void RecodeBedSnpGeno(const char*, bool, char*);
 };
 
 #endif
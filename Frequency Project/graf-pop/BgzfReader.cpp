@@ -0,0 +1,498 @@
+#include "BgzfReader.h"
+
+BgzfBlock::BgzfBlock()
+{
+    coffset = 0;
+    csize = 0;
+    usize = 0;
+    isValid = false;
+    cdata = {};
+    udata = {};
+}
+
+bool BgzfBlock::Inflate()
+{
+    isValid = false;
+    usize = 0;
+
+    if (udata.size() < BGZF_MAX_BLOCK_SIZE) udata.resize(BGZF_MAX_BLOCK_SIZE);
+
+    const unsigned char *footer = (const unsigned char*)&cdata[csize - BGZF_FOOTER_LEN];
+    unsigned int expCrc = footer[0] | footer[1] << 8 | footer[2] << 16 | (unsigned)footer[3] << 24;
+    unsigned int expLen = footer[4] | footer[5] << 8 | footer[6] << 16 | (unsigned)footer[7] << 24;
+
+    if (expLen > BGZF_MAX_BLOCK_SIZE) return false;
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.next_in = (Bytef*)&cdata[BGZF_HEADER_LEN];
+    strm.avail_in = csize - BGZF_HEADER_LEN - BGZF_FOOTER_LEN;
+    strm.next_out = (Bytef*)&udata[0];
+    strm.avail_out = BGZF_MAX_BLOCK_SIZE;
+
+    if (inflateInit2(&strm, -15) != Z_OK) return false;
+    int ret = inflate(&strm, Z_FINISH);
+    usize = BGZF_MAX_BLOCK_SIZE - strm.avail_out;
+    inflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || usize != expLen) return false;
+
+    unsigned int crc = crc32(0L, (const Bytef*)&udata[0], usize);
+    if (crc != expCrc) return false;
+
+    isValid = true;
+    return true;
+}
+
+BgzfReader::BgzfReader(string file, int threads)
+{
+    filename = file;
+    fp = NULL;
+    gzfp = NULL;
+    isBgzf = false;
+    isZstd = false;
+    fileDone = false;
+    hasErr = false;
+    numThreads = threads > 0 ? threads : 1;
+
+    blocks = {};
+    numBatchBlocks = 0;
+    maxBatchBlocks = 0;
+    nextBlockNo = 0;
+    inflateTasks = NULL;
+    inflateDone = NULL;
+    gzBuffer = NULL;
+
+    skipBytes = 0;
+    hasRegion = false;
+    regionDone = false;
+    regionEnd = 0;
+    chunkOffset = 0;
+    gzOffset = 0;
+
+    fileSize = 0;
+    totBlocks = 0;
+    totCompBytes = 0;
+    totBytes = 0;
+    inflateSecs = 0;
+
+#ifdef GRAFPOP_ZSTD
+    zstdStream = NULL;
+    zstdFrameLeft = 0;
+    zstdOutFull = false;
+#endif
+}
+
+BgzfReader::~BgzfReader()
+{
+    Close();
+    blocks.clear();
+}
+
+bool BgzfReader::CheckBgzfHeader(const unsigned char *header, int *blockSize)
+{
+    // gzip magic, deflate, FEXTRA set, XLEN = 6, subfield "BC" with SLEN = 2
+    bool isBgzfHeader = header[0] == 31 && header[1] == 139 && header[2] == 8 && (header[3] & 4) &&
+                        header[10] == 6 && header[11] == 0 &&
+                        header[12] == 'B' && header[13] == 'C' && header[14] == 2 && header[15] == 0;
+
+    if (isBgzfHeader) *blockSize = (header[16] | header[17] << 8) + 1;
+
+    return isBgzfHeader;
+}
+
+bool BgzfReader::Open()
+{
+    fileDone = false;
+    hasErr = false;
+
+    FILE *ifp = fopen(filename.c_str(), "rb");
+    if (!ifp) return false;
+
+    unsigned char header[BGZF_HEADER_LEN];
+    int blockSize = 0;
+    int bytesRead = fread(header, 1, BGZF_HEADER_LEN, ifp);
+
+    if (bytesRead == BGZF_HEADER_LEN && CheckBgzfHeader(header, &blockSize)) {
+        isBgzf = true;
+        fp = ifp;
+        fseek(fp, 0, SEEK_END);
+        fileSize = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        int numBlocks = numThreads * BGZF_BATCH_BLOCKS;
+        blocks.resize(numBlocks);
+        for (int i = 0; i < numBlocks; i++) blocks[i].cdata.resize(BGZF_MAX_BLOCK_SIZE);
+        maxBatchBlocks = numThreads;
+    }
+    else if (bytesRead >= 4 && memcmp(header, ZSTD_MAGIC, 4) == 0) {
+        fseek(ifp, 0, SEEK_SET);
+        return OpenZstd(ifp);
+    }
+    else {
+        fclose(ifp);
+        isBgzf = false;
+        gzfp = gzopen(filename.c_str(), "r");
+        if (!gzfp) return false;
+        gzbuffer(gzfp, GZ_READ_LEN);
+        gzBuffer = new char[GZ_READ_LEN];
+    }
+
+    return true;
+}
+
+void BgzfReader::Close()
+{
+    StopWorkers();
+
+    if (fp) fclose(fp);
+    if (gzfp) gzclose(gzfp);
+    if (gzBuffer) delete[] gzBuffer;
+
+#ifdef GRAFPOP_ZSTD
+    if (zstdStream) ZSTD_freeDStream(zstdStream);
+    zstdStream = NULL;
+#endif
+
+    fp = NULL;
+    gzfp = NULL;
+    gzBuffer = NULL;
+}
+
+bool BgzfReader::ReadBlock(BgzfBlock *block)
+{
+    unsigned char *header = (unsigned char*)&block->cdata[0];
+    block->coffset = ftell(fp);
+    block->csize = 0;
+    block->usize = 0;
+    block->isValid = false;
+
+    int bytesRead = fread(header, 1, BGZF_HEADER_LEN, fp);
+    if (bytesRead == 0) {
+        fileDone = true;
+        return false;
+    }
+
+    int blockSize = 0;
+    if (bytesRead < BGZF_HEADER_LEN || !CheckBgzfHeader(header, &blockSize) ||
+        blockSize < BGZF_HEADER_LEN + BGZF_FOOTER_LEN) {
+        cout << "\nERROR: invalid BGZF block at offset " << block->coffset << " in file " << filename << "\n";
+        hasErr = true;
+        return false;
+    }
+
+    int restLen = blockSize - BGZF_HEADER_LEN;
+    bytesRead = fread(&block->cdata[BGZF_HEADER_LEN], 1, restLen, fp);
+    if (bytesRead != restLen) {
+        cout << "\nERROR: truncated BGZF block at offset " << block->coffset << " in file " << filename << "\n";
+        hasErr = true;
+        return false;
+    }
+
+    block->csize = blockSize;
+
+    return true;
+}
+
+bool BgzfReader::ReadBatch()
+{
+    numBatchBlocks = 0;
+    nextBlockNo = 0;
+
+    while (numBatchBlocks < maxBatchBlocks && !fileDone && !hasErr) {
+        // Don't read ahead past the block where the region ends
+        if (hasRegion) {
+            uint64_t coffset = ftell(fp);
+            uint64_t endCoffset = regionEnd >> 16;
+            if (coffset > endCoffset || (coffset == endCoffset && (regionEnd & 0xffff) == 0)) break;
+        }
+
+        if (ReadBlock(&blocks[numBatchBlocks])) numBatchBlocks++;
+    }
+
+    if (numBatchBlocks == 0) return false;
+
+    maxBatchBlocks *= 2;
+    if (maxBatchBlocks > blocks.size()) maxBatchBlocks = blocks.size();
+
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+
+    // Each thread inflates a contiguous range of blocks. The ranges after the first one are passed to the
+    // workers, and the calling thread inflates the first one.
+    int batchThreads = numThreads < numBatchBlocks ? numThreads : numBatchBlocks;
+    int thBlocks = (numBatchBlocks - 1) / batchThreads + 1;
+    if (batchThreads > 1 && !inflateTasks) StartWorkers();
+
+    int numTasks = 0;
+    for (int stBlock = thBlocks; stBlock < numBatchBlocks; stBlock += thBlocks) {
+        int edBlock = stBlock + thBlocks < numBatchBlocks ? stBlock + thBlocks : numBatchBlocks;
+        inflateTasks->Push(make_pair(stBlock, edBlock));
+        numTasks++;
+    }
+
+    for (int i = 0; i < thBlocks && i < numBatchBlocks; i++) blocks[i].Inflate();
+
+    int doneBlocks;
+    for (int taskNo = 0; taskNo < numTasks; taskNo++) inflateDone->Pop(&doneBlocks);
+
+    gettimeofday(&t2, NULL);
+    inflateSecs += (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0;
+
+    // Counted when inflated, since Seek() can pass a block of the batch more than once
+    for (int i = 0; i < numBatchBlocks; i++) {
+        totBlocks++;
+        totCompBytes += blocks[i].csize;
+        totBytes += blocks[i].usize;
+    }
+
+    return true;
+}
+
+// Starts numThreads - 1 workers, which inflate the ranges of blocks from inflateTasks until it's closed. A batch
+// has at most numThreads ranges, so the queues never fill up.
+void BgzfReader::StartWorkers()
+{
+    int numWorkers = numThreads - 1;
+    inflateTasks = new BoundedQueue<pair<int, int> >(numWorkers);
+    inflateDone = new BoundedQueue<int>(numWorkers);
+
+    for (int thNo = 0; thNo < numWorkers; thNo++) {
+        workers.push_back(thread([this] {
+            pair<int, int> range;
+            while (inflateTasks->Pop(&range)) {
+                for (int i = range.first; i < range.second; i++) blocks[i].Inflate();
+                inflateDone->Push(range.second - range.first);
+            }
+        }));
+    }
+}
+
+void BgzfReader::StopWorkers()
+{
+    if (!inflateTasks) return;
+
+    inflateTasks->Close();
+    for (auto& t : workers) t.join();
+    workers.clear();
+
+    delete inflateTasks;
+    delete inflateDone;
+    inflateTasks = NULL;
+    inflateDone = NULL;
+}
+
+// Zstandard files are decompressed as a stream by the calling thread. They can't be read with Seek().
+bool BgzfReader::OpenZstd(FILE *ifp)
+{
+    isZstd = true;
+
+#ifdef GRAFPOP_ZSTD
+    fp = ifp;
+    zstdStream = ZSTD_createDStream();
+    if (!zstdStream || ZSTD_isError(ZSTD_initDStream(zstdStream))) {
+        cout << "\nERROR: Couldn't initialize zstd decompression for " << filename << "\n";
+        hasErr = true;
+        return false;
+    }
+
+    zstdInBuff.resize(ZSTD_DStreamInSize());
+    zstdOutBuff.resize(ZSTD_DStreamOutSize());
+    zstdInput.src = &zstdInBuff[0];
+    zstdInput.size = 0;
+    zstdInput.pos = 0;
+    zstdFrameLeft = 0;
+    zstdOutFull = false;
+
+    return true;
+#else
+    fclose(ifp);
+    cout << "\nERROR: " << filename << " is zstd compressed. Please rebuild grafpop with 'make ZSTD=1' "
+         << "to read zstd files, or decompress it with 'zstd -d'.\n";
+    hasErr = true;
+
+    return false;
+#endif
+}
+
+int BgzfReader::ReadZstdChunk(const char **data)
+{
+#ifdef GRAFPOP_ZSTD
+    double t1 = GetWallSeconds();
+    ZSTD_outBuffer output = {&zstdOutBuff[0], zstdOutBuff.size(), 0};
+
+    while (output.pos == 0) {
+        if (zstdInput.pos == zstdInput.size && !zstdOutFull) {
+            size_t bytesRead = fileDone ? 0 : fread(&zstdInBuff[0], 1, zstdInBuff.size(), fp);
+            if (bytesRead == 0) {
+                fileDone = true;
+                if (zstdFrameLeft) {
+                    cout << "\nERROR: zstd file " << filename << " is truncated\n";
+                    hasErr = true;
+                    return -1;
+                }
+                break;
+            }
+
+            zstdInput.size = bytesRead;
+            zstdInput.pos = 0;
+            totCompBytes += bytesRead;
+        }
+
+        zstdFrameLeft = ZSTD_decompressStream(zstdStream, &output, &zstdInput);
+        if (ZSTD_isError(zstdFrameLeft)) {
+            cout << "\nERROR: " << ZSTD_getErrorName(zstdFrameLeft) << " when reading " << filename << "\n";
+            hasErr = true;
+            return -1;
+        }
+        zstdOutFull = output.pos == output.size;
+    }
+
+    inflateSecs += GetWallSeconds() - t1;
+    totBytes += output.pos;
+    chunkOffset = gzOffset;
+    gzOffset += output.pos;
+    *data = &zstdOutBuff[0];
+
+    return output.pos;
+#else
+    (void)data;    // zstd files aren't opened without GRAFPOP_ZSTD
+    return -1;
+#endif
+}
+
+// Sets the pointer to the next chunk of decompressed data and returns its length.
+// Returns 0 at the end of the file and -1 if the file can't be decompressed.
+int BgzfReader::ReadChunk(const char **data)
+{
+    if (isZstd) return ReadZstdChunk(data);
+
+    if (!isBgzf) {
+        int bytesRead = gzread(gzfp, gzBuffer, GZ_READ_LEN);
+        if (bytesRead < 0) {
+            int err;
+            const char *errorString = gzerror(gzfp, &err);
+            cout << "\nERROR: " << errorString << " when reading " << filename << "\n";
+            hasErr = true;
+            return -1;
+        }
+
+        totBytes += bytesRead;
+        chunkOffset = gzOffset;
+        gzOffset += bytesRead;
+        *data = gzBuffer;
+        return bytesRead;
+    }
+
+    while (true) {
+        if (regionDone) return 0;
+
+        if (nextBlockNo >= numBatchBlocks) {
+            if (fileDone || hasErr || !ReadBatch()) return hasErr ? -1 : 0;
+        }
+
+        BgzfBlock *block = &blocks[nextBlockNo];
+        nextBlockNo++;
+
+        if (!block->isValid) {
+            cout << "\nERROR: failed to inflate BGZF block at offset " << block->coffset
+                 << " in file " << filename << "\n";
+            hasErr = true;
+            return -1;
+        }
+
+        int stPos = skipBytes;
+        int edPos = block->usize;
+        skipBytes = 0;
+
+        if (hasRegion && uint64_t(block->coffset) >= regionEnd >> 16) {
+            int endPos = regionEnd & 0xffff;
+            if (endPos < edPos) edPos = endPos;
+            regionDone = true;
+        }
+
+        // Skip empty blocks, e.g., the EOF marker
+        if (edPos > stPos) {
+            chunkOffset = uint64_t(block->coffset) << 16 | stPos;
+            *data = &block->udata[stPos];
+            return edPos - stPos;
+        }
+    }
+}
+
+// BGZF files, and files that are not compressed, support random access
+bool BgzfReader::CanSeek()
+{
+    return isBgzf || (gzfp && gzdirect(gzfp));
+}
+
+// Moves to the given virtual offset, or to the given offset if the file is not compressed
+bool BgzfReader::Seek(uint64_t voffset)
+{
+    if (!isBgzf) {
+        if (!CanSeek() || gzseek(gzfp, voffset, SEEK_SET) < 0) {
+            hasErr = true;
+            return false;
+        }
+        gzOffset = voffset;
+        return true;
+    }
+
+    long coffset = voffset >> 16;
+    regionDone = false;
+    hasRegion = false;
+    skipBytes = voffset & 0xffff;
+
+    // The block is already inflated in the current batch
+    for (int i = 0; i < numBatchBlocks; i++) {
+        if (blocks[i].coffset == coffset) {
+            nextBlockNo = i;
+            return true;
+        }
+    }
+
+    if (fseek(fp, coffset, SEEK_SET) != 0) {
+        hasErr = true;
+        return false;
+    }
+
+    // Only the block of the offset is read first, so that reading single lines far apart doesn't inflate the
+    // blocks after them. The batch size grows again if reading goes on from there.
+    numBatchBlocks = 0;
+    maxBatchBlocks = 1;
+    nextBlockNo = 0;
+    fileDone = false;
+
+    return true;
+}
+
+// Reads data from virtual offset begin up to (not including) virtual offset end
+bool BgzfReader::SetRegion(uint64_t begin, uint64_t end)
+{
+    if (!Seek(begin)) return false;
+
+    hasRegion = true;
+    regionEnd = end;
+    if (maxBatchBlocks < numThreads) maxBatchBlocks = numThreads;
+
+    return true;
+}
+
+void BgzfReader::ShowSummary()
+{
+    if (isBgzf) {
+        double mbs = totBytes / 1048576.0;
+        cout << "\tInflated " << totBlocks << " BGZF blocks (" << long(mbs) << " MB) using "
+             << numThreads << " threads";
+        if (inflateSecs > 0) printf(", %.1f MB/second", mbs / inflateSecs);
+        cout << "\n";
+    }
+    else if (isZstd) {
+        double mbs = totBytes / 1048576.0;
+        cout << "\tDecompressed " << long(mbs) << " MB of zstd data";
+        if (inflateSecs > 0) printf(", %.1f MB/second", mbs / inflateSecs);
+        cout << "\n";
+    }
+}
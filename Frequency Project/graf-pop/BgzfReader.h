@@ -0,0 +1,118 @@
+#ifndef BGZF_READER_H
+#define BGZF_READER_H
+
+#include <zlib.h>
+#include <stdint.h>
+#include <thread>
+#include "Util.h"
+#include "BoundedQueue.h"
+
+#ifdef GRAFPOP_ZSTD
+#include <zstd.h>
+#endif
+
+static const int BGZF_HEADER_LEN     = 18;      // gzip header with the 6-byte "BC" extra subfield
+static const int BGZF_FOOTER_LEN     = 8;       // CRC32 + ISIZE
+static const int BGZF_MAX_BLOCK_SIZE = 0x10000; // Both compressed and uncompressed sizes are at most 64 KB
+static const int BGZF_BATCH_BLOCKS   = 64;      // Number of blocks each worker thread inflates in one batch
+static const int GZ_READ_LEN         = 0x10000; // Chunk size when falling back to gzread
+static const unsigned char ZSTD_MAGIC[4] = {0x28, 0xb5, 0x2f, 0xfd};
+
+// One BGZF block, read from the file and inflated by a worker thread
+class BgzfBlock
+{
+public:
+    long coffset;        // Offset of the block in the compressed file
+    int csize;           // Total size of the block, including header and footer
+    int usize;           // Size of the inflated data
+    bool isValid;
+    vector<char> cdata;  // The compressed block, as read from the file
+    vector<char> udata;  // Inflated data
+
+    BgzfBlock();
+    bool Inflate();
+};
+
+// Reads a .gz file as a stream of decompressed chunks.
+// If the file is in BGZF format (e.g., created by bgzip), the independent blocks are inflated
+// by a pool of worker threads and passed to the caller in the original order. The workers are started
+// with the first batch that needs them, and wait for the ranges of blocks of each batch on a queue.
+// Otherwise the file is read with gzread, which handles single-stream gzip and uncompressed files.
+// Zstandard files (e.g., .pvar.zst of PLINK 2) are streamed with libzstd when built with "make ZSTD=1".
+class BgzfReader
+{
+private:
+    string filename;
+    FILE *fp;              // Used to read BGZF blocks
+    gzFile gzfp;           // Used when the file is not BGZF
+    bool isBgzf;
+    bool isZstd;
+    bool fileDone;
+    bool hasErr;
+    int numThreads;
+
+    vector<BgzfBlock> blocks;  // Blocks of the current batch
+    int numBatchBlocks;        // Number of blocks read into the current batch
+    int maxBatchBlocks;        // Batch size ramps up after Open() and Seek() to avoid reading far ahead
+    int nextBlockNo;           // Next block in the batch to be passed to the caller
+    vector<thread> workers;    // Inflate the ranges of blocks after the first one of each batch
+    BoundedQueue<pair<int, int> > *inflateTasks;  // Ranges of blocks [first, last) to inflate
+    BoundedQueue<int> *inflateDone;               // Number of blocks inflated, for each range done
+    char *gzBuffer;
+
+    // Random access with virtual offsets (compressed block offset << 16 | offset in the inflated block)
+    int skipBytes;             // Bytes to skip in the first block after Seek()
+    bool hasRegion;            // Stop at regionEnd instead of the end of the file
+    bool regionDone;
+    uint64_t regionEnd;
+    uint64_t chunkOffset;      // Offset of the last chunk passed to the caller. See GetChunkOffset().
+    uint64_t gzOffset;         // Uncompressed offset of the next gzread
+
+    long fileSize;
+    long totBlocks;
+    long totCompBytes;         // Total compressed bytes read
+    long totBytes;             // Total decompressed bytes
+    double inflateSecs;        // Wall time spent on decompression
+
+#ifdef GRAFPOP_ZSTD
+    ZSTD_DStream *zstdStream;  // Used when the file is zstd compressed, reading from fp
+    ZSTD_inBuffer zstdInput;
+    vector<char> zstdInBuff;
+    vector<char> zstdOutBuff;
+    size_t zstdFrameLeft;      // Non-zero if the last frame isn't complete
+    bool zstdOutFull;          // The last output buffer was filled, so more data may be flushed without input
+#endif
+
+    bool CheckBgzfHeader(const unsigned char*, int*);
+    bool OpenZstd(FILE*);
+    int ReadZstdChunk(const char**);
+    bool ReadBlock(BgzfBlock*);
+    bool ReadBatch();
+    void StartWorkers();
+    void StopWorkers();
+
+public:
+    BgzfReader(string, int=1);
+    ~BgzfReader();
+
+    bool Open();
+    void Close();
+    int ReadChunk(const char**);
+    bool Seek(uint64_t);
+    bool SetRegion(uint64_t, uint64_t);
+
+    bool CanSeek();
+    bool IsBgzf() { return isBgzf; };
+    bool IsZstd() { return isZstd; };
+    bool HasError() { return hasErr; };
+    long GetFileSize() { return fileSize; };
+    long GetNumBlocksRead() { return totBlocks; };
+    long GetCompressedBytesRead() { return totCompBytes; };
+
+    // Offset of byte pos of the last chunk is GetChunkOffset() + pos, which can be passed to Seek().
+    // A virtual offset for BGZF files, or the offset in the file if it's not compressed.
+    uint64_t GetChunkOffset() { return chunkOffset; };
+    void ShowSummary();
+};
+
+#endif
@@ -5,6 +5,7 @@ BimFileAncestrySnps::BimFileAncestrySnps()
     numDupAncSnps = 0;
     filename = "";
     numBimSnps = 0;
+    numThreads = 1;
 }
 
 BimFileAncestrySnps::BimFileAncestrySnps(int totSnps)
@@ -15,9 +16,7 @@ BimFileAncestrySnps::BimFileAncestrySnps(int totSnps)
     numBimSnps = 0;
     numBimAncSnps = 0;
     numGoodAncSnps = 0;
-    numRsAncSnps = 0;
-    numPos37Snps = 0;
-    numPos38Snps = 0;
+    numThreads = 1;
 }
 
 BimFileAncestrySnps::~BimFileAncestrySnps()
@@ -62,6 +61,7 @@ int BimFileAncestrySnps::CompareAncestrySnpAlleles(const char a1, const char a2,
     return match;
 }
 
+// Reads a .bim file, or a PLINK 2 .pvar or .pvar.zst file. A .bim file might also be gzip or zstd compressed.
 int BimFileAncestrySnps::ReadAncestrySnpsFromFile(string bimFile, AncestrySnps* ancSnps)
 {
     cout << "Reading SNPs from file " << bimFile << "\n";
@@ -70,79 +70,320 @@ int BimFileAncestrySnps::ReadAncestrySnpsFromFile(string bimFile, AncestrySnps*
 
     filename = bimFile;
 
-    int lineLen = 1048675;
-    char fpLine[lineLen];
+    int fileLen = bimFile.length();
+    bool isPvar = (fileLen > 5 && bimFile.substr(fileLen - 5) == ".pvar") ||
+                  (fileLen > 9 && bimFile.substr(fileLen - 9) == ".pvar.zst");
+    if (isPvar) return ReadAncestrySnpsFromStream(bimFile, ancSnps, false);
+    if (IsCompressedFile(bimFile)) return ReadAncestrySnpsFromStream(bimFile, ancSnps, true);
 
-    FILE *ifp = fopen(bimFile.c_str(), "r");
-    ASSERT(ifp, "Could not open " << bimFile << "\n");
+    return ReadAncestrySnpsFromBimFile(bimFile, ancSnps);
+}
 
-    bool fileIsValid = true;
+// Parses the lines of a chunk of a .bim file in place: CHR, ID, CM, POS, A1, A2, separated by spaces or tabs.
+// Every line is counted as a SNP, as the genotypes in the .bed file are for every line.
+void BimFileAncestrySnps::ParseBimChunk(BimFileChunk *chunk, AncestrySnps *ancSnps)
+{
+    const int numCols = 6;
+    const char *fields[numCols];
+    int fieldLens[numCols];
+    AncSnpPosCursor posCursor(ancSnps);
+
+    chunk->numSnps = 0;
+    for (const char *line = chunk->start; line < chunk->end; ) {
+        const char *lineEnd = (const char*)memchr(line, '\n', chunk->end - line);
+        if (!lineEnd) lineEnd = chunk->end;
+        const char *next = lineEnd < chunk->end ? lineEnd + 1 : lineEnd;
+        if (lineEnd > line && lineEnd[-1] == '\r') lineEnd--;
+
+        int numFields = 0;
+        for (const char *p = line; numFields < numCols; ) {
+            while (p < lineEnd && (*p == ' ' || *p == '\t')) p++;
+            const char *fieldEnd = p;
+            while (fieldEnd < lineEnd && *fieldEnd != ' ' && *fieldEnd != '\t') fieldEnd++;
+
+            fields[numFields] = p;
+            fieldLens[numFields] = fieldEnd - p;
+            numFields++;
+            p = fieldEnd;
+        }
 
-    int i;
-    int rs, pos;
-    char chrStr[128], rsStr[128], cm[64];
-    char refStr[524288], altStr[524288]; // In case there are very, very long refs or alts
-
-    // Read the bed file and save lines with potential ancestry SNPs into memory
-    vector<int> bimSnpIds;
-    vector<int> rsAncSnpIds;
-    vector<int> pos37SnpIds;
-    vector<int> pos38SnpIds;
-    vector<char> refs;
-    vector<char> alts;
-
-    int numSaveSnps = 0;
-    int numRsAncSnps = 0;
-    int numPos37Snps = 0;
-    int numPos38Snps = 0;
+        int pos = 0;
+        const char *posStr = fields[3];
+        bool isNeg = fieldLens[3] > 0 && posStr[0] == '-';
+        for (int i = isNeg ? 1 : 0; i < fieldLens[3] && posStr[i] >= '0' && posStr[i] <= '9'; i++) {
+            pos = pos * 10 + posStr[i] - '0';
+        }
+        if (isNeg) pos = -pos;
+
+        int chr = GetChromosomeFromString(fields[0], fieldLens[0]);
+        int rsNum = GetRsNumFromString(fields[1], fieldLens[1]);
+        SaveFileSnp(&chunk->saveSnps, chunk->numSnps, chr, rsNum, pos, fields[4], fieldLens[4], fields[5], fieldLens[5],
+                    ancSnps, &posCursor);
+
+        chunk->numSnps++;
+        line = next;
+    }
+    chunk->posIsSorted = posCursor.IsSorted();
+}
+
+// The .bim file is memory mapped and split at line starts into chunks parsed by separate threads.
+// The SNPs saved from each chunk are then appended in the order of the chunks, to keep the order of the file.
+int BimFileAncestrySnps::ReadAncestrySnpsFromBimFile(string bimFile, AncestrySnps *ancSnps)
+{
+    double t1 = GetWallSeconds();
+
+    int fd = open(bimFile.c_str(), O_RDONLY);
+    struct stat fileStat;
+    ASSERT(fd >= 0 && fstat(fd, &fileStat) == 0, "Could not open " << bimFile << "\n");
+    long fileLen = fileStat.st_size;
+
+    const char *bimData = NULL;
+    if (fileLen > 0) {
+        void *mapAddr = mmap(NULL, fileLen, PROT_READ, MAP_PRIVATE, fd, 0);
+        ASSERT(mapAddr != MAP_FAILED, "Could not read " << bimFile << "\n");
+        bimData = (const char*)mapAddr;
+        madvise(mapAddr, fileLen, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    int numChunks = min(long(numThreads), max(fileLen / BIM_MIN_CHUNK_BYTES, 1L));
+    vector<BimFileChunk> chunks(numChunks);
+
+    const char *chunkStart = bimData;
+    for (int i = 0; i < numChunks; i++) {
+        const char *chunkEnd = bimData + fileLen;
+        if (i < numChunks - 1) {
+            chunkEnd = max(chunkStart, bimData + fileLen * (i + 1) / numChunks);
+            const char *lineEnd = (const char*)memchr(chunkEnd, '\n', bimData + fileLen - chunkEnd);
+            chunkEnd = lineEnd ? lineEnd + 1 : bimData + fileLen;
+        }
+        chunks[i].start = chunkStart;
+        chunks[i].end = chunkEnd;
+        chunkStart = chunkEnd;
+    }
+
+    vector<thread> threads;
+    for (int i = 1; i < numChunks; i++) {
+        threads.push_back(thread([this, &chunks, i, ancSnps] { ParseBimChunk(&chunks[i], ancSnps); }));
+    }
+    ParseBimChunk(&chunks[0], ancSnps);
+    for (auto& t : threads) t.join();
+
+    if (bimData) munmap((void*)bimData, fileLen);
 
     numBimSnps = 0;
-    while (fgets(fpLine, lineLen, ifp) != NULL && fileIsValid == true) {
-        sscanf(fpLine, "%s %s %s %d %s %s", chrStr, rsStr, cm, &pos, refStr, altStr);
+    for (int i = 0; i < numChunks; i++) {
+        const BimSaveSnps& chunkSnps = chunks[i].saveSnps;
+        for (int j = 0; j < chunkSnps.bimSnpIds.size(); j++) {
+            saveSnps.bimSnpIds.push_back(numBimSnps + chunkSnps.bimSnpIds[j]);
+        }
+        saveSnps.rsAncSnpIds.insert(saveSnps.rsAncSnpIds.end(), chunkSnps.rsAncSnpIds.begin(), chunkSnps.rsAncSnpIds.end());
+        saveSnps.pos37SnpIds.insert(saveSnps.pos37SnpIds.end(), chunkSnps.pos37SnpIds.begin(), chunkSnps.pos37SnpIds.end());
+        saveSnps.pos38SnpIds.insert(saveSnps.pos38SnpIds.end(), chunkSnps.pos38SnpIds.begin(), chunkSnps.pos38SnpIds.end());
+        saveSnps.refs.insert(saveSnps.refs.end(), chunkSnps.refs.begin(), chunkSnps.refs.end());
+        saveSnps.alts.insert(saveSnps.alts.end(), chunkSnps.alts.begin(), chunkSnps.alts.end());
+        saveSnps.numRsAncSnps += chunkSnps.numRsAncSnps;
+        saveSnps.numPos37Snps += chunkSnps.numPos37Snps;
+        saveSnps.numPos38Snps += chunkSnps.numPos38Snps;
+
+        numBimSnps += chunks[i].numSnps;
+        if (!chunks[i].posIsSorted) posIsSorted = false;
+    }
 
-        int chr = GetChromosomeFromString(chrStr);
-        int rsNum = GetRsNumFromString(rsStr);
+    printf("\tParsed %.1f MB with %d threads in %.3f seconds\n", fileLen / 1048576.0, numChunks, GetWallSeconds() - t1);
 
-        int rsAncSnpId = ancSnps->FindSnpIdGivenRs(rsNum);
-        int pos37SnpId = ancSnps->FindSnpIdGivenChrPos(chr, pos, 37);
-        int pos38SnpId = ancSnps->FindSnpIdGivenChrPos(chr, pos, 38);
+    MatchAncestrySnps(ancSnps);
 
-        if (rsAncSnpId > -1 || pos37SnpId > -1 || pos38SnpId > -1) {
-            char ref = 0, alt = 0;
-            if (strlen(refStr) == 1) ref = refStr[0];
-            if (strlen(altStr) == 1) alt = altStr[0];
+    return numBimSnps;
+}
 
-            bimSnpIds.push_back(numBimSnps);
-            rsAncSnpIds.push_back(rsAncSnpId);
-            pos37SnpIds.push_back(pos37SnpId);
-            pos38SnpIds.push_back(pos38SnpId);
-            refs.push_back(ref);
-            alts.push_back(alt);
+// Saves SNP snpNo of the file if it might be an ancestry SNP. Only reads the ancestry SNPs, so the chunks of a file
+// can be saved by several threads, each with its own position cursor.
+void BimFileAncestrySnps::SaveFileSnp(BimSaveSnps *snps, int snpNo, int chr, int rsNum, int pos, const char *refStr,
+int refLen, const char *altStr, int altLen, AncestrySnps *ancSnps, AncSnpPosCursor *posCursor)
+{
+    int rsAncSnpId = ancSnps->FindSnpIdGivenRs(rsNum);
+    int pos37SnpId = posCursor->FindSnpIdGivenChrPos(chr, pos, 37);
+    int pos38SnpId = posCursor->FindSnpIdGivenChrPos(chr, pos, 38);
+
+    if (rsAncSnpId > -1 || pos37SnpId > -1 || pos38SnpId > -1) {
+        char ref = 0, alt = 0;
+        if (refLen == 1) ref = refStr[0];
+        if (altLen == 1) alt = altStr[0];
+
+        snps->bimSnpIds.push_back(snpNo);
+        snps->rsAncSnpIds.push_back(rsAncSnpId);
+        snps->pos37SnpIds.push_back(pos37SnpId);
+        snps->pos38SnpIds.push_back(pos38SnpId);
+        snps->refs.push_back(ref);
+        snps->alts.push_back(alt);
+
+        if (rsAncSnpId > -1) snps->numRsAncSnps++;
+        if (pos37SnpId > -1) snps->numPos37Snps++;
+        if (pos38SnpId > -1) snps->numPos38Snps++;
+    }
+}
+
+// Finds the columns from the header line of a .pvar file. Returns false if a required column is missing.
+bool BimFileAncestrySnps::SetPvarColumns(const char *line, int lineLen)
+{
+    pvarCols = {-1, -1, -1, -1, -1, 0};
 
-            if (rsAncSnpId > -1) numRsAncSnps++;
-            if (pos37SnpId > -1) numPos37Snps++;
-            if (pos38SnpId > -1) numPos38Snps++;
+    int colNo = 0;
+    for (int stPos = 1; stPos < lineLen; colNo++) {
+        int edPos = stPos;
+        while (edPos < lineLen && line[edPos] != '\t' && line[edPos] != ' ') edPos++;
+        string col(line + stPos, edPos - stPos);
+
+        if      (col == "CHROM") pvarCols.chr = colNo;
+        else if (col == "POS")   pvarCols.pos = colNo;
+        else if (col == "ID")    pvarCols.id  = colNo;
+        else if (col == "REF")   pvarCols.ref = colNo;
+        else if (col == "ALT")   pvarCols.alt = colNo;
+
+        stPos = edPos + 1;
+    }
+
+    pvarCols.numCols = max(max(max(pvarCols.chr, pvarCols.pos), max(pvarCols.id, pvarCols.ref)), pvarCols.alt) + 1;
+
+    return pvarCols.chr > -1 && pvarCols.pos > -1 && pvarCols.id > -1 && pvarCols.ref > -1 && pvarCols.alt > -1;
+}
+
+// Parses one line of a .pvar file. Lines before the header line starting with "#CHROM" are skipped.
+// Without the header line, the columns are the same as in a .bim file: CHROM, ID, CM (optional), POS, ALT, REF.
+// Returns false if the line doesn't have the expected columns.
+bool BimFileAncestrySnps::ParsePvarLine(const char *line, int lineLen, AncestrySnps *ancSnps,
+AncSnpPosCursor *posCursor)
+{
+    if (lineLen == 0) return true;
 
-            numSaveSnps++;
+    if (line[0] == '#') {
+        if (lineLen > 6 && strncmp(line, "#CHROM", 6) == 0) {
+            if (!SetPvarColumns(line, lineLen)) {
+                cout << "\nERROR: Header line of " << filename << " should have CHROM, POS, ID, REF and ALT columns\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const int maxCols = 64;
+    const char *fields[maxCols];
+    int fieldLens[maxCols];
+    int numFields = 0;
+    int numNeedCols = pvarCols.numCols > 0 ? pvarCols.numCols : 6;
+
+    for (int stPos = 0; stPos < lineLen && numFields < numNeedCols && numFields < maxCols; ) {
+        while (stPos < lineLen && (line[stPos] == '\t' || line[stPos] == ' ')) stPos++;
+        if (stPos >= lineLen) break;
+        int edPos = stPos;
+        while (edPos < lineLen && line[edPos] != '\t' && line[edPos] != ' ') edPos++;
+
+        fields[numFields] = line + stPos;
+        fieldLens[numFields] = edPos - stPos;
+        numFields++;
+        stPos = edPos;
+    }
+
+    if (pvarCols.numCols == 0) {
+        // No header line
+        if (numFields == 6) pvarCols = {0, 3, 1, 5, 4, 6};
+        else if (numFields == 5) pvarCols = {0, 2, 1, 4, 3, 5};
+    }
+
+    if (pvarCols.numCols == 0 || numFields < pvarCols.numCols) {
+        cout << "\nERROR: Line " << numBimSnps + 1 << " of " << filename << " doesn't have all the columns\n";
+        return false;
+    }
+
+    int chr = GetChromosomeFromString(fields[pvarCols.chr], fieldLens[pvarCols.chr]);
+    int rsNum = GetRsNumFromString(fields[pvarCols.id], fieldLens[pvarCols.id]);
+    int pos = atoi(fields[pvarCols.pos]);
+
+    SaveFileSnp(&saveSnps, numBimSnps, chr, rsNum, pos, fields[pvarCols.ref], fieldLens[pvarCols.ref],
+                fields[pvarCols.alt], fieldLens[pvarCols.alt], ancSnps, posCursor);
+    numBimSnps++;
+
+    return true;
+}
+
+// Reads a .pvar file, or a compressed .bim file, as a stream of inflated chunks.
+// The REF and ALT alleles of a .pvar file are saved as the first and second alleles of the .bim files,
+// since the genotypes in the .pgen file are the counts of the ALT allele. The lines of a .bim file are parsed
+// the same way, with the columns fixed to CHR, ID, CM, POS, A1, A2.
+int BimFileAncestrySnps::ReadAncestrySnpsFromStream(string snpFile, AncestrySnps *ancSnps, bool isBim)
+{
+    BgzfReader reader(snpFile, numThreads);
+    if (!reader.Open()) {
+        if (!reader.HasError()) cout << "\nERROR: Couldn't open " << snpFile << "\n";
+        return 0;
+    }
+
+    if (isBim) pvarCols = {0, 3, 1, 4, 5, 6};
+    else       pvarCols = {-1, -1, -1, -1, -1, 0};
+    numBimSnps = 0;
+    AncSnpPosCursor posCursor(ancSnps);
+
+    string lineLeft = "";   // Part of a line at the end of the last chunk
+    const char *chunk;
+    int chunkLen;
+    bool fileIsValid = true;
+
+    while (fileIsValid && (chunkLen = reader.ReadChunk(&chunk)) > 0) {
+        int stPos = 0;
+        for (int pos = 0; pos < chunkLen && fileIsValid; pos++) {
+            if (chunk[pos] != '\n') continue;
+
+            int edPos = pos > 0 && chunk[pos-1] == '\r' ? pos - 1 : pos;
+            if (lineLeft.empty()) {
+                fileIsValid = ParsePvarLine(chunk + stPos, edPos - stPos, ancSnps, &posCursor);
+            }
+            else {
+                lineLeft.append(chunk + stPos, pos - stPos);
+                if (!lineLeft.empty() && lineLeft.back() == '\r') lineLeft.pop_back();
+                fileIsValid = ParsePvarLine(lineLeft.c_str(), lineLeft.length(), ancSnps, &posCursor);
+                lineLeft = "";
+            }
+            stPos = pos + 1;
         }
 
-        numBimSnps++;
+        if (stPos < chunkLen) lineLeft.append(chunk + stPos, chunkLen - stPos);
     }
 
-    fclose(ifp);
+    if (fileIsValid && !lineLeft.empty()) fileIsValid = ParsePvarLine(lineLeft.c_str(), lineLeft.length(), ancSnps, &posCursor);
+    if (chunkLen < 0 || reader.HasError()) fileIsValid = false;
 
-    // Rs ID, GB37, or GB38, use whichever returns the most ancestry SNPs to find these SNPs
+    reader.ShowSummary();
+    reader.Close();
+    posIsSorted = posCursor.IsSorted();
+
+    if (!fileIsValid) {
+        cout << "\nERROR: Failed to read SNPs from " << snpFile << "\n";
+        numBimSnps = 0;
+        saveSnps = {};
+    }
+
+    MatchAncestrySnps(ancSnps);
+
+    return numBimSnps;
+}
+
+// Rs ID, GB37, or GB38, use whichever returns the most ancestry SNPs to find these SNPs
+void BimFileAncestrySnps::MatchAncestrySnps(AncestrySnps *ancSnps)
+{
+    int i;
+    int numSaveSnps = saveSnps.bimSnpIds.size();
     ancSnpType = AncestrySnpType::RSID;
-    int maxBimAncSnps = numRsAncSnps;
+    int maxBimAncSnps = saveSnps.numRsAncSnps;
 
-    if (numPos37Snps > maxBimAncSnps) {
+    if (saveSnps.numPos37Snps > maxBimAncSnps) {
         ancSnpType = AncestrySnpType::GB37;
-        maxBimAncSnps = numPos37Snps;
+        maxBimAncSnps = saveSnps.numPos37Snps;
     }
 
-    if (numPos38Snps > maxBimAncSnps) {
+    if (saveSnps.numPos38Snps > maxBimAncSnps) {
         ancSnpType = AncestrySnpType::GB38;
-        maxBimAncSnps = numPos38Snps;
+        maxBimAncSnps = saveSnps.numPos38Snps;
     }
 
     for (i = 0; i < numBimSnps; i++) {
@@ -158,24 +399,23 @@ int BimFileAncestrySnps::ReadAncestrySnpsFromFile(string bimFile, AncestrySnps*
     numBimAncSnps = 0;
     int numSwaps = 0;
     for (i = 0; i < numSaveSnps; i++) {
-        int bimSnpId = bimSnpIds[i];
-        char ref = refs[i];
-        char alt = alts[i];
+        int bimSnpId = saveSnps.bimSnpIds[i];
+        char ref = saveSnps.refs[i];
+        char alt = saveSnps.alts[i];
 
         int ancSnpId = -1;
         if (ancSnpType == AncestrySnpType::RSID) {
-            ancSnpId = rsAncSnpIds[i];
+            ancSnpId = saveSnps.rsAncSnpIds[i];
         }
         else if (ancSnpType == AncestrySnpType::GB37) {
-            ancSnpId = pos37SnpIds[i];
+            ancSnpId = saveSnps.pos37SnpIds[i];
         }
         else if (ancSnpType == AncestrySnpType::GB38) {
-            ancSnpId = pos38SnpIds[i];
+            ancSnpId = saveSnps.pos38SnpIds[i];
         }
 
         if (ancSnpId > -1) {
-            AncestrySnp ancSnp = ancSnps->GetAncestrySnp(ancSnpId);
-            int match = CompareAncestrySnpAlleles(ref, alt, ancSnp.ref, ancSnp.alt);
+            int match = CompareAncestrySnpAlleles(ref, alt, ancSnps->snpRefs[ancSnpId], ancSnps->snpAlts[ancSnpId]);
 
             // Only save SNPs with expected alleles
             if (match) {
@@ -186,6 +426,7 @@ int BimFileAncestrySnps::ReadAncestrySnpsFromFile(string bimFile, AncestrySnps*
                     ancIdAdded[ancSnpId] = true;
                     bimSnpAncSnpIds[bimSnpId] = ancSnpId;
                     bimSnpAlleleMatches[bimSnpId] = match;
+                    ancSnpBimPoses.push_back(bimSnpId);
                     if (match == -2 || match ==  2) numSwaps++;
                     numGoodAncSnps++;
                 }
@@ -194,7 +435,7 @@ int BimFileAncestrySnps::ReadAncestrySnpsFromFile(string bimFile, AncestrySnps*
         }
     }
 
-    return numBimSnps;
+    saveSnps = {};
 }
 
 void BimFileAncestrySnps::ShowSummary()
@@ -209,6 +450,7 @@ void BimFileAncestrySnps::ShowSummary()
     cout << "\t" << showSnpType << " are used to find ancestry SNPs.\n";
     cout << "\t" << numGoodAncSnps << " SNPs have expected alleles and will be used for ancestry inference.\n";
     if (numDupAncSnps > 0) cout << "\t" << numDupAncSnps << " ancestry SNPs have multiple entries.\n";
+    if (!posIsSorted) cout << "\tSNPs are not sorted by position. Positions were matched with hash lookups.\n";
 
     if (numBadAncSnps > 0) {
         cout << "\t" << numBadAncSnps << " ancestry SNPs do not have expected alleles.\n";
@@ -1,9 +1,50 @@
 #ifndef BIM_FILE_ANCESTRY_SNPS_H
 #define BIM_FILE_ANCESTRY_SNPS_H
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include "Util.h"
 #include "AncestrySnps.h"
+#include "BgzfReader.h"
 
+static const long BIM_MIN_CHUNK_BYTES = 4194304;   // A .bim file is split for parallel parsing into chunks at least this large
+
+// SNPs of the file that might be ancestry SNPs, saved while the file is read
+struct BimSaveSnps
+{
+    vector<int> bimSnpIds;
+    vector<int> rsAncSnpIds;
+    vector<int> pos37SnpIds;
+    vector<int> pos38SnpIds;
+    vector<char> refs;
+    vector<char> alts;
+
+    int numRsAncSnps = 0;
+    int numPos37Snps = 0;
+    int numPos38Snps = 0;
+};
+
+// Part of a .bim file parsed by one thread, from a line start to a line start. SNP IDs in saveSnps are
+// numbered from the start of the chunk, and are shifted when the chunks are merged.
+struct BimFileChunk
+{
+    const char *start;
+    const char *end;
+    int numSnps;
+    bool posIsSorted;
+    BimSaveSnps saveSnps;
+};
+
+// Column numbers of the fields used in a .pvar file. numCols is 0 until the columns are known.
+struct PvarColumns
+{
+    int chr, pos, id, ref, alt;
+    int numCols;
+};
+
+// SNPs from a PLINK .bim file, or a PLINK 2 .pvar file
 class BimFileAncestrySnps
 {
     int totAncSnps;
@@ -13,10 +54,8 @@ class BimFileAncestrySnps
     int numBimAncSnps;
     int numGoodAncSnps;
     int numDupAncSnps = 0;
-
-    int numRsAncSnps;
-    int numPos37Snps;
-    int numPos38Snps;
+    int numThreads;
+    bool posIsSorted = true;       // False if the positions were matched with hash lookups since the file isn't sorted
 
     AncestrySnpType ancSnpType;
 
@@ -24,20 +63,34 @@ class BimFileAncestrySnps
     // Ancestry SNP ID is 0-based. If a bim SNP is not an Ancestry SNP, the SNP ID is -1
     vector<int> bimSnpAncSnpIds;
     vector<int> bimSnpAlleleMatches; // SNP allele matches: 0 = not match; -1, -2: flip; 2, -2: swap
+    vector<int> ancSnpBimPoses;      // Positions of the bim SNPs with Ancestry SNP IDs, in the order of the file
+
+    BimSaveSnps saveSnps;
+    PvarColumns pvarCols;
 
 private:
     char FlipAllele(char);
+    void SaveFileSnp(BimSaveSnps*, int, int, int, int, const char*, int, const char*, int, AncestrySnps*,
+                     AncSnpPosCursor*);
+    void MatchAncestrySnps(AncestrySnps*);
+    void ParseBimChunk(BimFileChunk*, AncestrySnps*);
+    int ReadAncestrySnpsFromBimFile(string, AncestrySnps*);
+    bool SetPvarColumns(const char*, int);
+    bool ParsePvarLine(const char*, int, AncestrySnps*, AncSnpPosCursor*);
+    int ReadAncestrySnpsFromStream(string, AncestrySnps*, bool);
 
 public:
     BimFileAncestrySnps();
     BimFileAncestrySnps(int);
     ~BimFileAncestrySnps();
     void SetTotalAncestrySnps(int totSnps) { totAncSnps = totSnps; };
+    void SetNumThreads(int threads) { numThreads = threads > 0 ? threads : 1; };
     char* RecodeBedSnpGeno(char*, bool);
     int ReadAncestrySnpsFromFile(string, AncestrySnps*);
     int CompareAncestrySnpAlleles(const char, const char, const char, const char);
     int GetNumBimSnps() { return numBimSnps; };
     int GetNumBimAncestrySnps() { return numBimAncSnps; };
+    const vector<int>& GetAncSnpBimPositions() { return ancSnpBimPoses; };
     int GetAncSnpIdGivenBimSnpPos(int bimSnpPos) {
         return bimSnpPos >= 0 && bimSnpPos < numBimSnps ? bimSnpAncSnpIds[bimSnpPos] : -1;
     };
@@ -0,0 +1,94 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include "Util.h"
+
+// A blocking FIFO queue with a fixed capacity, used to pass work between the stages of a pipeline.
+// Push() waits while the queue is full, and Pop() waits while it is empty. After Close(), Pop()
+// returns false once the queue is drained.
+// Depths and waiting times are recorded to show which stage is the bottleneck.
+template <typename T>
+class BoundedQueue
+{
+private:
+    deque<T> items;
+    size_t capacity;
+    bool closed;
+    mutex mtx;
+    condition_variable notFull;
+    condition_variable notEmpty;
+
+    long numPushes;
+    long sumDepths;         // Sum of the queue depths after each push
+    size_t maxDepth;
+    double pushWaitSecs;    // Total time producers waited for a free slot
+    double popWaitSecs;     // Total time consumers waited for an item
+
+public:
+    BoundedQueue(size_t cap)
+    {
+        capacity = cap > 0 ? cap : 1;
+        closed = false;
+        numPushes = 0;
+        sumDepths = 0;
+        maxDepth = 0;
+        pushWaitSecs = 0;
+        popWaitSecs = 0;
+    }
+
+    void Push(T item)
+    {
+        unique_lock<mutex> lock(mtx);
+        if (items.size() >= capacity) {
+            double t1 = GetWallSeconds();
+            notFull.wait(lock, [this] { return items.size() < capacity; });
+            pushWaitSecs += GetWallSeconds() - t1;
+        }
+
+        items.push_back(item);
+        numPushes++;
+        sumDepths += items.size();
+        if (items.size() > maxDepth) maxDepth = items.size();
+
+        lock.unlock();
+        notEmpty.notify_one();
+    }
+
+    bool Pop(T *item)
+    {
+        unique_lock<mutex> lock(mtx);
+        if (items.empty() && !closed) {
+            double t1 = GetWallSeconds();
+            notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+            popWaitSecs += GetWallSeconds() - t1;
+        }
+        if (items.empty()) return false;
+
+        *item = items.front();
+        items.pop_front();
+
+        lock.unlock();
+        notFull.notify_one();
+
+        return true;
+    }
+
+    void Close()
+    {
+        unique_lock<mutex> lock(mtx);
+        closed = true;
+        lock.unlock();
+        notEmpty.notify_all();
+    }
+
+    size_t GetCapacity() { return capacity; };
+    size_t GetMaxDepth() { return maxDepth; };
+    double GetMeanDepth() { return numPushes > 0 ? double(sumDepths) / numPushes : 0; };
+    double GetPushWaitSecs() { return pushWaitSecs; };
+    double GetPopWaitSecs() { return popWaitSecs; };
+};
+
+#endif
@@ -3,94 +3,159 @@
 using namespace std;
 
 
-FamSample::FamSample(string smp, string dad, string mom, int gender)
-{
-    name = smp;
-    father = dad;
-    mother = mom;
-    sex = gender;
-}
-
-
 FamFileSamples::FamFileSamples(string file)
 {
     filename = file;
     numFamSmps = 0;
     numMales = 0;
     numFemales = 0;
+    hasErr = false;
 
     ReadSamplesFromFile();
 }
 
-bool FamFileSamples::Summarize()
+// Keeps the samples selected by the keep/remove lists. The number of samples in the file is not changed.
+bool FamFileSamples::SelectSamples(const SampleSubset *smpSubset)
 {
-    bool success = false;
-    int arraySize = samples.size();
-
-    if (arraySize == numFamSmps) {
-        for (int i = 0; i < numFamSmps; i++) {
-            FamSample smp = samples[i];
-            if (smp.sex == 1) {
-                numMales++;
-            }
-            else if (smp.sex == 2) {
-                numFemales++;
-            }
-        }
+    if (!smpSubset->SelectSamples(smpIds, &selSmpNos)) return false;
 
-        success = true;
+    if (selSmpNos.size() == numFamSmps) {
+        selSmpNos.clear();
+    }
+    else {
+        smpIds.SelectIds(selSmpNos);
     }
 
-    return success;
+    return true;
 }
 
 void FamFileSamples::ShowSummary()
 {
-    bool success = false;
     cout << "Total " << numFamSmps << " samples in fam file " << filename << ".\n";
     cout << "\t" << numMales << " males\n";
     cout << "\t" << numFemales << " females\n";
     cout << "\n";
 }
 
+// Reads a PLINK .fam file, or a PLINK 2 .psam file. A .psam file has a header line starting with #FID or #IID
+// that names the columns. Without the header line, the columns are the same as in a .fam file.
+// A gzip or zstd compressed .fam file is inflated in chunks, and the lines are split from the chunks.
+// Only the sample IDs are kept, in smpIds. The sexes are counted for the summary.
 int FamFileSamples::ReadSamplesFromFile()
 {
     int numFileSmps = 0;
 
     ASSERT(FileExists(filename.c_str()), "File " << filename << " does not exist.");
 
-    int lineLen = 300;
-    char fpLine[lineLen];
+    bool isZipped = IsCompressedFile(filename);
+    ifstream ifs;
+    BgzfReader reader(filename);
+    bool isOpen = false;
+    if (isZipped) {
+        isOpen = reader.Open();
+    }
+    else {
+        ifs.open(filename);
+        isOpen = ifs.is_open();
+    }
+    if (!isOpen) {
+        // The reader shows why a compressed file can't be opened, e.g., zstd support isn't built in
+        if (!isZipped) cout << "\nERROR: Couldn't open file " << filename << "\n";
+        hasErr = true;
+        return 0;
+    }
 
-    FILE *ifp = fopen(filename.c_str(), "r");
-    ASSERT(ifp, "Couldn't open file " << filename << ".\n");
+    string chunkLines = "";    // Inflated data not split into lines yet
+    size_t linePos = 0;
+    auto getLine = [&](string& line) -> bool {
+        if (!isZipped) return bool(getline(ifs, line));
+
+        while (true) {
+            size_t endPos = chunkLines.find('\n', linePos);
+            if (endPos != string::npos) {
+                line.assign(chunkLines, linePos, endPos - linePos);
+                linePos = endPos + 1;
+                break;
+            }
 
-    int lineNo = 0;
-    bool fileIsValid = true;
+            chunkLines.erase(0, linePos);
+            linePos = 0;
 
-    int numSmps = 0;
-    int smpSex, pheno;
-    char famId[80], smpId[80], dadId[80], momId[80];
+            const char *chunk;
+            int chunkLen = reader.ReadChunk(&chunk);
+            if (chunkLen <= 0) {
+                if (chunkLines.empty()) return false;
+                line = chunkLines;
+                chunkLines = "";
+                break;
+            }
+            chunkLines.append(chunk, chunkLen);
+        }
 
-    while (fgets(fpLine, lineLen, ifp) != NULL && fileIsValid == true) {
-        sscanf(fpLine, "%s %s %s %s %d %d", famId, smpId, dadId, momId, &smpSex, &pheno);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    };
+
+    // Columns of the sample ID and the sex. A .psam header line might name other columns.
+    int iidCol = 1, sexCol = 4;
+    const int maxCols = 64;
+    const char *fields[maxCols];
+    int fieldLens[maxCols];
+
+    string line;
+    while (getLine(line)) {
+        if (line.empty()) continue;
+
+        if (line[0] == '#') {
+            if (line.compare(0, 4, "#FID") == 0 || line.compare(0, 4, "#IID") == 0) {
+                iidCol = sexCol = -1;
+                istringstream cols(line.substr(1));
+                string col;
+                for (int colNo = 0; cols >> col; colNo++) {
+                    if      (col == "IID") iidCol = colNo;
+                    else if (col == "SEX") sexCol = colNo;
+                }
+            }
+            continue;
+        }
+        if (iidCol < 0 || iidCol >= maxCols) continue;
+
+        // Splits the line in place, up to the last column needed
+        int numNeedCols = max(iidCol, sexCol) + 1;
+        int numFields = 0;
+        const char *lineEnd = line.c_str() + line.length();
+        for (const char *p = line.c_str(); numFields < numNeedCols; ) {
+            while (p < lineEnd && (*p == ' ' || *p == '\t')) p++;
+            if (p >= lineEnd) break;
+            const char *fieldEnd = p;
+            while (fieldEnd < lineEnd && *fieldEnd != ' ' && *fieldEnd != '\t') fieldEnd++;
+
+            fields[numFields] = p;
+            fieldLens[numFields] = fieldEnd - p;
+            numFields++;
+            p = fieldEnd;
+        }
+        if (iidCol >= numFields) continue;
 
-        if (!smpSex) smpSex = 0;
+        smpIds.AddId(fields[iidCol], fieldLens[iidCol]);
+        numFileSmps++;
 
-        if (smpId) {
-            FamSample sample(smpId, dadId, momId, smpSex);
-            samples.push_back(sample);
-            numFileSmps++;
+        if (sexCol > -1 && sexCol < numFields && fieldLens[sexCol] == 1) {
+            char sex = fields[sexCol][0];
+            if      (sex == '1' || sex == 'M' || sex == 'm') numMales++;
+            else if (sex == '2' || sex == 'F' || sex == 'f') numFemales++;
         }
+    }
 
-        lineNo++;
+    if (isZipped) {
+        if (reader.HasError()) {
+            cout << "\nERROR: Failed to inflate file " << filename << "\n";
+            hasErr = true;
+        }
+        reader.Close();
     }
-    fclose(ifp);
 
     numFamSmps = numFileSmps;
 
-    Summarize();
-
     return numFileSmps;
 }
-
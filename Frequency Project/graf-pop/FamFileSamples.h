@@ -2,37 +2,32 @@
 #define FAM_FILE_SAMPLES_H
 
 #include "Util.h"
+#include "SampleSubset.h"
+#include "SampleIdTable.h"
+#include "BgzfReader.h"
 
-class FamSample
-{
-public:
-    // Info from the fam file
-    string name;
-    string father;
-    string mother;
-    int sex;
-
-public:
-    FamSample(string, string, string, int);
-};
-
+// Samples of a PLINK .fam file or PLINK 2 .psam file. Only the sample IDs are kept, in a SampleIdTable,
+// since the parents and the phenotypes aren't used.
 class FamFileSamples
 {
     string filename;
     int numFamSmps;
     int numMales;
     int numFemales;
-
-    bool Summarize();
+    bool hasErr;               // The file couldn't be opened or inflated
 
 private:
     int ReadSamplesFromFile();
 
 public:
-    vector<FamSample> samples;
+    SampleIdTable smpIds;      // IDs of the selected samples, or of all samples in the file
+    vector<int> selSmpNos;     // Positions in the fam file of the selected samples. Empty if all samples are used.
 
     FamFileSamples(string);
     int GetNumFamSamples() {return numFamSmps;};
+    int GetNumSelSamples() {return smpIds.GetNumIds();};
+    bool HasError() {return hasErr;};
+    bool SelectSamples(const SampleSubset*);
     void ShowSummary();
 };
 
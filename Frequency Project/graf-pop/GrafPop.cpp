@@ -4,7 +4,15 @@ SampleGenoAncestry *smpGenoAnc = NULL;
 
 int main(int argc, char* argv[])
 {
-    string usage = "Usage: grafpop <Binary PLINK set or VCF file> <output file>\n";
+    string usage = "Usage: grafpop [options] <Binary PLINK set, PLINK 2 set, VCF or BCF file> <output file>\n"
+                   "       grafpop [options] <File listing PLINK sets, VCF or BCF files, or quoted pattern like 'chr*.vcf.gz'> <output file>\n"
+                   "Options:\n"
+                   "       --keep <file>     Only use the samples listed in the file, one sample ID per line\n"
+                   "       --remove <file>   Don't use the samples listed in the file\n"
+                   "       --max-memory <MB> Read the samples in blocks, so that the genotypes of each block use at most\n"
+                   "                         about this many megabytes. Results are the same as when all samples are read\n"
+                   "       --threads <N>     Number of threads to decompress, parse and score the genotypes. Default is\n"
+                   "                         the number of CPUs minus 1\n";
 
     string disclaimer =
     "\n *==========================================================================="
@@ -35,7 +43,44 @@ int main(int argc, char* argv[])
     "\n *"
     "\n *===========================================================================";
 
-    if (argc < 3) {
+    string keepFile = "", removeFile = "";
+    long maxMemoryMb = 0;
+    int numThreads = 0;
+    vector<string> fileArgs;
+    bool argsOk = true;
+
+    for (int argNo = 1; argNo < argc; argNo++) {
+        string arg = argv[argNo];
+        if (arg == "--keep" || arg == "--remove" || arg == "--max-memory" || arg == "--threads") {
+            if (argNo + 1 < argc) {
+                if (arg == "--keep") keepFile = argv[++argNo];
+                else if (arg == "--remove") removeFile = argv[++argNo];
+                else if (arg == "--max-memory") maxMemoryMb = atol(argv[++argNo]);
+                else numThreads = atoi(argv[++argNo]);
+
+                if (arg == "--max-memory" && maxMemoryMb < 1) {
+                    cout << "\nERROR: --max-memory should be a positive number of megabytes\n";
+                    argsOk = false;
+                }
+                if (arg == "--threads" && numThreads < 1) {
+                    cout << "\nERROR: --threads should be a positive number\n";
+                    argsOk = false;
+                }
+            }
+            else {
+                argsOk = false;
+            }
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            cout << "\nERROR: Unknown option " << arg << "\n";
+            argsOk = false;
+        }
+        else {
+            fileArgs.push_back(arg);
+        }
+    }
+
+    if (!argsOk || fileArgs.size() != 2) {
         cout << disclaimer << "\n\n";
         cout << usage << "\n";
         exit(0);
@@ -45,107 +90,280 @@ int main(int argc, char* argv[])
     gettimeofday(&t1, NULL);
 
     string genoDs, outputFile;
-    genoDs = argv[1];
-    outputFile = argv[2];
+    genoDs = fileArgs[0];
+    outputFile = fileArgs[1];
+
+    // The samples blocks are selected the same way as the samples in the keep/remove lists
+    SampleSubset *smpSubset = NULL;
+    if (keepFile != "" || removeFile != "" || maxMemoryMb > 0) {
+        smpSubset = new SampleSubset();
+        if (keepFile != "" && !smpSubset->ReadKeepFile(keepFile)) return 0;
+        if (removeFile != "" && !smpSubset->ReadRemoveFile(removeFile)) return 0;
+        cout << "\n";
+        smpSubset->ShowSummary();
+    }
+
+    // Genotypes might be split into multiple files, e.g., by chromosome
+    vector<string> genoFiles = MultiFileAncestrySnpGeno::FindGenoFiles(genoDs);
+    bool isMultiFile = !genoFiles.empty();
 
     string fileBase = "";
     GenoDatasetType fileType = CheckGenoDataFile(genoDs, &fileBase);
 
-    if (fileType == GenoDatasetType::NOT_EXISTS) {
+    if (isMultiFile) {
+        cout << "\nFound " << genoFiles.size() << " genotype files from " << genoDs << "\n";
+    }
+    else if (fileType == GenoDatasetType::NOT_EXISTS) {
         cout << "\nERROR: Genotype file " << genoDs << " doesn't exist!\n\n";
     	return 0;
     }
-    else if (fileType == GenoDatasetType::IS_PLINK_GZ) {
-        cout << "\nERROR: PLINK set " << genoDs << " is zipped. Please unzip it.\n\n";
-        return 0;
-    }
     else if (fileType == GenoDatasetType::IS_OTHER) {
-        cout << "\nERROR: Genotype file " << genoDs << " should be a binary PLINK set or vcf or vcf.gz file..\n\n";
+        cout << "\nERROR: Genotype file " << genoDs << " should be a binary PLINK set, PLINK 2 set or vcf, vcf.gz or bcf file..\n\n";
         return 0;
     }
+    else if (fileType == GenoDatasetType::IS_PGEN) {
+        string pgenFile = fileBase + ".pgen";
+        string psamFile = fileBase + ".psam";
+
+        if (!FileExists(pgenFile.c_str()) || !FileExists(psamFile.c_str()) || FindPvarFile(fileBase) == "") {
+            if (!FileExists(pgenFile.c_str())) cout << "\nERROR: didn't find " << pgenFile << "\n";
+            if (FindPvarFile(fileBase) == "") cout << "\nERROR: didn't find " << fileBase << ".pvar or .pvar.zst\n";
+            if (!FileExists(psamFile.c_str())) cout << "\nERROR: didn't find " << psamFile << "\n";
+            cout << "\n";
+            return 0;
+        }
+    }
+    else if (fileType == GenoDatasetType::IS_PLINK || fileType == GenoDatasetType::IS_PLINK_GZ) {
+        // Each file of the set might be gzip or zstd compressed
+        string bedFile = FindPlinkFile(fileBase, ".bed");
+        string bimFile = FindPlinkFile(fileBase, ".bim");
+        string famFile = FindPlinkFile(fileBase, ".fam");
+
+        if (bedFile == "" || bimFile == "" || famFile == "") {
+            if (bedFile == "") cout << "\nERROR: didn't find " << fileBase << ".bed, .bed.gz or .bed.zst\n";
+            if (bimFile == "") cout << "\nERROR: didn't find " << fileBase << ".bim, .bim.gz or .bim.zst\n";
+            if (famFile == "") cout << "\nERROR: didn't find " << fileBase << ".fam, .fam.gz or .fam.zst\n";
+            cout << "\n";
+            return 0;
+        }
 
-    string ancSnpFile = FindFile("AncInferSNPs.txt");
-    if (ancSnpFile == "") {
-        cout << "\nERROR: didn't find file AncInferSNPs.txt. Please put the file under 'data' directory.\n\n";
-        return 0;
+#ifndef GRAFPOP_ZSTD
+        // zstd compressed files are only read when grafpop is built with libzstd
+        string plinkFiles[3] = {bedFile, bimFile, famFile};
+        for (int i = 0; i < 3; i++) {
+            if (IsZstdFile(plinkFiles[i])) {
+                cout << "\nERROR: " << plinkFiles[i] << " is zstd compressed. Please rebuild grafpop with 'make ZSTD=1' "
+                     << "to read zstd files, or decompress it with 'zstd -d'.\n\n";
+                return 0;
+            }
+        }
+#endif
     }
+
+    // The binary panel compiled by grafpop-panel is loaded much faster than the text file. It's only used if it's
+    // in the same directory as the text file, and was compiled from it.
     AncestrySnps *ancSnps = new AncestrySnps();
-    ancSnps->ReadAncestrySnpsFromFile(ancSnpFile);
+    string ancSnpFile = FindFile("AncInferSNPs.txt");
+    string panelFile = "";
+    if (ancSnpFile != "") {
+        size_t dirLen = ancSnpFile.rfind('/');
+        panelFile = (dirLen != string::npos ? ancSnpFile.substr(0, dirLen + 1) : "") + "AncInferSNPs.panel";
+        if (!FileExists(panelFile.c_str())) panelFile = "";
+    }
+    else {
+        panelFile = FindFile("AncInferSNPs.panel");
+    }
+    int numPanelSnps = panelFile != "" ? ancSnps->ReadPanelFile(panelFile, ancSnpFile) : 0;
+
+    if (numPanelSnps == 0) {
+        if (ancSnpFile == "") {
+            cout << "\nERROR: didn't find file AncInferSNPs.txt. Please put the file under 'data' directory.\n\n";
+            return 0;
+        }
+        if (ancSnps->ReadAncestrySnpsFromFile(ancSnpFile) == 0) return 0;
+    }
     //ancSnps->ShowAncestrySnps();
 
+    if (numThreads == 0) {
+        numThreads = thread::hardware_concurrency();
+        numThreads--;
+        if (numThreads < 1) numThreads = 1;
+    }
+
+    GenoDataset genoData;
+    genoData.genoDs = genoDs;
+    genoData.genoFiles = genoFiles;
+    genoData.fileType = fileType;
+    genoData.fileBase = fileBase;
+    genoData.ancSnps = ancSnps;
+    genoData.smpSubset = smpSubset;
+    genoData.numThreads = numThreads;
+    genoData.minAncSnps = 100;
+    genoData.isFirstPass = true;
+    genoData.vcfSnpType = AncestrySnpType::RSID;
+    genoData.vcfSnpLineOffsets = {};
+    genoData.bimSnps = NULL;
+
+    if (maxMemoryMb > 0) {
+        if (!InferAncestryInBlocks(&genoData, maxMemoryMb, outputFile)) return 0;
+    }
+    else {
+        smpGenoAnc = new SampleGenoAncestry(ancSnps, genoData.minAncSnps);
+        if (!ReadGenotypesAndScore(&genoData, false)) return 0;
+        smpGenoAnc->SaveAncestryResults(outputFile);
+    }
+
+    gettimeofday(&t2, NULL);
+    cout << "\n";
+    ShowTimeDiff(t1, t2);
+
+    return 1;
+}
+
+// Reads the genotypes of the selected samples into smpGenoAnc, and calculates their ancestry scores.
+// The genotypes are deleted after the scores are calculated if freeGenos is true.
+// Returns false if the genotypes couldn't be read or there are not enough ancestry SNPs.
+bool ReadGenotypesAndScore(GenoDataset *genoData, bool freeGenos)
+{
+    AncestrySnps *ancSnps = genoData->ancSnps;
     int totAncSnps = ancSnps->GetNumAncestrySnps();
-    int minAncSnps = 100;
+    int minAncSnps = genoData->minAncSnps;
+    string genoDs = genoData->genoDs;
+    bool isBlockMode = freeGenos;
+
+    if (!genoData->genoFiles.empty()) {
+        MultiFileAncestrySnpGeno *multiGeno = new MultiFileAncestrySnpGeno(genoData->genoFiles, ancSnps);
+        multiGeno->SetNumThreads(genoData->numThreads);
+        multiGeno->SetSampleSubset(genoData->smpSubset);
+        bool dataRead = multiGeno->ReadDataFromFiles();
+        if (!dataRead) {
+            cout << "\nFailed to read genotype data from " << genoDs << "\n\n";
+            return false;
+        }
+        multiGeno->ShowSummary();
+
+        int numAncSnps = multiGeno->ancSnpIds.size();
 
-    int numThreads = thread::hardware_concurrency();
-    numThreads--;
+        if (smpGenoAnc->HasEnoughAncestrySnps(numAncSnps)) {
+            smpGenoAnc->SetGenoSamples(multiGeno->samples);
+            smpGenoAnc->SetSnpGenoData(&multiGeno->ancSnpIds, &multiGeno->ancSnpGenos);
+        }
+        else {
+            cout << "\nWARNING: Ancestry inference not done due to lack of genotyped ancestry SNPs "
+             << "(at least " << minAncSnps << " ancestry SNPs are needed).\n\n";
+            return false;
+        }
 
-    smpGenoAnc = new SampleGenoAncestry(ancSnps, minAncSnps);
+        CalculateAncestryScores(genoData->numThreads);
+        if (freeGenos) delete multiGeno;
+    }
+    else if (genoData->fileType == GenoDatasetType::IS_VCF || genoData->fileType == GenoDatasetType::IS_VCF_GZ ||
+             genoData->fileType == GenoDatasetType::IS_BCF) {
+        VcfSampleAncestrySnpGeno *vcfGeno;
+        if (genoData->fileType == GenoDatasetType::IS_BCF) vcfGeno = new BcfSampleAncestrySnpGeno(genoDs, ancSnps);
+        else vcfGeno = new VcfSampleAncestrySnpGeno(genoDs, ancSnps);
+        vcfGeno->SetNumThreads(genoData->numThreads);
+        vcfGeno->SetSampleSubset(genoData->smpSubset);
+
+        // The later passes of the sample-block mode only read the lines used in the first pass
+        if (isBlockMode && genoData->isFirstPass) vcfGeno->SetSaveLineOffsets(true);
+        else if (isBlockMode) vcfGeno->SetSnpLineOffsets(genoData->vcfSnpLineOffsets);
 
-    if (fileType == GenoDatasetType::IS_VCF || fileType == GenoDatasetType::IS_VCF_GZ) {
-        VcfSampleAncestrySnpGeno *vcfGeno = new VcfSampleAncestrySnpGeno(genoDs, ancSnps);
         bool dataRead = vcfGeno->ReadDataFromFile();
         if (!dataRead) {
             cout << "\nFailed to read genotype data from " << genoDs << "\n\n";
-            return 0;
+            return false;
         }
         vcfGeno->ShowSummary();
-        vcfGeno->RecodeSnpGenotypes();
+
+        if (genoData->isFirstPass) {
+            vcfGeno->RecodeSnpGenotypes();
+            genoData->vcfSnpType = vcfGeno->GetAncestrySnpType();
+            if (vcfGeno->HasAncSnpLineOffsets()) genoData->vcfSnpLineOffsets = vcfGeno->vcfAncSnpLineOffsets;
+        }
+        else {
+            vcfGeno->RecodeSnpGenotypes(genoData->vcfSnpType);
+        }
 
         int numAncSnps = vcfGeno->vcfAncSnpIds.size();
-        int numVcfSmps = vcfGeno->GetNumSamples();
 
         if (smpGenoAnc->HasEnoughAncestrySnps(numAncSnps)) {
             smpGenoAnc->SetGenoSamples(vcfGeno->vcfSamples);
-            smpGenoAnc->SetSnpGenoData(&vcfGeno->vcfAncSnpIds, &vcfGeno->vcfAncSnpCodedGenos);
+            smpGenoAnc->SetSnpGenoData(&vcfGeno->vcfAncSnpIds, &vcfGeno->vcfAncSnpGenos);
         }
         else {
             cout << "\nWARNING: Ancestry inference not done due to lack of genotyped ancestry SNPs "
              << "(at least " << minAncSnps << " ancestry SNPs are needed).\n\n";
-            return 0;
+            return false;
         }
-    }
-    else if (fileType == GenoDatasetType::IS_PLINK) {
-        string bedFile = fileBase + ".bed";
-        string bimFile = fileBase + ".bim";
-        string famFile = fileBase + ".fam";
 
-        if ( !FileExists(bedFile.c_str()) ||
-             !FileExists(bimFile.c_str()) ||
-             !FileExists(famFile.c_str())    ) {
-            if (!FileExists(bedFile.c_str())) cout << "\nERROR: didn't find " << bedFile << "\n";
-            if (!FileExists(bimFile.c_str())) cout << "\nERROR: didn't find " << bimFile << "\n";
-            if (!FileExists(famFile.c_str())) cout << "\nERROR: didn't find " << famFile << "\n";
-            cout << "\n";
-            return 0;
-        }
+        CalculateAncestryScores(genoData->numThreads);
+        if (freeGenos) delete vcfGeno;
+    }
+    else if (genoData->fileType == GenoDatasetType::IS_PLINK || genoData->fileType == GenoDatasetType::IS_PLINK_GZ ||
+             genoData->fileType == GenoDatasetType::IS_PGEN) {
+        // PLINK 2 sets have the samples in .psam and the SNPs in .pvar, read the same way as .fam and .bim files
+        bool isPgen = genoData->fileType == GenoDatasetType::IS_PGEN;
+        string bedFile = isPgen ? genoData->fileBase + ".pgen" : FindPlinkFile(genoData->fileBase, ".bed");
+        string bimFile = isPgen ? FindPvarFile(genoData->fileBase) : FindPlinkFile(genoData->fileBase, ".bim");
+        string famFile = isPgen ? genoData->fileBase + ".psam" : FindPlinkFile(genoData->fileBase, ".fam");
 
         FamFileSamples *famSmps = new FamFileSamples(famFile);
+        if (famSmps->HasError()) return false;
         famSmps->ShowSummary();
+        if (genoData->smpSubset && !famSmps->SelectSamples(genoData->smpSubset)) return false;
 
-        smpGenoAnc->SetGenoSamples(famSmps->samples);
+        smpGenoAnc->SetGenoSamples(famSmps->smpIds);
         int numSmps = smpGenoAnc->GetNumSamples();
 
-        BimFileAncestrySnps *bimSnps = new BimFileAncestrySnps(totAncSnps);
-        bimSnps->ReadAncestrySnpsFromFile(bimFile, ancSnps);
+        if (!genoData->bimSnps) {
+            genoData->bimSnps = new BimFileAncestrySnps(totAncSnps);
+            genoData->bimSnps->SetNumThreads(genoData->numThreads);
+            genoData->bimSnps->ReadAncestrySnpsFromFile(bimFile, ancSnps);
+            genoData->bimSnps->ShowSummary();
+        }
+        BimFileAncestrySnps *bimSnps = genoData->bimSnps;
         int numBimAncSnps = bimSnps->GetNumBimAncestrySnps();
-        bimSnps->ShowSummary();
 
-        if (smpGenoAnc->HasEnoughAncestrySnps(numBimAncSnps)) {
+        if (smpGenoAnc->HasEnoughAncestrySnps(numBimAncSnps) && isPgen) {
+            PgenFileSnpGeno *pgenGenos = new PgenFileSnpGeno(bedFile, ancSnps, bimSnps, famSmps);
+            bool hasErr = pgenGenos->ReadGenotypesFromPgenFile();
+            if (hasErr) return false;
+            pgenGenos->ShowSummary();
+
+            smpGenoAnc->SetSnpGenoData(&pgenGenos->ancSnpSnpIds, &pgenGenos->ancSnpGenos);
+
+            CalculateAncestryScores(genoData->numThreads);
+            if (freeGenos) delete pgenGenos;
+        }
+        else if (smpGenoAnc->HasEnoughAncestrySnps(numBimAncSnps)) {
             BedFileSnpGeno *bedGenos = new BedFileSnpGeno(bedFile, ancSnps, bimSnps, famSmps);
+            bedGenos->SetNumThreads(genoData->numThreads);
             bool hasErr = bedGenos->ReadGenotypesFromBedFile();
-            if (hasErr) return 0;
+            if (hasErr) return false;
             bedGenos->ShowSummary();
 
-            smpGenoAnc->SetSnpGenoData(&bedGenos->ancSnpSnpIds, &bedGenos->ancSnpSmpGenos);
+            smpGenoAnc->SetSnpGenoData(&bedGenos->ancSnpSnpIds, &bedGenos->ancSnpGenos);
+
+            CalculateAncestryScores(genoData->numThreads);
+            if (freeGenos) delete bedGenos;
         }
         else {
             cout << "Ancestry inference not done due to lack of genotyped ancestry SNPs.\n\n";
-            return 0;
+            return false;
         }
+
+        if (freeGenos) delete famSmps;
     }
 
+    return true;
+}
+
+void CalculateAncestryScores(int numThreads)
+{
     cout << "\nLaunching " << numThreads << " threads to calculate ancestry scores.\n";
     smpGenoAnc->SetNumThreads(numThreads);
+    double t1 = GetWallSeconds();
 
     mutex iomutex;
     vector<thread> threads(numThreads);
@@ -164,13 +382,67 @@ int main(int argc, char* argv[])
         t.join();
     }
 
-    smpGenoAnc->SaveAncestryResults(outputFile);
+    printf("Calculated ancestry scores from %.1f MB of packed genotypes in %.3f seconds\n",
+    smpGenoAnc->GetGenoMegabytes(), GetWallSeconds() - t1);
+}
 
-    gettimeofday(&t2, NULL);
-    cout << "\n";
-    ShowTimeDiff(t1, t2);
+// Sample-block mode. Each pass reads the genotypes of one block of samples, sized so that the genotypes of
+// all ancestry SNPs take at most about maxMemoryMb megabytes, and appends the results of the block.
+bool InferAncestryInBlocks(GenoDataset *genoData, long maxMemoryMb, string outputFile)
+{
+    AncestrySnps *ancSnps = genoData->ancSnps;
+    SampleSubset *smpSubset = genoData->smpSubset;
+
+    // Genotypes are packed at 2 bits, i.e., 4 genotypes per byte
+    long blockSmps = maxMemoryMb * 1048576 * 4 / ancSnps->GetNumAncestrySnps();
+    if (blockSmps < 1) blockSmps = 1;
+    if (blockSmps > INT_MAX) blockSmps = INT_MAX;
+
+    cout << "\nReading genotypes of at most " << blockSmps << " samples at a time to use at most "
+         << maxMemoryMb << " MB of memory for genotypes\n";
+
+    long blockStart = 0;
+    long totSmps = 0;
+    int blockNo = 0;
+    int numSaveSmps = 0;
+
+    do {
+        blockNo++;
+        cout << "\n======== Block " << blockNo << ": samples " << blockStart + 1 << " - ";
+        if (totSmps > 0) cout << min(blockStart + blockSmps, totSmps) << " of " << totSmps;
+        else cout << blockStart + blockSmps;
+        cout << " ========\n\n";
+
+        if (smpGenoAnc) delete smpGenoAnc;
+        smpGenoAnc = new SampleGenoAncestry(ancSnps, genoData->minAncSnps);
+
+        smpSubset->SetBlock(blockStart, blockSmps);
+        if (!ReadGenotypesAndScore(genoData, true)) return false;
+
+        int blockSaveSmps = smpGenoAnc->AppendAncestryResults(outputFile, blockNo == 1);
+        if (blockSaveSmps < 0) return false;
+        numSaveSmps += blockSaveSmps;
+
+        if (genoData->isFirstPass) {
+            totSmps = smpSubset->GetNumKeptSamples();
+            genoData->isFirstPass = false;
+        }
+        blockStart += blockSmps;
+    } while (blockStart < totSmps);
 
-    return 1;
+    cout << "\nProcessed " << totSmps << " samples in " << blockNo << " blocks\n";
+
+    if (numSaveSmps < 1) {
+        remove(outputFile.c_str());
+        cout << "\nNOTE: None of the " << totSmps << " samples have enough genotypes for ancestry inference."
+        <<  " No ancestry results were generated.\n";
+        return true;
+    }
+
+    smpGenoAnc->ShowVertexPositions();
+    cout << "Saved population results of " << numSaveSmps << " samples to " << outputFile << ".\n";
+
+    return true;
 }
 
 string GetExecutablePath()
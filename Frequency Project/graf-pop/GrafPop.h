@@ -6,9 +6,12 @@ using namespace std;
 #include "Util.h"
 #include "AncestrySnps.h"
 #include "VcfSampleAncestrySnpGeno.h"
+#include "BcfSampleAncestrySnpGeno.h"
+#include "MultiFileAncestrySnpGeno.h"
 #include "FamFileSamples.h"
 #include "BimFileAncestrySnps.h"
 #include "BedFileSnpGeno.h"
+#include "PgenFileSnpGeno.h"
 #include "SampleGenoDist.h"
 #include "SampleGenoAncestry.h"
 #include <thread>
@@ -20,6 +23,28 @@ using namespace std;
 #define PROC_SELF_EXE "/proc/self/exe"
 #endif
 
+// Genotype dataset and settings used to read it. In the sample-block mode (--max-memory), the dataset is read
+// once for each block of samples, reusing what the first pass found.
+struct GenoDataset
+{
+    string genoDs;
+    vector<string> genoFiles;          // Not empty if the genotypes are split into multiple files
+    GenoDatasetType fileType;
+    string fileBase;
+    AncestrySnps *ancSnps;
+    SampleSubset *smpSubset;
+    int numThreads;
+    int minAncSnps;
+
+    bool isFirstPass;
+    AncestrySnpType vcfSnpType;        // SNP ID type and the offsets of the vcf lines used in the first pass
+    vector<uint64_t> vcfSnpLineOffsets;
+    BimFileAncestrySnps *bimSnps;      // The bim file is only read in the first pass
+};
+
+bool ReadGenotypesAndScore(GenoDataset*, bool);
+void CalculateAncestryScores(int);
+bool InferAncestryInBlocks(GenoDataset*, long, string);
 string GetExecutablePath(void);
 string FindFile(string);
 
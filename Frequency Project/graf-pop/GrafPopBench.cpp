@@ -0,0 +1,302 @@
+#include "Util.h"
+#include "VcfGtTokenizer.h"
+#include "BedFileSnpGeno.h"
+
+// Checks that the decoders picked at run time give the same results on generated VCF lines and bed rows, and shows
+// how fast each one is. "make bench" builds and runs it. Returns 1 if any results differ.
+
+static const SimdLevel simdLevels[3] = {SimdLevel::SCALAR, SimdLevel::SSE42, SimdLevel::AVX2};
+static const char *simdNames[3] = {"scalar", "SSE4.2", "AVX2"};
+
+// Random numbers that are the same in each run
+static uint32_t randState = 12345;
+static int GetRandNum(int n)
+{
+    randState = randState * 1103515245 + 12345;
+    return (randState >> 8) % n;
+}
+
+// Makes a GT column with single-digit or missing alleles, e.g., 0|1 or ./1. If oddPct > 0, about that percent of the
+// columns have multi-digit alleles, haploid or missing calls, or other FORMAT subfields.
+static string MakeGtColumn(int oddPct)
+{
+    const char alleles[] = "0001112.";
+    string gt = string(1, alleles[GetRandNum(8)]) + (GetRandNum(2) ? '|' : '/') + alleles[GetRandNum(8)];
+    if (GetRandNum(100) >= oddPct) return gt;
+
+    switch (GetRandNum(6)) {
+        case 0: return to_string(GetRandNum(13)) + "|" + to_string(GetRandNum(13));
+        case 1: return to_string(GetRandNum(3));
+        case 2: return ".";
+        case 3: return gt + ":" + to_string(GetRandNum(60)) + ":" + to_string(GetRandNum(99));
+        case 4: return "1" + to_string(GetRandNum(3)) + "/0:12";
+        default: return gt + ":0,12";
+    }
+}
+
+static string MakeGtLine(int numCols, int oddPct)
+{
+    string line = MakeGtColumn(oddPct);
+    for (int colNo = 1; colNo < numCols; colNo++) line += "\t" + MakeGtColumn(oddPct);
+    return line;
+}
+
+// Allele index at the start of the string, or -1 if missing or not a number
+static int ParseRefAllele(const string& line, size_t *pos)
+{
+    if (*pos >= line.length() || line[*pos] < '0' || line[*pos] > '9') {
+        if (*pos < line.length() && line[*pos] == '.') (*pos)++;
+        return -1;
+    }
+
+    int alleleIdx = 0;
+    while (*pos < line.length() && line[*pos] >= '0' && line[*pos] <= '9') {
+        alleleIdx = alleleIdx * 10 + line[*pos] - '0';
+        (*pos)++;
+    }
+
+    return alleleIdx;
+}
+
+// Decodes the line one character at a time, to check the results of the decoders
+static vector<char> DecodeReference(const string& line, int refIdx, int altIdx)
+{
+    vector<char> genos;
+    size_t colStart = 0;
+
+    while (true) {
+        size_t pos = colStart;
+        int g1Num = ParseRefAllele(line, &pos);
+        int g2Num = -1;
+        if (pos < line.length() && (line[pos] == '|' || line[pos] == '/')) {
+            pos++;
+            g2Num = ParseRefAllele(line, &pos);
+        }
+
+        int geno = 3;
+        if (g1Num > -1 && g2Num > -1) geno = VcfGtTokenizer::CodeGenotype(refIdx, altIdx, g1Num, g2Num);
+        genos.push_back(geno);
+
+        size_t tab = line.find('\t', colStart);
+        if (tab == string::npos) break;
+        colStart = tab + 1;
+    }
+
+    return genos;
+}
+
+// Decodes the line with the decoder in use, and compares the results with the reference. Only the first maxGenos
+// genotypes are saved, and the bytes after them should be unchanged.
+static bool CheckGtLine(const string& line, int refIdx, int altIdx, int maxGenos)
+{
+    vector<char> refGenos = DecodeReference(line, refIdx, altIdx);
+    int numCols = refGenos.size();
+
+    VcfGtTokenizer tokenizer(refIdx, altIdx);
+    vector<char> genos(maxGenos + 8, 99);
+    int numDecoded = tokenizer.Decode(line.data(), line.data() + line.length(), &genos[0], maxGenos);
+
+    bool genosOk = numDecoded == numCols;
+    for (int i = 0; i < maxGenos + 8 && genosOk; i++) {
+        char expGeno = i < maxGenos && i < numCols ? refGenos[i] : 99;
+        if (genos[i] != expGeno) genosOk = false;
+    }
+
+    // Every third column, starting from a random one
+    vector<int> colNos;
+    for (int colNo = GetRandNum(3); colNo < numCols; colNo += 3) colNos.push_back(colNo);
+    vector<char> selGenos(colNos.size() + 1, 99);
+    int numSelDecoded = tokenizer.DecodeSelected(line.data(), line.data() + line.length(), colNos.data(),
+                                                 colNos.size(), &selGenos[0]);
+
+    if (numSelDecoded != numCols) genosOk = false;
+    for (int i = 0; i < colNos.size() && genosOk; i++) {
+        if (selGenos[i] != refGenos[colNos[i]]) genosOk = false;
+    }
+
+    if (!genosOk) {
+        cout << "\nERROR: " << VcfGtTokenizer::GetSimdName() << " decoder failed on a line of " << numCols
+             << " columns with alleles " << refIdx << " and " << altIdx << ", saving " << maxGenos << " genotypes\n";
+        if (line.length() < 200) cout << line << "\n";
+    }
+
+    return genosOk;
+}
+
+static bool CheckGtDecoders()
+{
+    const int expAlleles[5][2] = {{0, 1}, {1, 0}, {0, 2}, {2, 3}, {1, 11}};
+    const int oddPcts[3] = {0, 5, 50};
+    int numLines = 0;
+    bool checkOk = true;
+
+    // Lines of 1 to 40 columns, and longer ones, so that they end at any byte of the 16 or 32 byte blocks
+    for (int numCols = 1; numCols < 300 && checkOk; numCols += numCols < 40 ? 1 : 37) {
+        for (int i = 0; i < 3; i++) {
+            string line = MakeGtLine(numCols, oddPcts[i]);
+
+            for (int j = 0; j < 5; j++) {
+                for (int k = 0; k < 3; k++) {
+                    if (VcfGtTokenizer::SetSimdLevel(simdLevels[k]) != simdLevels[k]) continue;
+
+                    int refIdx = expAlleles[j][0];
+                    int altIdx = expAlleles[j][1];
+                    if (!CheckGtLine(line, refIdx, altIdx, numCols)) checkOk = false;
+                    if (!CheckGtLine(line, refIdx, altIdx, numCols / 2)) checkOk = false;
+                }
+            }
+            numLines++;
+        }
+    }
+
+    if (checkOk) cout << "GT decoders gave the same genotypes on " << numLines << " lines\n";
+
+    return checkOk;
+}
+
+// Decodes the line repeatedly for about half a second, and returns GB per second
+static double TimeGtDecoder(const string& line, int numCols)
+{
+    VcfGtTokenizer tokenizer(0, 1);
+    vector<char> genos(numCols);
+    long numRuns = 0;
+    double t1 = GetWallSeconds();
+    double secs = 0;
+
+    while (secs < 0.5) {
+        for (int i = 0; i < 100; i++) tokenizer.Decode(line.data(), line.data() + line.length(), &genos[0], numCols);
+        numRuns += 100;
+        secs = GetWallSeconds() - t1;
+    }
+
+    return line.length() * double(numRuns) / secs / 1e9;
+}
+
+static void BenchGtDecoders()
+{
+    const int numCols = 10000;
+    string gtLine = MakeGtLine(numCols, 0);
+    string oddLine = MakeGtLine(numCols, 5);
+
+    cout << "\nDecoding lines of " << numCols << " genotype columns\n";
+    printf("%-8s %12s %18s\n", "", "GT only", "5% other columns");
+
+    for (int k = 0; k < 3; k++) {
+        if (VcfGtTokenizer::SetSimdLevel(simdLevels[k]) != simdLevels[k]) {
+            printf("%-8s not supported by this CPU\n", simdNames[k]);
+            continue;
+        }
+
+        double gtSpeed = TimeGtDecoder(gtLine, numCols);
+        double oddSpeed = TimeGtDecoder(oddLine, numCols);
+        printf("%-8s %7.2f GB/s %13.2f GB/s\n", simdNames[k], gtSpeed, oddSpeed);
+    }
+}
+
+static string MakeBedRow(int numSamples)
+{
+    string row((numSamples + 3) / 4, 0);
+    for (int i = 0; i < row.length(); i++) row[i] = GetRandNum(256);
+    return row;
+}
+
+// Decodes the 2-bit values one sample at a time: 00 = AA, 01 = missing, 10 = AB, 11 = BB
+static vector<char> DecodeBedReference(const string& row, int numSamples, bool swap)
+{
+    const char codes[4] = {0, 3, 1, 2};
+    vector<char> genos;
+
+    for (int smpNo = 0; smpNo < numSamples; smpNo++) {
+        char geno = codes[(uint8_t(row[smpNo / 4]) >> (smpNo % 4 * 2)) & 3];
+        if (swap && geno != 3) geno = 2 - geno;
+        genos.push_back(geno);
+    }
+
+    return genos;
+}
+
+static bool CheckBedRow(const string& row, int numSamples, bool swap)
+{
+    vector<char> refGenos = DecodeBedReference(row, numSamples, swap);
+    vector<char> genos(numSamples + 8, 99);
+    BedFileSnpGeno::DecodeBedRow(row.data(), numSamples, swap, &genos[0]);
+
+    bool genosOk = true;
+    for (int i = 0; i < numSamples + 8 && genosOk; i++) {
+        char expGeno = i < numSamples ? refGenos[i] : 99;
+        if (genos[i] != expGeno) genosOk = false;
+    }
+
+    return genosOk;
+}
+
+static bool CheckBedDecoders()
+{
+    int numRows = 0;
+    bool checkOk = true;
+
+    // Rows of 1 to 600 samples, so that they end at any byte of the 32 byte blocks, and a few longer ones
+    for (int numSamples = 1; numSamples < 5000 && checkOk; numSamples += numSamples < 600 ? 1 : 997) {
+        string row = MakeBedRow(numSamples);
+
+        for (int k = 0; k < 2; k++) {
+            bool avx2 = k == 1;
+            if (BedFileSnpGeno::SetUseAvx2(avx2) != avx2) continue;
+
+            for (int swap = 0; swap < 2; swap++) {
+                if (!CheckBedRow(row, numSamples, swap)) {
+                    cout << "\nERROR: " << (avx2 ? "AVX2" : "table lookup") << " decoder failed on a bed row of "
+                         << numSamples << " samples" << (swap ? " with swapped alleles" : "") << "\n";
+                    checkOk = false;
+                }
+            }
+        }
+        numRows++;
+    }
+
+    if (checkOk) cout << "Bed row decoders gave the same genotypes on " << numRows << " rows\n";
+
+    return checkOk;
+}
+
+static void BenchBedDecoders()
+{
+    const int numSamples = 100000;
+    const int numRows = 64;
+    vector<string> rows;
+    for (int i = 0; i < numRows; i++) rows.push_back(MakeBedRow(numSamples));
+    vector<char> genos(numSamples);
+
+    cout << "\nDecoding bed rows of " << numSamples << " samples\n";
+
+    for (int k = 0; k < 2; k++) {
+        bool avx2 = k == 1;
+        const char *decoderName = avx2 ? "AVX2" : "table lookup";
+        if (BedFileSnpGeno::SetUseAvx2(avx2) != avx2) {
+            printf("%-13s not supported by this CPU\n", decoderName);
+            continue;
+        }
+
+        long numRuns = 0;
+        double t1 = GetWallSeconds();
+        double secs = 0;
+        while (secs < 0.5) {
+            for (int i = 0; i < numRows; i++) BedFileSnpGeno::DecodeBedRow(rows[i].data(), numSamples, false, &genos[0]);
+            numRuns += numRows;
+            secs = GetWallSeconds() - t1;
+        }
+
+        printf("%-13s %7.1f million genotypes/second\n", decoderName, double(numSamples) * numRuns / secs / 1e6);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    bool checkOk = CheckGtDecoders();
+    if (!CheckBedDecoders()) checkOk = false;
+    BenchGtDecoders();
+    BenchBedDecoders();
+    cout << "\n";
+
+    return checkOk ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+#include "Util.h"
+#include "AncestrySnps.h"
+
+// Compiles the text file of the ancestry SNPs (AncInferSNPs.txt) into a binary panel file. grafpop loads the panel
+// file when it's found, instead of parsing the text file and calculating the expected genetic distances again.
+int main(int argc, char* argv[])
+{
+    string usage = "Usage: grafpop-panel compile <AncInferSNPs.txt> <AncInferSNPs.panel>\n"
+                   "       grafpop-panel check <AncInferSNPs.panel> [<AncInferSNPs.txt>]\n"
+                   "grafpop reads AncInferSNPs.panel instead of AncInferSNPs.txt if the panel file is in the same\n"
+                   "directory as the text file, and was compiled from the text file as it is now. Give the text file\n"
+                   "to 'check' to also check that the panel was compiled from it.\n";
+
+    string command = argc > 1 ? argv[1] : "";
+    if (!(command == "compile" && argc == 4) && !(command == "check" && (argc == 3 || argc == 4))) {
+        cout << usage << "\n";
+        return 1;
+    }
+
+    if (command == "compile") {
+        string ancSnpFile = argv[2];
+        string panelFile = argv[3];
+
+        if (!FileExists(ancSnpFile.c_str())) {
+            cout << "\nERROR: File " << ancSnpFile << " does not exist\n\n";
+            return 1;
+        }
+
+        AncestrySnps *ancSnps = new AncestrySnps();
+        if (ancSnps->ReadAncestrySnpsFromFile(ancSnpFile) == 0) return 1;
+        if (!ancSnps->WritePanelFile(panelFile, ancSnpFile)) return 1;
+        delete ancSnps;
+
+        cout << "Saved the ancestry SNPs to panel file " << panelFile << "\n\n";
+    }
+
+    // Loading the panel file also checks it
+    double t1 = GetWallSeconds();
+    AncestrySnps *panelSnps = new AncestrySnps();
+    string panelFile = command == "compile" ? argv[3] : argv[2];
+    string ancSnpFile = command == "compile" ? argv[2] : argc == 4 ? argv[3] : "";
+    int numSnps = panelSnps->ReadPanelFile(panelFile, ancSnpFile);
+    if (numSnps == 0) return 1;
+
+    printf("Panel file loaded in %.1f milliseconds\n", (GetWallSeconds() - t1) * 1000);
+    panelSnps->ShowAncestrySnps();
+    delete panelSnps;
+
+    return 0;
+}
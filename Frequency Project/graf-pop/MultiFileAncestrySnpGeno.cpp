@@ -0,0 +1,311 @@
+#include "MultiFileAncestrySnpGeno.h"
+
+GenoFileData::GenoFileData(string file)
+{
+    filename = file;
+    fileType = GenoDatasetType::NOT_EXISTS;
+    isRead = false;
+    numFileSnps = 0;
+    vcfGeno = NULL;
+    samples.Clear();
+    ancSnpIds = {};
+}
+
+MultiFileAncestrySnpGeno::MultiFileAncestrySnpGeno(const vector<string>& files, AncestrySnps *aSnps)
+{
+    ancSnps = aSnps;
+    for (int i = 0; i < files.size(); i++) fileDatas.push_back(GenoFileData(files[i]));
+
+    numThreads = 1;
+    numFileThreads = 1;
+    numDupSnps = 0;
+    nextFileNo = 0;
+    smpSubset = NULL;
+
+    samples.Clear();
+    ancSnpIds = {};
+}
+
+MultiFileAncestrySnpGeno::~MultiFileAncestrySnpGeno()
+{
+    ancSnpGenos.DeleteRows();
+
+    for (int fileNo = 0; fileNo < fileDatas.size(); fileNo++) {
+        if (fileDatas[fileNo].vcfGeno) delete fileDatas[fileNo].vcfGeno;
+        fileDatas[fileNo].ancSnpGenos.DeleteRows();
+    }
+}
+
+// Finds the genotype files given a glob pattern, e.g., "chr*.vcf.gz", or a text file that lists one
+// file (or PLINK set) per line. Returns an empty list if the argument is a single genotype file.
+vector<string> MultiFileAncestrySnpGeno::FindGenoFiles(const string& genoDs)
+{
+    vector<string> files;
+
+    if (genoDs.find_first_of("*?[") != string::npos) {
+        glob_t globBuf;
+        if (glob(genoDs.c_str(), 0, NULL, &globBuf) == 0) {
+            for (size_t i = 0; i < globBuf.gl_pathc; i++) {
+                string file = string(globBuf.gl_pathv[i]);
+                size_t dotPos = file.find_last_of("./");
+                string fileExt = dotPos != string::npos && file[dotPos] == '.' ? file.substr(dotPos) : "";
+
+                // The extension before .gz or .zst, e.g., .bim of .bim.gz
+                if ((fileExt == ".gz" || fileExt == ".zst") && dotPos > 0) {
+                    size_t extPos = file.find_last_of("./", dotPos - 1);
+                    if (extPos != string::npos && file[extPos] == '.') fileExt = file.substr(extPos, dotPos - extPos);
+                }
+
+                // Index files, and the .bim/.pvar and .fam/.psam files of the PLINK sets, are not listed separately
+                if (fileExt == ".tbi" || fileExt == ".csi" || fileExt == ".bim" || fileExt == ".fam" ||
+                    fileExt == ".pvar" || fileExt == ".psam" || fileExt == ".pgi") continue;
+                files.push_back(file);
+            }
+        }
+        globfree(&globBuf);
+    }
+    else {
+        string fileBase = "";
+        if (CheckGenoDataFile(genoDs, &fileBase) != GenoDatasetType::IS_OTHER) return files;
+
+        ifstream listFile(genoDs);
+        string line;
+        while (getline(listFile, line)) {
+            size_t stPos = line.find_first_not_of(" \t\r");
+            if (stPos == string::npos || line[stPos] == '#') continue;
+            size_t edPos = line.find_last_not_of(" \t\r");
+            files.push_back(line.substr(stPos, edPos - stPos + 1));
+        }
+    }
+
+    return files;
+}
+
+bool MultiFileAncestrySnpGeno::ReadDataFromFiles()
+{
+    int numFiles = fileDatas.size();
+    if (numFiles < 1) return false;
+
+    // Each file is read with its share of the threads
+    numFileThreads = numThreads < numFiles ? numThreads : numFiles;
+
+    cout << "Reading " << numFiles << " genotype files, " << numFileThreads << " files at a time\n\n";
+    ReadFiles();
+
+    bool allRead = true;
+    for (int fileNo = 0; fileNo < numFiles; fileNo++) {
+        if (!fileDatas[fileNo].isRead) {
+            cout << "\nERROR: Failed to read genotype data from " << fileDatas[fileNo].filename << "\n";
+            allRead = false;
+        }
+    }
+    if (!allRead) return false;
+
+    RecodeVcfGenotypes();
+    if (!CheckSamples()) return false;
+    MergeSnps();
+
+    return true;
+}
+
+void MultiFileAncestrySnpGeno::ReadFiles()
+{
+    int numFiles = fileDatas.size();
+    int fileThreads = numThreads / numFileThreads;
+
+    nextFileNo = 0;
+    vector<thread> threads;
+
+    for (int i = 0; i < numFileThreads; i++) {
+        threads.push_back(thread([this, numFiles, fileThreads] {
+            int fileNo;
+            while ((fileNo = nextFileNo++) < numFiles) {
+                fileDatas[fileNo].isRead = ReadFile(&fileDatas[fileNo], fileThreads);
+            }
+        }));
+    }
+
+    for (auto& t : threads) t.join();
+}
+
+bool MultiFileAncestrySnpGeno::ReadFile(GenoFileData *fileData, int fileThreads)
+{
+    string fileBase = "";
+    fileData->fileType = CheckGenoDataFile(fileData->filename, &fileBase);
+
+    if (fileData->fileType == GenoDatasetType::NOT_EXISTS) {
+        cout << "\nERROR: Genotype file " << fileData->filename << " doesn't exist!\n";
+        return false;
+    }
+    else if (fileData->fileType == GenoDatasetType::IS_OTHER) {
+        cout << "\nERROR: Genotype file " << fileData->filename << " should be a binary PLINK set, PLINK 2 set or vcf, vcf.gz or bcf file.\n";
+        return false;
+    }
+
+    if (fileData->fileType == GenoDatasetType::IS_PLINK || fileData->fileType == GenoDatasetType::IS_PLINK_GZ ||
+        fileData->fileType == GenoDatasetType::IS_PGEN) {
+        return ReadPlinkFile(fileData, fileBase, fileThreads);
+    }
+
+    return ReadVcfFile(fileData, fileThreads);
+}
+
+bool MultiFileAncestrySnpGeno::ReadVcfFile(GenoFileData *fileData, int fileThreads)
+{
+    if (fileData->fileType == GenoDatasetType::IS_BCF) {
+        fileData->vcfGeno = new BcfSampleAncestrySnpGeno(fileData->filename, ancSnps);
+    }
+    else {
+        fileData->vcfGeno = new VcfSampleAncestrySnpGeno(fileData->filename, ancSnps);
+    }
+    fileData->vcfGeno->SetNumThreads(fileThreads);
+    fileData->vcfGeno->SetSampleSubset(smpSubset);
+    if (!fileData->vcfGeno->ReadDataFromFile()) return false;
+
+    fileData->numFileSnps = fileData->vcfGeno->GetNumVcfSnps();
+    fileData->samples.AddIds(fileData->vcfGeno->vcfSamples);
+
+    return true;
+}
+
+// Uses the same SNP ID type (RS ID, GB37 or GB38) for all the vcf files, the one that finds the most ancestry SNPs
+void MultiFileAncestrySnpGeno::RecodeVcfGenotypes()
+{
+    int numRsIdAncSnps = 0, numGb37AncSnps = 0, numGb38AncSnps = 0;
+    for (int fileNo = 0; fileNo < fileDatas.size(); fileNo++) {
+        VcfSampleAncestrySnpGeno *vcfGeno = fileDatas[fileNo].vcfGeno;
+        if (!vcfGeno) continue;
+        numRsIdAncSnps += vcfGeno->GetNumRsIdAncestrySnps();
+        numGb37AncSnps += vcfGeno->GetNumGb37AncestrySnps();
+        numGb38AncSnps += vcfGeno->GetNumGb38AncestrySnps();
+    }
+
+    AncestrySnpType ancSnpType = AncestrySnpType::RSID;
+    if (numGb37AncSnps > numRsIdAncSnps) ancSnpType = AncestrySnpType::GB37;
+    if (numGb38AncSnps > numRsIdAncSnps && numGb38AncSnps > numGb37AncSnps) ancSnpType = AncestrySnpType::GB38;
+
+    for (int fileNo = 0; fileNo < fileDatas.size(); fileNo++) {
+        GenoFileData *fileData = &fileDatas[fileNo];
+        if (!fileData->vcfGeno) continue;
+
+        fileData->vcfGeno->RecodeSnpGenotypes(ancSnpType);
+        fileData->ancSnpIds = fileData->vcfGeno->vcfAncSnpIds;
+        fileData->ancSnpGenos.SetNumSamples(fileData->vcfGeno->vcfAncSnpGenos.GetNumSamples());
+        fileData->ancSnpGenos.rows.swap(fileData->vcfGeno->vcfAncSnpGenos.rows);
+
+        delete fileData->vcfGeno;
+        fileData->vcfGeno = NULL;
+    }
+}
+
+bool MultiFileAncestrySnpGeno::ReadPlinkFile(GenoFileData *fileData, const string& fileBase, int fileThreads)
+{
+    bool isPgen = fileData->fileType == GenoDatasetType::IS_PGEN;
+    string bedFile = isPgen ? fileBase + ".pgen" : FindPlinkFile(fileBase, ".bed");
+    string bimFile = isPgen ? FindPvarFile(fileBase) : FindPlinkFile(fileBase, ".bim");
+    string famFile = isPgen ? fileBase + ".psam" : FindPlinkFile(fileBase, ".fam");
+    if (bedFile == "" || !FileExists(bedFile.c_str()) || !FileExists(famFile.c_str()) || bimFile == "") {
+        cout << "\nERROR: PLINK set " << fileBase << " is incomplete\n";
+        return false;
+    }
+
+    FamFileSamples famSmps(famFile);
+    if (famSmps.HasError()) return false;
+    if (smpSubset && !famSmps.SelectSamples(smpSubset)) return false;
+
+    BimFileAncestrySnps bimSnps(ancSnps->GetNumAncestrySnps());
+    bimSnps.SetNumThreads(fileThreads);
+    bimSnps.ReadAncestrySnpsFromFile(bimFile, ancSnps);
+
+    fileData->numFileSnps = bimSnps.GetNumBimSnps();
+    fileData->samples.AddIds(famSmps.smpIds);
+
+    if (isPgen) {
+        PgenFileSnpGeno pgenGenos(bedFile, ancSnps, &bimSnps, &famSmps);
+        bool hasErr = pgenGenos.ReadGenotypesFromPgenFile();
+        if (hasErr) return false;
+
+        fileData->ancSnpIds = pgenGenos.ancSnpSnpIds;
+        fileData->ancSnpGenos.SetNumSamples(pgenGenos.ancSnpGenos.GetNumSamples());
+        fileData->ancSnpGenos.rows.swap(pgenGenos.ancSnpGenos.rows);
+    }
+    else {
+        BedFileSnpGeno bedGenos(bedFile, ancSnps, &bimSnps, &famSmps);
+        bedGenos.SetNumThreads(fileThreads);
+        bool hasErr = bedGenos.ReadGenotypesFromBedFile();
+        if (hasErr) return false;
+
+        fileData->ancSnpIds = bedGenos.ancSnpSnpIds;
+        fileData->ancSnpGenos.SetNumSamples(bedGenos.ancSnpGenos.GetNumSamples());
+        fileData->ancSnpGenos.rows.swap(bedGenos.ancSnpGenos.rows);
+    }
+
+    return true;
+}
+
+// All files should have the same samples in the same order
+bool MultiFileAncestrySnpGeno::CheckSamples()
+{
+    samples = fileDatas[0].samples;
+    int numSamples = samples.GetNumIds();
+    ancSnpGenos.SetNumSamples(numSamples);
+
+    for (int fileNo = 1; fileNo < fileDatas.size(); fileNo++) {
+        const GenoFileData& fileData = fileDatas[fileNo];
+
+        if (fileData.samples.GetNumIds() != numSamples) {
+            cout << "\nERROR: File " << fileData.filename << " has " << fileData.samples.GetNumIds() << " samples, but "
+                 << fileDatas[0].filename << " has " << numSamples << " samples\n";
+            return false;
+        }
+
+        for (int smpNo = 0; smpNo < numSamples; smpNo++) {
+            if (!fileData.samples.HasSameId(smpNo, samples, smpNo)) {
+                cout << "\nERROR: Sample #" << smpNo + 1 << " is " << fileData.samples.GetId(smpNo) << " in file "
+                     << fileData.filename << ", but " << samples.GetId(smpNo) << " in " << fileDatas[0].filename << "\n";
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Appends the ancestry SNPs of each file. If an ancestry SNP is found in more than one file, only the SNPs
+// from the first file are kept. SNPs found more than once in the same file are kept, as with a single file.
+void MultiFileAncestrySnpGeno::MergeSnps()
+{
+    vector<int> snpFileNos(ancSnps->GetNumAncestrySnps(), -1);   // The file each ancestry SNP is taken from
+
+    for (int fileNo = 0; fileNo < fileDatas.size(); fileNo++) {
+        GenoFileData *fileData = &fileDatas[fileNo];
+
+        for (int i = 0; i < fileData->ancSnpIds.size(); i++) {
+            int ancSnpId = fileData->ancSnpIds[i];
+            if (snpFileNos[ancSnpId] > -1 && snpFileNos[ancSnpId] != fileNo) {
+                delete[] fileData->ancSnpGenos.rows[i];
+                numDupSnps++;
+            }
+            else {
+                snpFileNos[ancSnpId] = fileNo;
+                ancSnpIds.push_back(ancSnpId);
+                ancSnpGenos.rows.push_back(fileData->ancSnpGenos.rows[i]);
+            }
+        }
+
+        fileData->ancSnpGenos.rows.clear();
+    }
+}
+
+void MultiFileAncestrySnpGeno::ShowSummary()
+{
+    cout << "\nRead " << fileDatas.size() << " genotype files with " << samples.GetNumIds() << " samples\n";
+    for (int fileNo = 0; fileNo < fileDatas.size(); fileNo++) {
+        const GenoFileData& fileData = fileDatas[fileNo];
+        cout << "\t" << fileData.filename << ": " << fileData.ancSnpIds.size() << " ancestry SNPs found from "
+             << fileData.numFileSnps << " SNPs\n";
+    }
+
+    cout << "Total " << ancSnpIds.size() << " ancestry SNPs\n";
+    if (numDupSnps > 0) cout << "\t" << numDupSnps << " ancestry SNPs found in more than one file were skipped\n";
+}
@@ -0,0 +1,73 @@
+#ifndef MULTI_FILE_ANCESTRY_SNP_GENO_H
+#define MULTI_FILE_ANCESTRY_SNP_GENO_H
+
+#include <glob.h>
+#include <fstream>
+#include <atomic>
+#include <thread>
+#include "Util.h"
+#include "AncestrySnps.h"
+#include "VcfSampleAncestrySnpGeno.h"
+#include "BcfSampleAncestrySnpGeno.h"
+#include "FamFileSamples.h"
+#include "BimFileAncestrySnps.h"
+#include "BedFileSnpGeno.h"
+#include "PgenFileSnpGeno.h"
+#include "PackedGenoMatrix.h"
+
+// Samples and ancestry SNP genotypes read from one of the files
+class GenoFileData
+{
+public:
+    string filename;
+    GenoDatasetType fileType;
+    bool isRead;
+    int numFileSnps;              // All the SNPs in the file
+    VcfSampleAncestrySnpGeno *vcfGeno;  // Keeps the putative SNPs of a vcf file until the SNP ID type is chosen
+    SampleIdTable samples;
+    vector<int> ancSnpIds;
+    PackedGenoMatrix ancSnpGenos;
+
+    GenoFileData(string);
+};
+
+// Reads genotypes from a set of files with the same samples, e.g., vcf files or binary PLINK sets split
+// by chromosome. The files are read concurrently, and the ancestry SNPs are merged in the order of the files.
+class MultiFileAncestrySnpGeno
+{
+private:
+    AncestrySnps *ancSnps;
+    vector<GenoFileData> fileDatas;
+    int numThreads;
+    int numFileThreads;            // Number of files read at the same time
+    int numDupSnps;                // Ancestry SNPs found in more than one file
+    atomic<int> nextFileNo;
+    const SampleSubset *smpSubset;   // Keep/remove lists applied to each file. NULL if all samples are used.
+
+    void ReadFiles();
+    bool ReadFile(GenoFileData*, int);
+    bool ReadVcfFile(GenoFileData*, int);
+    bool ReadPlinkFile(GenoFileData*, const string&, int);
+    void RecodeVcfGenotypes();
+    bool CheckSamples();
+    void MergeSnps();
+
+public:
+    SampleIdTable samples;
+    vector<int> ancSnpIds;
+    PackedGenoMatrix ancSnpGenos;
+
+    MultiFileAncestrySnpGeno(const vector<string>&, AncestrySnps*);
+    ~MultiFileAncestrySnpGeno();
+
+    static vector<string> FindGenoFiles(const string&);
+
+    void SetNumThreads(int threads) { numThreads = threads > 0 ? threads : 1; };
+    void SetSampleSubset(const SampleSubset *subset) { smpSubset = subset; };
+    int GetNumFiles() { return fileDatas.size(); };
+    int GetNumSamples() { return samples.GetNumIds(); };
+    bool ReadDataFromFiles();
+    void ShowSummary();
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include "PackedGenoMatrix.h"
+
+#if defined(__x86_64__)
+#define PACKED_X86_AVX2
+#include <immintrin.h>
+#endif
+
+// AVX2 packs 32 genotype codes at a time, moving bit 0 and bit 1 of each code to the sign bit and using movemask
+static bool DetectPackAvx2()
+{
+#ifdef PACKED_X86_AVX2
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+    return false;
+}
+
+static const bool packAvx2 = DetectPackAvx2();
+
+#ifdef PACKED_X86_AVX2
+__attribute__((target("avx2")))
+static void PackWordsAvx2(const char *codedGenos, int numFullWords, uint64_t *hiPlane, uint64_t *loPlane)
+{
+    for (int wordNo = 0; wordNo < numFullWords; wordNo++) {
+        const __m256i *genos = (const __m256i*)(codedGenos + wordNo * GENO_WORD_BITS);
+        __m256i g0 = _mm256_loadu_si256(genos);
+        __m256i g1 = _mm256_loadu_si256(genos + 1);
+
+        uint32_t hi0 = _mm256_movemask_epi8(_mm256_slli_epi16(g0, 6));
+        uint32_t hi1 = _mm256_movemask_epi8(_mm256_slli_epi16(g1, 6));
+        uint32_t lo0 = _mm256_movemask_epi8(_mm256_slli_epi16(g0, 7));
+        uint32_t lo1 = _mm256_movemask_epi8(_mm256_slli_epi16(g1, 7));
+
+        hiPlane[wordNo] = uint64_t(hi1) << 32 | hi0;
+        loPlane[wordNo] = uint64_t(lo1) << 32 | lo0;
+    }
+}
+#endif
+
+PackedGenoMatrix::PackedGenoMatrix(int numSmps)
+{
+    rows = {};
+    SetNumSamples(numSmps);
+}
+
+void PackedGenoMatrix::SetNumSamples(int numSmps)
+{
+    numSamples = numSmps;
+    numWords = (numSmps + GENO_WORD_BITS - 1) / GENO_WORD_BITS;
+}
+
+uint64_t* PackedGenoMatrix::NewRow() const
+{
+    return new uint64_t[numWords * 2];
+}
+
+// Packs the genotype codes of all samples into a row. Bits after the last sample are 0.
+void PackedGenoMatrix::PackRow(const char *codedGenos, uint64_t *row) const
+{
+    uint64_t *hiPlane = row;
+    uint64_t *loPlane = row + numWords;
+
+    int numFullWords = numSamples / GENO_WORD_BITS;
+    int wordNo = 0;
+
+#ifdef PACKED_X86_AVX2
+    if (packAvx2) {
+        PackWordsAvx2(codedGenos, numFullWords, hiPlane, loPlane);
+        wordNo = numFullWords;
+    }
+#endif
+
+    for (; wordNo < numWords; wordNo++) {
+        uint64_t hiBits = 0, loBits = 0;
+        int firstSmpNo = wordNo * GENO_WORD_BITS;
+        int numWordSmps = min(GENO_WORD_BITS, numSamples - firstSmpNo);
+
+        for (int i = 0; i < numWordSmps; i++) {
+            uint64_t geno = codedGenos[firstSmpNo + i];
+            hiBits |= (geno >> 1 & 1) << i;
+            loBits |= (geno & 1) << i;
+        }
+
+        hiPlane[wordNo] = hiBits;
+        loPlane[wordNo] = loBits;
+    }
+}
+
+char PackedGenoMatrix::GetGeno(const uint64_t *row, int smpNo) const
+{
+    int wordNo = smpNo / GENO_WORD_BITS;
+    int bitNo = smpNo % GENO_WORD_BITS;
+
+    return (row[wordNo] >> bitNo & 1) << 1 | (row[numWords + wordNo] >> bitNo & 1);
+}
+
+void PackedGenoMatrix::DeleteRows()
+{
+    for (int i = 0; i < rows.size(); i++) {
+        if (rows[i]) delete[] rows[i];
+    }
+    rows.clear();
+}
@@ -0,0 +1,49 @@
+#ifndef PACKED_GENO_MATRIX_H
+#define PACKED_GENO_MATRIX_H
+
+#include <stdint.h>
+#include "Util.h"
+
+#define GENO_WORD_BITS 64
+
+// Genotypes of the ancestry SNPs (one row per SNP), packed at 2 bits per sample. The genotype codes
+// 0 = RR, 1 = RA, 2 = AA, 3 = unknown are kept in two bit-planes: the high bits and the low bits of the codes,
+// so alt-hom = hi & ~lo, het = lo & ~hi and missing = hi & lo, 64 samples per word.
+// Each row has numWords words of the high plane followed by numWords words of the low plane.
+// The rows are owned by whoever keeps the matrix, and are freed with DeleteRows(), as with the char rows before.
+class PackedGenoMatrix
+{
+private:
+    int numSamples;
+    int numWords;      // 64-bit words in each plane of a row
+
+public:
+    vector<uint64_t*> rows;
+
+    PackedGenoMatrix(int=0);
+
+    void SetNumSamples(int);
+    int GetNumSamples() const { return numSamples; };
+    int GetNumWords() const { return numWords; };
+    int GetNumRows() const { return rows.size(); };
+    double GetMegabytes() const { return rows.size() * numWords * 16.0 / 1048576; };
+
+    uint64_t* NewRow() const;
+    void PackRow(const char*, uint64_t*) const;
+    char GetGeno(const uint64_t*, int) const;
+    void DeleteRows();
+
+    // Transposes a 64 x 64 bit matrix, so that bit i of word j becomes bit j of word i
+    static void TransposeBits64(uint64_t *words) {
+        uint64_t mask = 0x00000000FFFFFFFFULL;
+        for (int j = 32; j != 0; j >>= 1, mask ^= mask << j) {
+            for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+                uint64_t t = ((words[k] >> j) ^ words[k | j]) & mask;
+                words[k] ^= t << j;
+                words[k | j] ^= t;
+            }
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,400 @@
+#include "PgenFileSnpGeno.h"
+
+// Genotype codes of the 2-bit values of the records. PGEN_MODE_BED files have .bed codes, where 00 is
+// homozygous for the first .bim allele, i.e., ALT in PLINK 2.
+static const char pgenGenoCodes[4] = {0, 1, 2, 3};
+static const char pgenBedCodes[4]  = {2, 3, 1, 0};
+
+// Ancestry SNP genotype codes given the ALT allele counts, when the alleles match or are swapped
+static const char pgenSnpCodes[4]  = {0, 1, 2, 3};
+static const char pgenSwapCodes[4] = {2, 1, 0, 3};
+
+static uint64_t GetLittleEndian(const unsigned char *bytes, int numBytes)
+{
+    uint64_t val = 0;
+    for (int i = numBytes - 1; i >= 0; i--) val = val << 8 | bytes[i];
+
+    return val;
+}
+
+// Variable-length integer, 7 bits per byte from the lowest bits, as used in difflists.
+// Returns false if it goes past the end of the record.
+static bool GetVarint(const unsigned char **pp, const unsigned char *end, uint32_t *val)
+{
+    *val = 0;
+    for (int shift = 0; *pp < end && shift < 32; shift += 7) {
+        unsigned char b = *(*pp)++;
+        *val |= uint32_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+
+    return false;
+}
+
+PgenFileSnpGeno::PgenFileSnpGeno(string pFile, AncestrySnps *aSnps, BimFileAncestrySnps *bSnps, FamFileSamples *fSmps)
+{
+    pgenFile = pFile;
+    ancSnps = aSnps;
+    bimSnps = bSnps;
+    famSmps = fSmps;
+
+    numBimSnps = bimSnps->GetNumBimSnps();
+    numBimAncSnps = bimSnps->GetNumBimAncestrySnps();
+    numSamples = famSmps->GetNumFamSamples();
+    numSelSmps = famSmps->GetNumSelSamples();
+
+    pgenData = NULL;
+    fileLen = 0;
+    storageMode = 0;
+    for (int i = 0; i < 8; i++) numTypeRecords[i] = 0;
+
+    // Bytes needed to hold the number of samples
+    smpIdBytes = 1;
+    while (smpIdBytes < 4 && (numSamples >> (smpIdBytes * 8)) > 0) smpIdBytes++;
+
+    rawGenos.resize(numSamples);
+    baseGenos.resize(numSamples);
+    baseGenosOffset = -1;
+
+    ancSnpGenos.SetNumSamples(numSelSmps);
+    ancSnpSnpIds = {};
+}
+
+PgenFileSnpGeno::~PgenFileSnpGeno()
+{
+    ancSnpGenos.DeleteRows();
+    ancSnpSnpIds.clear();
+}
+
+// Finds the records of the ancestry SNPs. Returns false if the file isn't valid.
+bool PgenFileSnpGeno::ReadHeader()
+{
+    if (fileLen < 3 || pgenData[0] != BYTE1_IN_PGEN_FILE || pgenData[1] != BYTE2_IN_PGEN_FILE) {
+        cout << "ERROR: File " << pgenFile << " is not a valid PLINK 2 pgen file!\n";
+        return false;
+    }
+
+    storageMode = pgenData[2];
+    const vector<int>& ancBimPoses = bimSnps->GetAncSnpBimPositions();
+    long recLen = (numSamples + 3) / 4;
+    long headerLen = 0;
+
+    if (storageMode == PGEN_MODE_BED) {
+        headerLen = 3;
+    }
+    else if (storageMode == PGEN_MODE_FIXED) {
+        // Variant and sample counts, and possibly other header fields before the records
+        headerLen = fileLen - recLen * numBimSnps;
+        if (fileLen < 11 || headerLen < 11 ||
+            GetLittleEndian(pgenData + 3, 4) != numBimSnps || GetLittleEndian(pgenData + 7, 4) != numSamples) {
+            cout << "ERROR: Number of genotypes in pgen file doesn't match psam and pvar file!\n";
+            return false;
+        }
+    }
+    else if (storageMode == PGEN_MODE_VARIABLE) {
+        return ReadVariableHeader(&headerLen);
+    }
+    else {
+        cout << "ERROR: Storage mode " << storageMode << " of pgen file " << pgenFile << " is not supported. "
+             << "Please rewrite it with 'plink2 --make-pgen'.\n";
+        return false;
+    }
+
+    if (headerLen + recLen * numBimSnps != fileLen) {
+        cout << "ERROR: Number of genotypes in pgen file doesn't match psam and pvar file!\n";
+        cout << "\tPsam file has " << numSamples << " samples.  Pvar file has " << numBimSnps << " SNPs. "
+             << "Expected total " << headerLen + recLen * numBimSnps << " bytes.\n";
+        cout << "\tPgen file has " << fileLen << " bytes.\n";
+        return false;
+    }
+
+    for (int i = 0; i < ancBimPoses.size(); i++) {
+        PgenRecord record = {headerLen + ancBimPoses[i] * recLen, recLen, PGEN_TRACK_RAW, -1, 0, 0};
+        ancSnpRecords.push_back(record);
+    }
+
+    return true;
+}
+
+// The header has the offset of each block of 2^16 variants, followed by the record types and lengths of the
+// variants in each block. The records are found by adding up the lengths. An LD compressed record is decoded
+// from the last record before it that isn't LD compressed.
+bool PgenFileSnpGeno::ReadVariableHeader(long *headerLen)
+{
+    if (fileLen < 12 ||
+        GetLittleEndian(pgenData + 3, 4) != numBimSnps || GetLittleEndian(pgenData + 7, 4) != numSamples) {
+        cout << "ERROR: Number of genotypes in pgen file doesn't match psam and pvar file!\n";
+        return false;
+    }
+
+    int ctrlByte = pgenData[11];
+    int lenCode = ctrlByte & 15;
+    if (lenCode > 7) {
+        cout << "ERROR: Record index format " << lenCode << " of pgen file " << pgenFile << " is not supported.\n";
+        return false;
+    }
+
+    int typeBits = lenCode < 4 ? 4 : 8;
+    int recLenBytes = (lenCode & 3) + 1;
+    int alleleCtBytes[4] = {0, 1, 2, 4};
+    int numAlleleCtBytes = alleleCtBytes[(ctrlByte >> 4) & 3];
+    bool hasNonRefFlags = (ctrlByte >> 6) == 3;
+
+    const vector<int>& ancBimPoses = bimSnps->GetAncSnpBimPositions();
+    int numVblocks = (numBimSnps + PGEN_VBLOCK_SIZE - 1) / PGEN_VBLOCK_SIZE;
+
+    long pos = 12 + numVblocks * 8L;
+    int ancSnpNo = 0;
+    PgenRecord lastBase = {-1, 0, 0, -1, 0, 0};
+
+    for (int vblockNo = 0; vblockNo < numVblocks; vblockNo++) {
+        int firstSnpNo = vblockNo * PGEN_VBLOCK_SIZE;
+        int numBlockSnps = min(PGEN_VBLOCK_SIZE, numBimSnps - firstSnpNo);
+
+        long typesLen = typeBits == 4 ? (numBlockSnps + 1) / 2 : numBlockSnps;
+        long blockIndexLen = typesLen + numBlockSnps * long(recLenBytes + numAlleleCtBytes);
+        if (hasNonRefFlags) blockIndexLen += (numBlockSnps + 7) / 8;
+
+        if (pos + blockIndexLen > fileLen) {
+            cout << "ERROR: Pgen file " << pgenFile << " is truncated!\n";
+            return false;
+        }
+
+        const unsigned char *types = pgenData + pos;
+        const unsigned char *recLens = types + typesLen;
+        long recOffset = GetLittleEndian(pgenData + 12 + vblockNo * 8L, 8);
+
+        for (int i = 0; i < numBlockSnps; i++) {
+            int type = typeBits == 4 ? (types[i / 2] >> (i % 2 * 4)) & 15 : types[i];
+            long recLen = GetLittleEndian(recLens + i * recLenBytes, recLenBytes);
+            int trackType = type & 7;
+
+            if (ancSnpNo < ancBimPoses.size() && ancBimPoses[ancSnpNo] == firstSnpNo + i) {
+                PgenRecord record = {recOffset, recLen, type, -1, 0, 0};
+                if (trackType == PGEN_TRACK_LD || trackType == PGEN_TRACK_LD_INV) {
+                    record.baseOffset = lastBase.offset;
+                    record.baseLength = lastBase.length;
+                    record.baseType = lastBase.type;
+                }
+                ancSnpRecords.push_back(record);
+                ancSnpNo++;
+            }
+
+            if (trackType != PGEN_TRACK_LD && trackType != PGEN_TRACK_LD_INV) {
+                lastBase.offset = recOffset;
+                lastBase.length = recLen;
+                lastBase.type = type;
+            }
+
+            recOffset += recLen;
+        }
+
+        if (recOffset > fileLen) {
+            cout << "ERROR: Pgen file " << pgenFile << " is truncated!\n";
+            return false;
+        }
+
+        pos += blockIndexLen;
+    }
+
+    *headerLen = pos;
+
+    return true;
+}
+
+// 2-bit genotypes of all samples
+void PgenFileSnpGeno::DecodeRawGenos(const unsigned char *data, const char *codes, char *genos)
+{
+    for (int smpNo = 0; smpNo < numSamples; smpNo++) {
+        genos[smpNo] = codes[(data[smpNo / 4] >> (smpNo % 4 * 2)) & 3];
+    }
+}
+
+// A difflist is the number of samples, the first sample ID of each group of 64 samples, the byte lengths of
+// the groups, the 2-bit genotypes of the samples, then the sample ID differences within each group.
+// Sets the genotypes of the listed samples. Returns false if the list isn't valid.
+bool PgenFileSnpGeno::ApplyDifflist(const unsigned char **pp, const unsigned char *end, char *genos)
+{
+    uint32_t numDiffs;
+    if (!GetVarint(pp, end, &numDiffs)) return false;
+    if (numDiffs == 0) return true;
+    if (numDiffs > numSamples) return false;
+
+    int numGroups = (numDiffs + PGEN_DIFFLIST_GROUP - 1) / PGEN_DIFFLIST_GROUP;
+    const unsigned char *groupSmpIds = *pp;
+    const unsigned char *diffGenos = groupSmpIds + numGroups * smpIdBytes + (numGroups - 1);
+    *pp = diffGenos + (numDiffs + 3) / 4;
+    if (*pp > end) return false;
+
+    uint32_t smpNo = 0;
+    for (uint32_t i = 0; i < numDiffs; i++) {
+        if (i % PGEN_DIFFLIST_GROUP == 0) {
+            smpNo = GetLittleEndian(groupSmpIds + i / PGEN_DIFFLIST_GROUP * smpIdBytes, smpIdBytes);
+        }
+        else {
+            uint32_t delta;
+            if (!GetVarint(pp, end, &delta)) return false;
+            smpNo += delta;
+        }
+
+        if (smpNo >= numSamples) return false;
+        genos[smpNo] = (diffGenos[i / 4] >> (i % 4 * 2)) & 3;
+    }
+
+    return true;
+}
+
+// Decodes a main track that isn't LD compressed
+bool PgenFileSnpGeno::DecodeTrack(const unsigned char *data, const unsigned char *end, int type, char *genos)
+{
+    int trackType = type & 7;
+
+    if (trackType == PGEN_TRACK_RAW) {
+        if (data + (numSamples + 3) / 4 > end) return false;
+        DecodeRawGenos(data, storageMode == PGEN_MODE_BED ? pgenBedCodes : pgenGenoCodes, genos);
+    }
+    else if (trackType == PGEN_TRACK_1BIT) {
+        if (data + 1 + (numSamples + 7) / 8 > end) return false;
+
+        // The two common genotypes are (code / 4) and (code / 4 + code % 4)
+        int commonCode = *data++;
+        char geno0 = commonCode / 4;
+        char geno1 = geno0 + commonCode % 4;
+        for (int smpNo = 0; smpNo < numSamples; smpNo++) {
+            genos[smpNo] = (data[smpNo / 8] >> (smpNo % 8)) & 1 ? geno1 : geno0;
+        }
+
+        data += (numSamples + 7) / 8;
+        if (!ApplyDifflist(&data, end, genos)) return false;
+    }
+    else if (trackType & PGEN_TRACK_DIFFLIST) {
+        if (trackType == 5) return false;   // Het as the common genotype is not used
+        memset(genos, trackType & 3, numSamples);
+        if (!ApplyDifflist(&data, end, genos)) return false;
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+bool PgenFileSnpGeno::DecodeRecord(const PgenRecord& record, char *genos)
+{
+    const unsigned char *data = pgenData + record.offset;
+    const unsigned char *end = data + record.length;
+    int trackType = record.type & 7;
+    numTypeRecords[trackType]++;
+
+    if (trackType != PGEN_TRACK_LD && trackType != PGEN_TRACK_LD_INV) {
+        return DecodeTrack(data, end, record.type, genos);
+    }
+
+    if (record.baseOffset < 0) return false;
+
+    // Consecutive ancestry SNPs often share the base record
+    if (record.baseOffset != baseGenosOffset) {
+        const unsigned char *baseData = pgenData + record.baseOffset;
+        if (!DecodeTrack(baseData, baseData + record.baseLength, record.baseType, &baseGenos[0])) return false;
+        baseGenosOffset = record.baseOffset;
+    }
+
+    memcpy(genos, &baseGenos[0], numSamples);
+    if (!ApplyDifflist(&data, end, genos)) return false;
+
+    if (trackType == PGEN_TRACK_LD_INV) {
+        for (int smpNo = 0; smpNo < numSamples; smpNo++) {
+            if (genos[smpNo] != 1 && genos[smpNo] != 3) genos[smpNo] = 2 - genos[smpNo];
+        }
+    }
+
+    return true;
+}
+
+// The pgen file is memory mapped, and only the records of the ancestry SNPs (and their LD base records) are decoded
+bool PgenFileSnpGeno::ReadGenotypesFromPgenFile()
+{
+    int fd = open(pgenFile.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        cout << "ERROR: Couldn't open file " << pgenFile << "\n";
+        if (fd >= 0) close(fd);
+        return true;
+    }
+    fileLen = fileStat.st_size;
+
+    if (fileLen >= 3) {
+        void *mapAddr = mmap(NULL, fileLen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapAddr != MAP_FAILED) pgenData = (const unsigned char*)mapAddr;
+    }
+    close(fd);
+
+    if (!pgenData) {
+        cout << "ERROR: File " << pgenFile << " is not a valid PLINK 2 pgen file!\n";
+        return true;
+    }
+
+    if (!ReadHeader()) {
+        munmap((void*)pgenData, fileLen);
+        pgenData = NULL;
+        return true;
+    }
+    cout << "Reading genotypes from " << pgenFile << "\n";
+
+    const vector<int>& ancBimPoses = bimSnps->GetAncSnpBimPositions();
+    const vector<int>& selSmpNos = famSmps->selSmpNos;
+    int numRows = ancBimPoses.size();
+    madvise((void*)pgenData, fileLen, numRows * 4L < numBimSnps ? MADV_RANDOM : MADV_SEQUENTIAL);
+
+    vector<char> snpGenos(numSelSmps);   // Genotype codes of the selected samples, before they are packed
+    bool hasErr = false;
+
+    for (int rowNo = 0; rowNo < numRows && !hasErr; rowNo++) {
+        int bimPos = ancBimPoses[rowNo];
+        int ancSnpId = bimSnps->GetAncSnpIdGivenBimSnpPos(bimPos);
+        int match = bimSnps->GetAlleleMatchGivenBimSnpPos(bimPos);
+        const char *codes = match == 2 || match == -2 ? pgenSwapCodes : pgenSnpCodes;
+
+        if (!DecodeRecord(ancSnpRecords[rowNo], &rawGenos[0])) {
+            cout << "ERROR: Invalid record of variant #" << bimPos + 1 << " in pgen file " << pgenFile << "\n";
+            hasErr = true;
+            break;
+        }
+
+        if (selSmpNos.empty()) {
+            for (int smpNo = 0; smpNo < numSamples; smpNo++) snpGenos[smpNo] = codes[int(rawGenos[smpNo])];
+        }
+        else {
+            for (int i = 0; i < numSelSmps; i++) snpGenos[i] = codes[int(rawGenos[selSmpNos[i]])];
+        }
+
+        uint64_t *snpRow = ancSnpGenos.NewRow();
+        ancSnpGenos.PackRow(&snpGenos[0], snpRow);
+        ancSnpGenos.rows.push_back(snpRow);
+        ancSnpSnpIds.push_back(ancSnpId);
+    }
+
+    munmap((void*)pgenData, fileLen);
+    pgenData = NULL;
+    if (hasErr) return true;
+
+    numBimAncSnps = ancSnpSnpIds.size();
+
+    cout << "\tDecoded " << numRows << " records: " << numTypeRecords[PGEN_TRACK_RAW] << " 2-bit, "
+         << numTypeRecords[PGEN_TRACK_1BIT] << " 1-bit, "
+         << numTypeRecords[PGEN_TRACK_LD] + numTypeRecords[PGEN_TRACK_LD_INV] << " LD compressed, "
+         << numTypeRecords[4] + numTypeRecords[6] + numTypeRecords[7] << " difflist\n";
+    cout << "Pgen file has genotypes of " << numBimSnps << " SNPs. Read genotypes of "
+         << numBimAncSnps << " ancestry SNPs for " << numSelSmps << " samples.\n";
+
+    return false;
+}
+
+void PgenFileSnpGeno::ShowSummary()
+{
+    cout << "\n";
+    cout << "Total " << numSamples << " samples\n";
+    if (numSelSmps < numSamples) cout << "Selected " << numSelSmps << " samples\n";
+    cout << "Total " << ancSnps->GetNumAncestrySnps() << " Ancestry SNPs\n";
+    cout << "Total " << numBimAncSnps << " Ancestry SNPs in pvar file\n\n";
+}
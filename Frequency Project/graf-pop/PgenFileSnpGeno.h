@@ -0,0 +1,84 @@
+#ifndef PGEN_FILE_SNP_GENO_H
+#define PGEN_FILE_SNP_GENO_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Util.h"
+#include "AncestrySnps.h"
+#include "BimFileAncestrySnps.h"
+#include "FamFileSamples.h"
+#include "PackedGenoMatrix.h"
+
+static const int BYTE1_IN_PGEN_FILE   = 0x6c;
+static const int BYTE2_IN_PGEN_FILE   = 0x1b;
+static const int PGEN_MODE_BED        = 0x01;    // Same as a PLINK 1 .bed file in SNP mode
+static const int PGEN_MODE_FIXED      = 0x02;    // Fixed-width 2-bit hardcalls
+static const int PGEN_MODE_VARIABLE   = 0x10;    // Variable-width records, index in the header
+static const int PGEN_VBLOCK_SIZE     = 65536;   // Variants in each block of the header index
+static const int PGEN_DIFFLIST_GROUP  = 64;      // Sample IDs in each group of a difflist
+
+// Storage types of the main genotype track (low 3 bits of the variant record type)
+static const int PGEN_TRACK_RAW       = 0;       // 2 bits per sample
+static const int PGEN_TRACK_1BIT      = 1;       // 1 bit per sample for the two common genotypes, and a difflist
+static const int PGEN_TRACK_LD        = 2;       // Difflist from the last record that isn't LD compressed
+static const int PGEN_TRACK_LD_INV    = 3;       // Same as above, then ref and alt are swapped
+static const int PGEN_TRACK_DIFFLIST  = 4;       // 4, 6, 7: all samples have genotype (type & 3), except the difflist
+
+// Location of the record of an ancestry SNP, and of its LD base record if it's LD compressed
+struct PgenRecord
+{
+    long offset;
+    long length;
+    int type;
+    long baseOffset;
+    long baseLength;
+    int baseType;
+};
+
+// Reads the genotypes of the ancestry SNPs from a PLINK 2 .pgen file. SNPs are from the .pvar file, read by
+// BimFileAncestrySnps, and samples from the .psam file, read by FamFileSamples. Genotypes in the file are
+// the counts of the ALT allele (0 = hom REF, 1 = het, 2 = hom ALT, 3 = missing). Only the main hardcall
+// track of each record is decoded. Phase and dosage tracks are skipped.
+class PgenFileSnpGeno
+{
+public:
+    int numSamples;               // Samples in the psam file
+    int numSelSmps;               // Samples whose genotypes are read
+    int numBimSnps;               // Variants in the pvar file
+    int numBimAncSnps;
+
+    string pgenFile;
+    AncestrySnps *ancSnps;
+    BimFileAncestrySnps *bimSnps;
+    FamFileSamples *famSmps;
+
+    PackedGenoMatrix ancSnpGenos; // Genotypes of Ancestry SNPs (0 = AA, 1 = AB; 2 = BB, 3 = unknown), 2 bits per sample
+    vector<int> ancSnpSnpIds;
+
+    PgenFileSnpGeno(string, AncestrySnps*, BimFileAncestrySnps*, FamFileSamples*);
+    ~PgenFileSnpGeno();
+    bool ReadGenotypesFromPgenFile();
+    void ShowSummary();
+
+private:
+    const unsigned char *pgenData;
+    long fileLen;
+    int storageMode;
+    int smpIdBytes;               // Bytes of each sample ID in difflists
+    vector<PgenRecord> ancSnpRecords;
+    long numTypeRecords[8];       // Decoded records of each main track type
+
+    vector<char> rawGenos;        // Genotypes of all samples of one record
+    vector<char> baseGenos;       // Genotypes of the last LD base record
+    long baseGenosOffset;
+
+    bool ReadHeader();
+    bool ReadVariableHeader(long*);
+    bool DecodeRecord(const PgenRecord&, char*);
+    bool DecodeTrack(const unsigned char*, const unsigned char*, int, char*);
+    bool ApplyDifflist(const unsigned char**, const unsigned char*, char*);
+    void DecodeRawGenos(const unsigned char*, const char*, char*);
+};
+
+#endif
@@ -1,29 +1,5 @@
 #include "SampleGenoAncestry.h"
 
-GenoSample::GenoSample(string smp)
-{
-    name = smp;
-    father = "";
-    mother = "";
-    sex = 0;
-
-    numAncSnps = 0;
-    ancIsSet = false;
-}
-
-void GenoSample::SetAncestryScores(int numSnps, float d1, float d2, float d3, float d4, float e, float f, float a, bool isAnc)
-{
-    numAncSnps = numSnps;
-    ancIsSet = isAnc;
-    gd1 = d1;
-    gd2 = d2;
-    gd3 = d3;
-    gd4 = d4;
-    ePct = e;
-    fPct = f;
-    aPct = a;
-}
-
 SampleGenoAncestry::SampleGenoAncestry(AncestrySnps *aSnps, int minSnps)
 {
     ancSnps = aSnps;
@@ -32,11 +8,13 @@ SampleGenoAncestry::SampleGenoAncestry(AncestrySnps *aSnps, int minSnps)
     numSamples = 0;
     numAncSnps = 0;
     totAncSnps = ancSnps->GetNumAncestrySnps();
+    numRefPops = ancSnps->GetNumRefPops();
+    numVtxPops = ancSnps->GetNumVtxPops();
 
     ancSnpIds = NULL;
-    ancSnpCodedGenos = NULL;
-
-    samples = {};
+    ancSnpGenos = NULL;
+    numSnpBlocks = 0;
+    numAncSmps = 0;
 
     numThreads = 1;
     vtxExpGd0 = new SampleGenoDist(&aSnps->vtxPopExpGds[0], &aSnps->vtxPopExpGds[1],
@@ -48,7 +26,6 @@ SampleGenoAncestry::SampleGenoAncestry(AncestrySnps *aSnps, int minSnps)
 SampleGenoAncestry::~SampleGenoAncestry()
 {
     delete vtxExpGd0;
-    samples.clear();
 }
 
 void SampleGenoAncestry::SetNumThreads(int threads)
@@ -58,42 +35,100 @@ void SampleGenoAncestry::SetNumThreads(int threads)
 
 void SampleGenoAncestry::SetGenoSamples(const vector<string> &smps)
 {
-    if (!smps.empty()) {
-        numSamples = smps.size();
-
-        for (int i = 0; i < numSamples; i++) {
-            GenoSample genoSmp = GenoSample(smps[i]);
-            samples.push_back(genoSmp);
-        }
-    }
-    numAncSmps = 0;
+    smpIds.Clear();
+    smpIds.AddIds(smps);
+    ResetSampleResults();
 }
 
-void SampleGenoAncestry::SetGenoSamples(const vector<FamSample> &smps)
+void SampleGenoAncestry::SetGenoSamples(const SampleIdTable &smps)
 {
-    if (!smps.empty()) {
-        numSamples = smps.size();
+    smpIds.Clear();
+    smpIds.AddIds(smps);
+    ResetSampleResults();
+}
 
-        for (int i = 0; i < numSamples; i++) {
-            GenoSample genoSmp = GenoSample(smps[i].name);
-            samples.push_back(genoSmp);
-        }
-    }
+// Each result array is allocated once for all the samples
+void SampleGenoAncestry::ResetSampleResults()
+{
+    numSamples = smpIds.GetNumIds();
     numAncSmps = 0;
+
+    smpNumAncSnps.assign(numSamples, 0);
+    smpAncIsSet.assign(numSamples, 0);
+    smpGd1s.assign(numSamples, 0);
+    smpGd2s.assign(numSamples, 0);
+    smpGd3s.assign(numSamples, 0);
+    smpGd4s.assign(numSamples, 0);
+    smpEPcts.assign(numSamples, 0);
+    smpFPcts.assign(numSamples, 0);
+    smpAPcts.assign(numSamples, 0);
 }
 
-void SampleGenoAncestry::SetSnpGenoData(vector<int> *snpIds, vector<char*> *snpCodedGenos)
+void SampleGenoAncestry::SetSnpGenoData(vector<int> *snpIds, PackedGenoMatrix *snpGenos)
 {
     ancSnpIds = snpIds;
-    ancSnpCodedGenos = snpCodedGenos;
+    ancSnpGenos = snpGenos;
     numAncSnps = ancSnpIds->size();
+
+    SetSnpScoreTables();
+}
+
+// Log p-values of the genotypes of each SNP, the same values added for each sample before the genotypes were packed.
+// They're gathered from the log likelihood table of AncestrySnps, so no log() is calculated here.
+void SampleGenoAncestry::SetSnpScoreTables()
+{
+    numSnpBlocks = (numAncSnps + GENO_WORD_BITS - 1) / GENO_WORD_BITS;
+    int numTableSnps = numSnpBlocks * GENO_WORD_BITS;
+
+    snpAaPvals.assign(numTableSnps * numRefPops, 0);
+    snpAbDiffs.assign(numTableSnps * numRefPops, 0);
+    snpBbDiffs.assign(numTableSnps * numRefPops, 0);
+    snpVtxExpDists.assign(numTableSnps * numVtxPops * numVtxPops, 0);
+    snpPopValidBits.assign(numSnpBlocks * numRefPops, 0);
+
+    popAaPvalSums.assign(numRefPops, 0);
+    popValidSnps.assign(numRefPops, 0);
+    vtxExpDistSums.assign(numVtxPops * numVtxPops, 0);
+
+    for (int snpNo = 0; snpNo < numAncSnps; snpNo++) {
+        int ancSnpId = (*ancSnpIds)[snpNo];
+        int blockNo = snpNo / GENO_WORD_BITS;
+
+        const double *logLikes = &ancSnps->snpGenoLogLikes[long(ancSnpId) * 3 * numRefPops];
+        uint32_t validMask = ancSnps->snpPopValidMasks[ancSnpId];
+
+        for (int popId = 0; popId < numRefPops; popId++) {
+            if (validMask & (uint32_t(1) << popId)) {
+                double aaPv = logLikes[popId];
+                double abPv = logLikes[numRefPops + popId];
+                double bbPv = logLikes[2 * numRefPops + popId];
+
+                int tableNo = snpNo * numRefPops + popId;
+                snpAaPvals[tableNo] = aaPv;
+                snpAbDiffs[tableNo] = abPv - aaPv;
+                snpBbDiffs[tableNo] = bbPv - aaPv;
+                snpPopValidBits[blockNo * numRefPops + popId] |= uint64_t(1) << (snpNo % GENO_WORD_BITS);
+
+                popAaPvalSums[popId] += aaPv;
+                popValidSnps[popId]++;
+            }
+        }
+
+        for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
+            for (int popNo = 0; popNo < numVtxPops; popNo++) {
+                double dist = ancSnps->GetVtxExpGenoDist(vtxId, popNo, ancSnpId);
+                snpVtxExpDists[snpNo * numVtxPops * numVtxPops + vtxId * numVtxPops + popNo] = dist;
+                vtxExpDistSums[vtxId * numVtxPops + popNo] += dist;
+            }
+        }
+    }
 }
 
 int SampleGenoAncestry::SaveAncestryResults(string outFile)
 {
     int numSaveSmps = 0;
     for (int i = 0; i < numSamples; i++) {
-        if (samples[i].ancIsSet) numSaveSmps++;
+        if (smpAncIsSet[i]) numSaveSmps++;
     }
 
     if (numSaveSmps < 1) {
@@ -102,39 +137,12 @@ int SampleGenoAncestry::SaveAncestryResults(string outFile)
         return numSaveSmps;
     }
 
-    string vtxTitle = "Positions (x, y, z coordinates) of the three vertices";
-    vtxExpGd0->ShowPositions(vtxTitle);
+    ShowVertexPositions();
 
     FILE *ifp = fopen(outFile.c_str(), "w");
     if(ifp) {
-        char line[256];
-        fprintf(ifp, "# Positions of the three vertices\n");
-        fprintf(ifp, "#\n");
-
-        fprintf(ifp, "#          x       y      z\n");
-
-        sprintf(line, "# F: \t%5.4f  %5.4f %5.4f", vtxExpGd0->fPt.x, vtxExpGd0->fPt.y, vtxExpGd0->fPt.z);
-        fprintf(ifp, "%s\n", line);
-
-        sprintf(line, "# A: \t%5.4f  %5.4f %5.4f", vtxExpGd0->aPt.x, vtxExpGd0->aPt.y, vtxExpGd0->aPt.z);
-        fprintf(ifp, "%s\n", line);
-
-        sprintf(line, "# E: \t%5.4f  %5.4f %5.4f", vtxExpGd0->ePt.x, vtxExpGd0->ePt.y, vtxExpGd0->ePt.z);
-        fprintf(ifp, "%s\n", line);
-        fprintf(ifp, "#\n");
-
-        sprintf(line, "%s\t%s\tGD1 (x)\tGD2 (y)\tGD3 (z)\tGD4\tE(\%)\tF(\%)\tA(\%)", "Sample", "#SNPs");
-        fprintf(ifp, "%s\n", line);
-
-        for (int i = 0; i < numSamples; i++) {
-            GenoSample smp = samples[i];
-            if (!smp.ancIsSet) continue;
-
-            sprintf(line, "%s\t%d", smp.name.c_str(), smp.numAncSnps);
-            sprintf(line, "%s\t%7.6f\t%7.6f\t%7.6f\t%7.6f\t%6.2f\t%6.2f\t%6.2f",
-            line, smp.gd1, smp.gd2, smp.gd3, smp.gd4, smp.ePct, smp.fPct, smp.aPct);
-            fprintf(ifp, "%s\n", line);
-        }
+        WriteResultHeader(ifp);
+        WriteSampleResults(ifp);
     }
     else {
         cout << "ERROR: Can't open " << outFile << " for writing!\n";
@@ -147,168 +155,291 @@ int SampleGenoAncestry::SaveAncestryResults(string outFile)
     return numSaveSmps;
 }
 
-void SampleGenoAncestry::SetAncestryPvalues(int thNo)
+// Used in the sample-block mode. The header is written with the first block, and the results of each block
+// are appended, so the file is the same as the one saved by SaveAncestryResults() with all samples.
+// Returns the number of samples saved, or -1 if the file can't be written.
+int SampleGenoAncestry::AppendAncestryResults(string outFile, bool writeHeader)
 {
-    bool debug = numAncSnps < 0 && numSamples < 0 ? true : false;
+    FILE *ifp = fopen(outFile.c_str(), writeHeader ? "w" : "a");
+    if (!ifp) {
+        cout << "ERROR: Can't open " << outFile << " for writing!\n";
+        return -1;
+    }
 
-    int meanThSmps = int(numSamples / numThreads);
-    int rmSmps = numSamples % numThreads;
-    int chkThSmps = meanThSmps;
-    if (thNo+1 <= rmSmps) chkThSmps = meanThSmps + 1;
+    if (writeHeader) WriteResultHeader(ifp);
+    WriteSampleResults(ifp);
+    fclose(ifp);
 
-    int stSmp = thNo * chkThSmps;
-    if (thNo >= rmSmps) stSmp = thNo * chkThSmps + rmSmps;
-    int edSmp = stSmp + chkThSmps - 1;
+    int numSaveSmps = 0;
+    for (int i = 0; i < numSamples; i++) {
+        if (smpAncIsSet[i]) numSaveSmps++;
+    }
 
-    int smpCnt = 0;
-    for (int smpNo = stSmp; smpNo <= edSmp; smpNo++) {
-        // Calculate 14 scores for each sample, based on the SNPs with genotypes, i.e.,
-        // 9 expected genetics distances from the 3 vertices to the first 3 reference populations, and
-        // 5 genetic distances from the sample to the 5 referene populations
+    return numSaveSmps;
+}
 
-        if (debug && thNo == 0) cout << "Smp No. " << smpNo << ". smp " << samples[smpNo].name << " ";
+void SampleGenoAncestry::ShowVertexPositions()
+{
+    string vtxTitle = "Positions (x, y, z coordinates) of the three vertices";
+    vtxExpGd0->ShowPositions(vtxTitle);
+}
 
-        double popPvalues[numRefPops];
-        double popMeanPvals[numRefPops];
+void SampleGenoAncestry::WriteResultHeader(FILE *ifp)
+{
+    char line[256];
+    fprintf(ifp, "# Positions of the three vertices\n");
+    fprintf(ifp, "#\n");
 
-        for (int popId = 0; popId < numRefPops; popId++) {
-            popPvalues[popId] = 0;   // The raw log p-value
-            popMeanPvals[popId] = 0; // Genetic distancs from the sample to each ref population
-        }
+    fprintf(ifp, "#          x       y      z\n");
 
-        // Assuming the three vertex populations have allele freqs for all Ancestry SNPs
-        int numGenoSnps = 0;
-        double vtxExpPeSums[3];
-        double vtxExpPfSums[3];
-        double vtxExpPaSums[3];
-
-        // Initialize expected values for each vertex population (E, F, A)
-        for (int vtxId = 0; vtxId < 3; vtxId++) {
-            vtxExpPfSums[vtxId] = 0;
-            vtxExpPeSums[vtxId] = 0;
-            vtxExpPaSums[vtxId] = 0;
-        }
+    sprintf(line, "# F: \t%5.4f  %5.4f %5.4f", vtxExpGd0->fPt.x, vtxExpGd0->fPt.y, vtxExpGd0->fPt.z);
+    fprintf(ifp, "%s\n", line);
 
-        // Assuming some reference populations might not have allele freqs for all Ancestry SNPs,
-        // which is not ture for the current 5 reference populations being used
-        int refPopSnps[numRefPops]; // Counts of SNPs with freqs for each ref population
-        for (int popId = 0; popId < numRefPops; popId++) {
-            refPopSnps[popId] = 0;
+    sprintf(line, "# A: \t%5.4f  %5.4f %5.4f", vtxExpGd0->aPt.x, vtxExpGd0->aPt.y, vtxExpGd0->aPt.z);
+    fprintf(ifp, "%s\n", line);
+
+    sprintf(line, "# E: \t%5.4f  %5.4f %5.4f", vtxExpGd0->ePt.x, vtxExpGd0->ePt.y, vtxExpGd0->ePt.z);
+    fprintf(ifp, "%s\n", line);
+    fprintf(ifp, "#\n");
+
+    sprintf(line, "%s\t%s\tGD1 (x)\tGD2 (y)\tGD3 (z)\tGD4\tE(\%)\tF(\%)\tA(\%)", "Sample", "#SNPs");
+    fprintf(ifp, "%s\n", line);
+}
+
+void SampleGenoAncestry::WriteSampleResults(FILE *ifp)
+{
+    for (int i = 0; i < numSamples; i++) {
+        if (!smpAncIsSet[i]) continue;
+
+        fprintf(ifp, "%s\t%d\t%7.6f\t%7.6f\t%7.6f\t%7.6f\t%6.2f\t%6.2f\t%6.2f\n", smpIds.GetId(i), smpNumAncSnps[i],
+                smpGd1s[i], smpGd2s[i], smpGd3s[i], smpGd4s[i], smpEPcts[i], smpFPcts[i], smpAPcts[i]);
+    }
+}
+// Each thread scores the samples of a range of 64-sample words, with the kernel for the numbers of populations
+// of the panel. Kernels for the common panels are compiled for their numbers of populations.
+void SampleGenoAncestry::SetAncestryPvalues(int thNo)
+{
+    int numWords = ancSnpGenos->GetNumWords();
+    int meanThWords = int(numWords / numThreads);
+    int rmWords = numWords % numThreads;
+    int chkThWords = meanThWords;
+    if (thNo+1 <= rmWords) chkThWords = meanThWords + 1;
+
+    int stWord = thNo * chkThWords;
+    if (thNo >= rmWords) stWord = thNo * chkThWords + rmWords;
+    int edWord = stWord + chkThWords - 1;
+
+    if      (numRefPops == 5  && numVtxPops == 3) ScoreSampleWords<5, 3>(thNo, stWord, edWord);
+    else if (numRefPops == 8  && numVtxPops == 3) ScoreSampleWords<8, 3>(thNo, stWord, edWord);
+    else if (numRefPops == 12 && numVtxPops == 3) ScoreSampleWords<12, 3>(thNo, stWord, edWord);
+    else                                          ScoreSampleWords<0, 0>(thNo, stWord, edWord);
+}
+
+// Scores the samples of words stWord to edWord, in tiles of SCORE_TILE_WORDS words. For each block of 64 SNPs,
+// the words of the tile are read from each SNP row together, and for each word the two bit-planes are transposed
+// so that each sample has one word of SNP bits. The het, alt-hom and missing SNPs of the sample are then found
+// with a few bit operations. Counts are taken with popcount, and only the SNPs with an RA, AA or missing genotype
+// are visited one by one. The tables of the block stay in L1 cache while all samples of the tile are scored, so
+// the tables of all SNPs are read once per tile instead of once per word.
+//
+// REF_POPS and VTX_POPS are the numbers of populations of the panel, so that the population loops are unrolled
+// and the sums of a sample are kept in registers while its SNPs are visited. 0 is for any numbers of populations,
+// taken from the panel. -O2 doesn't fully unroll the loops by itself, hence the unroll pragmas.
+template <int REF_POPS, int VTX_POPS>
+void SampleGenoAncestry::ScoreSampleWords(int thNo, int stWord, int edWord)
+{
+    const int refPops = REF_POPS > 0 ? REF_POPS : numRefPops;
+    const int vtxDists = VTX_POPS > 0 ? VTX_POPS * VTX_POPS : numVtxPops * numVtxPops;
+    const int maxRefPops = REF_POPS > 0 ? REF_POPS : ANC_SNP_MAX_REF_POPS;
+    const int maxVtxDists = VTX_POPS > 0 ? VTX_POPS * VTX_POPS : ANC_SNP_NUM_VTX_POPS * ANC_SNP_NUM_VTX_POPS;
+    const int maxTileSmps = SCORE_TILE_WORDS * GENO_WORD_BITS;
+
+    int numWords = ancSnpGenos->GetNumWords();
+    int chkThSmps = 0;
+    for (int wordNo = stWord; wordNo <= edWord; wordNo++) {
+        chkThSmps += min(GENO_WORD_BITS, numSamples - wordNo * GENO_WORD_BITS);
+    }
+
+    const vector<uint64_t*>& rows = ancSnpGenos->rows;
+    uint64_t hiBits[SCORE_TILE_WORDS][GENO_WORD_BITS], loBits[SCORE_TILE_WORDS][GENO_WORD_BITS];
+
+    // Sums of the samples of a tile. These are kept for each thread, instead of on its stack.
+    vector<double> tilePvalues(maxTileSmps * maxRefPops);
+    vector<double> tileMissDists(maxTileSmps * maxVtxDists);
+    vector<int> tileRefPopMisses(maxTileSmps * maxRefPops);
+    vector<int> tileMissSnps(maxTileSmps);
+
+    int smpCnt = 0;
+    for (int tileWord = stWord; tileWord <= edWord; tileWord += SCORE_TILE_WORDS) {
+        int numTileWords = min(SCORE_TILE_WORDS, edWord - tileWord + 1);
+        int firstSmpNo = tileWord * GENO_WORD_BITS;
+        int numTileSmps = min(numTileWords * GENO_WORD_BITS, numSamples - firstSmpNo);
+
+        for (int i = 0; i < numTileSmps; i++) {
+            for (int popId = 0; popId < refPops; popId++) {
+                tilePvalues[i * maxRefPops + popId] = popAaPvalSums[popId];
+                tileRefPopMisses[i * maxRefPops + popId] = 0;
+            }
+            for (int j = 0; j < vtxDists; j++) tileMissDists[i * maxVtxDists + j] = 0;
+            tileMissSnps[i] = 0;
         }
 
-        bool hasRefPv = false;
-        int snpNo = 0;
-        for (snpNo = 0; snpNo < numAncSnps; snpNo++) {
-            int geno = (*ancSnpCodedGenos)[snpNo][smpNo];
-            int ancSnpId = (*ancSnpIds)[snpNo];
-
-            // Alt allele freq p of the 3 vertices
-            double v0p = ancSnps->snps[ancSnpId].vtxPopAfs[0];
-            double v1p = ancSnps->snps[ancSnpId].vtxPopAfs[1];
-            double v2p = ancSnps->snps[ancSnpId].vtxPopAfs[2];
-
-            if (geno > -1 && geno < 3) {
-                if (debug && 0) {
-                    cout << "    Snp No. " << snpNo << " ID " << ancSnpId
-                    << " rs " << ancSnps->snps[ancSnpId].rs
-                    << " ref " << ancSnps->snps[ancSnpId].ref
-                    << " alt " << ancSnps->snps[ancSnpId].alt
-                    << " v0 " << ancSnps->snps[ancSnpId].vtxPopAfs[0]
-                    << " p0 " << ancSnps->snps[ancSnpId].refPopAfs[0]
-                    << " geno " << geno << "\n";
+        for (int blockNo = 0; blockNo < numSnpBlocks; blockNo++) {
+            int firstSnpNo = blockNo * GENO_WORD_BITS;
+            int numBlockSnps = min(GENO_WORD_BITS, numAncSnps - firstSnpNo);
+
+            // SNPs after the last one are taken as RR, which adds nothing
+            for (int i = 0; i < GENO_WORD_BITS; i++) {
+                const uint64_t *hiWords = i < numBlockSnps ? &rows[firstSnpNo + i][tileWord] : NULL;
+                const uint64_t *loWords = i < numBlockSnps ? &rows[firstSnpNo + i][numWords + tileWord] : NULL;
+                for (int w = 0; w < numTileWords; w++) {
+                    hiBits[w][i] = hiWords ? hiWords[w] : 0;
+                    loBits[w][i] = loWords ? loWords[w] : 0;
                 }
+            }
 
-                for (int popId = 0; popId < numRefPops; popId++) {
-                    double pv = ancSnps->snps[ancSnpId].refPopAfs[popId]; // reference population allele freq p value
+            const uint64_t *validBits = &snpPopValidBits[blockNo * refPops];
+            const double *abDiffs = &snpAbDiffs[firstSnpNo * refPops];
+            const double *bbDiffs = &snpBbDiffs[firstSnpNo * refPops];
+
+            for (int w = 0; w < numTileWords; w++) {
+                PackedGenoMatrix::TransposeBits64(hiBits[w]);
+                PackedGenoMatrix::TransposeBits64(loBits[w]);
+
+                int numWordSmps = min(GENO_WORD_BITS, numTileSmps - w * GENO_WORD_BITS);
+                for (int i = 0; i < numWordSmps; i++) {
+                    uint64_t hetBits = loBits[w][i] & ~hiBits[w][i];
+                    uint64_t altBits = hiBits[w][i] & ~loBits[w][i];
+                    uint64_t missBits = hiBits[w][i] & loBits[w][i];
+                    int tileSmpNo = w * GENO_WORD_BITS + i;
+                    double *popPvalues = &tilePvalues[tileSmpNo * maxRefPops];
+
+                    double smpPvalues[maxRefPops];
+                    #pragma GCC unroll 12
+                    for (int popId = 0; popId < refPops; popId++) smpPvalues[popId] = popPvalues[popId];
+
+                    for (; hetBits; hetBits &= hetBits - 1) {
+                        const double *diffs = &abDiffs[__builtin_ctzll(hetBits) * refPops];
+                        #pragma GCC unroll 12
+                        for (int popId = 0; popId < refPops; popId++) smpPvalues[popId] += diffs[popId];
+                    }
+                    for (; altBits; altBits &= altBits - 1) {
+                        const double *diffs = &bbDiffs[__builtin_ctzll(altBits) * refPops];
+                        #pragma GCC unroll 12
+                        for (int popId = 0; popId < refPops; popId++) smpPvalues[popId] += diffs[popId];
+                    }
 
-                    if (pv > 0 && pv < 1) {
-                        double qv = 1 - pv;
-                        double bbPv = log(qv) * 2;
-                        double abPv = log(pv * qv * 2);
-                        double aaPv = log(pv) * 2;
+                    if (missBits) {
+                        int *refPopMisses = &tileRefPopMisses[tileSmpNo * maxRefPops];
+                        double *vtxMissDists = &tileMissDists[tileSmpNo * maxVtxDists];
 
-                        if      (geno == 2) {
-                            popPvalues[popId] += bbPv;
-                        }
-                        else if (geno == 1) {
-                            popPvalues[popId] += abPv;
-                        }
-                        else if (geno == 0) {
-                            popPvalues[popId] += aaPv;
+                        tileMissSnps[tileSmpNo] += __builtin_popcountll(missBits);
+                        for (int popId = 0; popId < refPops; popId++) {
+                            refPopMisses[popId] += __builtin_popcountll(missBits & validBits[popId]);
                         }
 
-                        hasRefPv = true;
-                        refPopSnps[popId]++;
+                        for (; missBits; missBits &= missBits - 1) {
+                            int snpNo = firstSnpNo + __builtin_ctzll(missBits);
+                            const double *aaPvals = &snpAaPvals[snpNo * refPops];
+                            const double *snpDists = &snpVtxExpDists[snpNo * vtxDists];
+                            #pragma GCC unroll 12
+                            for (int popId = 0; popId < refPops; popId++) smpPvalues[popId] -= aaPvals[popId];
+                            for (int j = 0; j < vtxDists; j++) vtxMissDists[j] += snpDists[j];
+                        }
                     }
-                }
 
-                // Calculate expected P values for each of the vertices E, F, A
-                for (int vtxId = 0; vtxId < 3; vtxId++) {
-                    vtxExpPeSums[vtxId] += ancSnps->vtxExpGenoDists[vtxId][0][ancSnpId];
-                    vtxExpPfSums[vtxId] += ancSnps->vtxExpGenoDists[vtxId][1][ancSnpId];
-                    vtxExpPaSums[vtxId] += ancSnps->vtxExpGenoDists[vtxId][2][ancSnpId];
+                    #pragma GCC unroll 12
+                    for (int popId = 0; popId < refPops; popId++) popPvalues[popId] = smpPvalues[popId];
                 }
-
-                numGenoSnps++;
             }
         }
 
-        for (int popId = 0; popId < numRefPops; popId++) {
-            if (refPopSnps[popId] > 0) {
-                popMeanPvals[popId] = -1 * popPvalues[popId]/refPopSnps[popId];
+        for (int i = 0; i < numTileSmps; i++) {
+            double vtxExpSums[maxVtxDists];
+            for (int j = 0; j < vtxDists; j++) vtxExpSums[j] = vtxExpDistSums[j] - tileMissDists[i * maxVtxDists + j];
+
+            int refPopSnps[maxRefPops];
+            for (int popId = 0; popId < refPops; popId++) {
+                refPopSnps[popId] = popValidSnps[popId] - tileRefPopMisses[i * maxRefPops + popId];
             }
+
+            SetSampleScores(firstSmpNo + i, numAncSnps - tileMissSnps[i], &tilePvalues[i * maxRefPops], refPopSnps,
+                            vtxExpSums);
+
+            smpCnt++;
+            if (thNo == 0 && smpCnt % 100 == 0)
+                cout  << "\tCalculated scores for " << smpCnt << " of " << chkThSmps << " samples\n";
         }
+    }
+}
 
-        float gd1 = 0, gd2 = 0, gd3 = 0, gd4 = 0;
-        float ePct = 0, fPct = 0, aPct = 0;
-        bool hasAncGeno = false;
+// Calculates 14 scores for the sample, based on the SNPs with genotypes, i.e.,
+// 9 expected genetics distances from the 3 vertices to the first 3 reference populations, and
+// 5 genetic distances from the sample to the 5 referene populations
+void SampleGenoAncestry::SetSampleScores(int smpNo, int numGenoSnps, const double *popPvalues,
+const int *refPopSnps, const double *vtxExpSums)
+{
+    double popMeanPvals[ANC_SNP_MAX_REF_POPS];  // Genetic distancs from the sample to each ref population
 
-        if (numGenoSnps >= minAncSnps) {
-            GenoDist smpDist;
-            GenoDist vtxExpDists[numVtxPops];
+    for (int popId = 0; popId < numRefPops; popId++) {
+        popMeanPvals[popId] = 0;
+        if (refPopSnps[popId] > 0) {
+            popMeanPvals[popId] = -1 * popPvalues[popId]/refPopSnps[popId];
+        }
+    }
 
-            smpDist.e = popMeanPvals[0];
-            smpDist.f = popMeanPvals[1];
-            smpDist.a = popMeanPvals[2];
+    float gd1 = 0, gd2 = 0, gd3 = 0, gd4 = 0;
+    float ePct = 0, fPct = 0, aPct = 0;
+    bool hasAncGeno = false;
 
-            for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
-                vtxExpDists[vtxId].e  = -1 * vtxExpPeSums[vtxId]/numGenoSnps;
-                vtxExpDists[vtxId].f  = -1 * vtxExpPfSums[vtxId]/numGenoSnps;
-                vtxExpDists[vtxId].a  = -1 * vtxExpPaSums[vtxId]/numGenoSnps;
-            }
+    if (numGenoSnps >= minAncSnps) {
+        GenoDist smpDist;
+        GenoDist vtxExpDists[ANC_SNP_NUM_VTX_POPS];
 
-            // Calculate GD and ancestry components using the raw scores
-            SampleGenoDist *smpGd = new SampleGenoDist(&vtxExpDists[0], &vtxExpDists[1], &vtxExpDists[2], &smpDist);
-            smpGd->TransformAllDists();
-            smpGd->CalculateBaryCenters();
-
-            // Show rotated x, y, z values as GD1, GD2, GD3
-            gd1 = smpGd->eWt * vtxExpGd0->ePt.x + smpGd->fWt * vtxExpGd0->fPt.x + smpGd->aWt * vtxExpGd0->aPt.x;
-            gd2 = smpGd->eWt * vtxExpGd0->ePt.y + smpGd->fWt * vtxExpGd0->fPt.y + smpGd->aWt * vtxExpGd0->aPt.y;
-            gd3 = smpGd->sPt.z;
-
-            // GD4 = D_mexican - D_india_pakistani
-            gd4 = popMeanPvals[3] - popMeanPvals[4];
-
-            double ejWt = smpGd->eWt > 0 ? smpGd->eWt : 0;
-            double fjWt = smpGd->fWt > 0 ? smpGd->fWt : 0;
-            double ajWt = smpGd->aWt > 0 ? smpGd->aWt : 0;
-            double totWt = fjWt + ejWt + ajWt;
-            ePct = ejWt * 100 / totWt;
-            fPct = fjWt * 100 / totWt;
-            aPct = ajWt * 100 / totWt;
-
-            hasAncGeno = true;
-            numAncSmps++;
-            delete smpGd;
-        }
+        smpDist.e = popMeanPvals[0];
+        smpDist.f = popMeanPvals[1];
+        smpDist.a = popMeanPvals[2];
 
-        samples[smpNo].SetAncestryScores(numGenoSnps, gd1, gd2, gd3, gd4, ePct, fPct, aPct, hasAncGeno);
+        for (int vtxId = 0; vtxId < numVtxPops; vtxId++) {
+            vtxExpDists[vtxId].e  = -1 * vtxExpSums[vtxId * numVtxPops + 0]/numGenoSnps;
+            vtxExpDists[vtxId].f  = -1 * vtxExpSums[vtxId * numVtxPops + 1]/numGenoSnps;
+            vtxExpDists[vtxId].a  = -1 * vtxExpSums[vtxId * numVtxPops + 2]/numGenoSnps;
+        }
 
-        smpCnt++;
-        if (thNo == 0 && smpCnt % 100 == 0)
-            cout  << "\tCalculated scores for " << smpCnt << " of " << chkThSmps << " samples\n";
+        // Calculate GD and ancestry components using the raw scores
+        SampleGenoDist smpGd(&vtxExpDists[0], &vtxExpDists[1], &vtxExpDists[2], &smpDist);
+        smpGd.TransformAllDists();
+        smpGd.CalculateBaryCenters();
+
+        // Show rotated x, y, z values as GD1, GD2, GD3
+        gd1 = smpGd.eWt * vtxExpGd0->ePt.x + smpGd.fWt * vtxExpGd0->fPt.x + smpGd.aWt * vtxExpGd0->aPt.x;
+        gd2 = smpGd.eWt * vtxExpGd0->ePt.y + smpGd.fWt * vtxExpGd0->fPt.y + smpGd.aWt * vtxExpGd0->aPt.y;
+        gd3 = smpGd.sPt.z;
+
+        // GD4 = D_mexican - D_india_pakistani
+        gd4 = popMeanPvals[3] - popMeanPvals[4];
+
+        double ejWt = smpGd.eWt > 0 ? smpGd.eWt : 0;
+        double fjWt = smpGd.fWt > 0 ? smpGd.fWt : 0;
+        double ajWt = smpGd.aWt > 0 ? smpGd.aWt : 0;
+        double totWt = fjWt + ejWt + ajWt;
+        ePct = ejWt * 100 / totWt;
+        fPct = fjWt * 100 / totWt;
+        aPct = ajWt * 100 / totWt;
+
+        hasAncGeno = true;
+        numAncSmps++;
     }
+
+    smpNumAncSnps[smpNo] = numGenoSnps;
+    smpAncIsSet[smpNo] = hasAncGeno;
+    smpGd1s[smpNo] = gd1;
+    smpGd2s[smpNo] = gd2;
+    smpGd3s[smpNo] = gd3;
+    smpGd4s[smpNo] = gd4;
+    smpEPcts[smpNo] = ePct;
+    smpFPcts[smpNo] = fPct;
+    smpAPcts[smpNo] = aPct;
 }
 
 void SampleGenoAncestry::ShowSummary()
@@ -323,7 +454,7 @@ void SampleGenoAncestry::ShowSummary()
         cout << "No. " << i << ": " << ancSnpId << ": ";
 
         for (int j = 0; j < numSamples; j++) {
-            if  (j < 20) cout << int((*ancSnpCodedGenos)[i][j]) << " ";
+            if  (j < 20) cout << int(ancSnpGenos->GetGeno(ancSnpGenos->rows[i], j)) << " ";
         }
         cout << "\n";
 
@@ -4,28 +4,11 @@
 #include <fstream>
 #include "Util.h"
 #include "AncestrySnps.h"
-#include "FamFileSamples.h"
+#include "SampleIdTable.h"
 #include "SampleGenoDist.h"
+#include "PackedGenoMatrix.h"
 
-class GenoSample
-{
-public:
-    string name;
-    string father;
-    string mother;
-    int sex;
-
-    // Ancestry results calculated from genotypes
-    int numAncSnps;
-    bool ancIsSet;
-    float gd1, gd2, gd3, gd4;
-    float ePct, fPct, aPct;   // Ancestry (EUR, AFR, EAS) components of the sample
-
-public:
-    GenoSample(string);
-    void SetAncestryScores(int, float, float, float, float, float, float, float, bool);
-};
-
+#define SCORE_TILE_WORDS 16  // 64-sample words scored together for each block of 64 SNPs
 
 class SampleGenoAncestry
 {
@@ -37,28 +20,59 @@ private:
     int totAncSnps;
     int numAncSnps;
     int numThreads;                // Number of threads for parallel computing
+    int numRefPops;                // Populations of the ancestry SNP panel
+    int numVtxPops;
 
     AncestrySnps *ancSnps;
     SampleGenoDist *vtxExpGd0;    // Genetic distances from 3 vertices to ref populations when all SNPs have genotypes
 
+    // Per-SNP tables for scoring the packed genotypes, in the order of the SNPs in the dataset, padded to
+    // a multiple of 64 SNPs. Each sample starts from the sums of an all-RR genotype with no missing SNP,
+    // then adds the differences of its het and alt-hom SNPs and subtracts its missing SNPs.
+    int numSnpBlocks;                     // Blocks of 64 SNPs
+    vector<double> snpAaPvals;            // log p-value of RR, [snpNo * numRefPops + popId], 0 if the pop has no freq
+    vector<double> snpAbDiffs;            // log p-value of RA minus that of RR
+    vector<double> snpBbDiffs;            // log p-value of AA minus that of RR
+    vector<double> snpVtxExpDists;        // [snpNo * 9 + vtxId * 3 + popNo], from AncestrySnps::vtxExpGenoDists
+    vector<uint64_t> snpPopValidBits;     // [blockNo * numRefPops + popId], SNPs with freqs for the ref population
+    vector<double> popAaPvalSums;
+    vector<int> popValidSnps;
+    vector<double> vtxExpDistSums;
+
+    // Sample IDs, and the ancestry results calculated from genotypes, one array per result in the order of the samples
+    SampleIdTable smpIds;
+    vector<int> smpNumAncSnps;
+    vector<char> smpAncIsSet;
+    vector<float> smpGd1s, smpGd2s, smpGd3s, smpGd4s;
+    vector<float> smpEPcts, smpFPcts, smpAPcts;   // Ancestry (EUR, AFR, EAS) components of the samples
+
+    void ResetSampleResults();
+    void SetSnpScoreTables();
+    template <int, int> void ScoreSampleWords(int, int, int);
+    void SetSampleScores(int, int, const double*, const int*, const double*);
+    void WriteResultHeader(FILE*);
+    void WriteSampleResults(FILE*);
+
 public:
-    vector<GenoSample> samples;
     vector<int> *ancSnpIds;
-    vector<char*> *ancSnpCodedGenos; // Use char, instead of int, to save space
+    PackedGenoMatrix *ancSnpGenos;   // 2 bits per genotype
 
     SampleGenoAncestry(AncestrySnps*, int=100);
     ~SampleGenoAncestry();
 
     void SetGenoSamples(const vector<string>&);
-    void SetGenoSamples(const vector<FamSample>&);
+    void SetGenoSamples(const SampleIdTable&);
     int SaveAncestryResults(string);
+    int AppendAncestryResults(string, bool);
+    void ShowVertexPositions();
     void SetAncestryPvalues(int);
-    void SetSnpGenoData(vector<int>*, vector<char*>*);
+    void SetSnpGenoData(vector<int>*, PackedGenoMatrix*);
     void SetNumThreads(int);
     void InitPopPvalues();
 
     int GetNumSamples() { return numSamples; };
     int GetNumAncSamples() { return numAncSmps; };
+    double GetGenoMegabytes() { return ancSnpGenos ? ancSnpGenos->GetMegabytes() : 0; };
     bool HasEnoughAncestrySnps(int numSnps) { return numSnps >= minAncSnps; }
 
     void ShowSummary();
@@ -0,0 +1,65 @@
+#include "SampleIdTable.h"
+
+SampleIdTable::SampleIdTable()
+{
+    idChars = {};
+    idOffsets = {0};
+}
+
+void SampleIdTable::Clear()
+{
+    idChars.clear();
+    idOffsets.assign(1, 0);
+}
+
+void SampleIdTable::AddId(const char *id, int idLen)
+{
+    idChars.insert(idChars.end(), id, id + idLen);
+    idChars.push_back('\0');
+    idOffsets.push_back(idChars.size());
+}
+
+void SampleIdTable::AddIds(const vector<string>& ids)
+{
+    long numChars = idChars.size();
+    for (int i = 0; i < ids.size(); i++) numChars += ids[i].length() + 1;
+
+    idChars.reserve(numChars);
+    idOffsets.reserve(idOffsets.size() + ids.size());
+    for (int i = 0; i < ids.size(); i++) AddId(ids[i]);
+}
+
+void SampleIdTable::AddIds(const SampleIdTable& ids)
+{
+    long charStart = idChars.size();
+    idChars.insert(idChars.end(), ids.idChars.begin(), ids.idChars.end());
+
+    idOffsets.reserve(idOffsets.size() + ids.GetNumIds());
+    for (int i = 1; i < ids.idOffsets.size(); i++) idOffsets.push_back(charStart + ids.idOffsets[i]);
+}
+
+// Keeps only the IDs at the given positions, which should be in increasing order. The IDs are moved forward
+// in place, so no memory is allocated.
+void SampleIdTable::SelectIds(const vector<int>& idNos)
+{
+    long charEnd = 0;
+    for (int i = 0; i < idNos.size(); i++) {
+        int idNo = idNos[i];
+        long idStart = idOffsets[idNo];
+        long idLen = idOffsets[idNo+1] - idStart;
+
+        memmove(&idChars[charEnd], &idChars[idStart], idLen);
+        idOffsets[i] = charEnd;
+        charEnd += idLen;
+    }
+
+    idChars.resize(charEnd);
+    idOffsets.resize(idNos.size() + 1);
+    idOffsets[idNos.size()] = charEnd;
+}
+
+bool SampleIdTable::HasSameId(int idNo, const SampleIdTable& other, int otherIdNo) const
+{
+    int idLen = GetIdLength(idNo);
+    return idLen == other.GetIdLength(otherIdNo) && memcmp(GetId(idNo), other.GetId(otherIdNo), idLen) == 0;
+}
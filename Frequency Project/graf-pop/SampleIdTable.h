@@ -0,0 +1,32 @@
+#ifndef SAMPLE_ID_TABLE_H
+#define SAMPLE_ID_TABLE_H
+
+#include "Util.h"
+
+// Sample IDs kept one after another in one block of characters, each ending with '\0', so that files with
+// millions of samples don't need a string object, and a heap allocation, for each sample.
+// ID No. i starts at idOffsets[i], and ends before idOffsets[i+1].
+class SampleIdTable
+{
+private:
+    vector<char> idChars;
+    vector<long> idOffsets;       // One more than the number of IDs. The last one is the end of idChars.
+
+public:
+    SampleIdTable();
+
+    void Clear();
+    void AddId(const char*, int);
+    void AddId(const string& id) { AddId(id.c_str(), id.length()); };
+    void AddIds(const vector<string>&);
+    void AddIds(const SampleIdTable&);
+    void SelectIds(const vector<int>&);
+    bool HasSameId(int, const SampleIdTable&, int) const;
+
+    int GetNumIds() const { return idOffsets.size() - 1; };
+    long GetNumChars() const { return idChars.size(); };
+    const char* GetId(int idNo) const { return &idChars[idOffsets[idNo]]; };
+    int GetIdLength(int idNo) const { return idOffsets[idNo+1] - idOffsets[idNo] - 1; };
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "SampleSubset.h"
+
+SampleSubset::SampleSubset()
+{
+    keepFile = "";
+    removeFile = "";
+    keepIds = {};
+    removeIds = {};
+
+    blockStart = 0;
+    blockSize = 0;
+    numKeptSmps = 0;
+}
+
+bool SampleSubset::ReadKeepFile(const string& file)
+{
+    keepFile = file;
+    return ReadIdFile(file, &keepIds);
+}
+
+bool SampleSubset::ReadRemoveFile(const string& file)
+{
+    removeFile = file;
+    return ReadIdFile(file, &removeIds);
+}
+
+// Reads the sample ID from each line, i.e., the second word if the line has two or more words, otherwise the first
+bool SampleSubset::ReadIdFile(const string& file, unordered_set<string> *ids)
+{
+    ifstream idFile(file);
+    if (!idFile.is_open()) {
+        cout << "\nERROR: Couldn't open sample list " << file << "\n";
+        return false;
+    }
+
+    string line;
+    while (getline(idFile, line)) {
+        istringstream words(line);
+        string word1, word2;
+        if (!(words >> word1) || word1[0] == '#') continue;
+
+        if (words >> word2) ids->insert(word2);
+        else ids->insert(word1);
+    }
+
+    if (ids->empty()) {
+        cout << "\nERROR: Sample list " << file << " is empty\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool SampleSubset::SelectSamples(const vector<string>& fileSamples, vector<int> *selSmpNos) const
+{
+    SampleIdTable smpIds;
+    smpIds.AddIds(fileSamples);
+
+    return SelectSamples(smpIds, selSmpNos);
+}
+
+// Finds the samples to be used, in the order of the file. Returns false if no sample is selected.
+bool SampleSubset::SelectSamples(const SampleIdTable& fileSamples, vector<int> *selSmpNos) const
+{
+    selSmpNos->clear();
+    int numKeepFound = 0;
+    int numKept = 0;
+    int numFileSmps = fileSamples.GetNumIds();
+    string smp = "";    // Reused for the lookups, so IDs aren't allocated one by one
+
+    for (int smpNo = 0; smpNo < numFileSmps; smpNo++) {
+        smp.assign(fileSamples.GetId(smpNo), fileSamples.GetIdLength(smpNo));
+
+        bool isKept = true;
+        if (!keepIds.empty()) {
+            isKept = keepIds.count(smp) > 0;
+            if (isKept) numKeepFound++;
+        }
+        if (isKept && removeIds.count(smp) > 0) isKept = false;
+
+        if (isKept) {
+            if (numKept >= blockStart && (blockSize == 0 || numKept < blockStart + blockSize)) {
+                selSmpNos->push_back(smpNo);
+            }
+            numKept++;
+        }
+    }
+    numKeptSmps = numKept;
+
+    cout << "\tSelected " << selSmpNos->size() << " of " << numFileSmps << " samples";
+    if (blockSize > 0 && !selSmpNos->empty()) {
+        cout << " (block of samples " << blockStart + 1 << " - " << blockStart + selSmpNos->size() << ")";
+    }
+    if (!keepIds.empty() && numKeepFound < keepIds.size()) {
+        cout << " (" << keepIds.size() - numKeepFound << " samples in the keep list not found)";
+    }
+    cout << "\n";
+
+    if (selSmpNos->empty()) {
+        if (numKept > 0) cout << "\nERROR: No sample left after sample #" << blockStart << "\n";
+        else cout << "\nERROR: None of the samples is selected by the keep/remove lists\n";
+        return false;
+    }
+
+    return true;
+}
+
+void SampleSubset::ShowSummary()
+{
+    if (keepFile != "") cout << "Keeping " << keepIds.size() << " samples listed in " << keepFile << "\n";
+    if (removeFile != "") cout << "Removing " << removeIds.size() << " samples listed in " << removeFile << "\n";
+}
@@ -0,0 +1,41 @@
+#ifndef SAMPLE_SUBSET_H
+#define SAMPLE_SUBSET_H
+
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#include <atomic>
+#include "Util.h"
+#include "SampleIdTable.h"
+
+// Samples selected with the --keep and --remove lists. Each line of a list has a sample ID, or a family ID
+// and a sample ID as in PLINK --keep files. The genotype readers select the samples of each file when the
+// sample IDs are read, and only decode the genotypes of the selected samples.
+// In the sample-block mode (--max-memory), each pass only selects one block of the samples kept by the lists.
+class SampleSubset
+{
+private:
+    string keepFile;
+    string removeFile;
+    unordered_set<string> keepIds;
+    unordered_set<string> removeIds;
+
+    int blockStart;                     // First kept sample of the block
+    int blockSize;                      // 0 if all kept samples are used
+    mutable atomic<int> numKeptSmps;    // Samples kept by the lists when the samples were last selected
+
+    bool ReadIdFile(const string&, unordered_set<string>*);
+
+public:
+    SampleSubset();
+
+    bool ReadKeepFile(const string&);
+    bool ReadRemoveFile(const string&);
+    bool SelectSamples(const vector<string>&, vector<int>*) const;
+    bool SelectSamples(const SampleIdTable&, vector<int>*) const;
+    void SetBlock(int start, int size) { blockStart = start; blockSize = size; };
+    int GetNumKeptSamples() { return numKeptSmps; };
+    void ShowSummary();
+};
+
+#endif
@@ -52,18 +52,26 @@ GenoDatasetType CheckGenoDataFile(const string& file, string *baseName)
 {
     GenoDatasetType fileType = GenoDatasetType::IS_OTHER;
 
-    // Check if this is a plink set basename
-    bool plinkExists = false;
-    string bedFile = file + ".bed";
-    string bimFile = file + ".bim";
-    string famFile = file + ".fam";
+    // Check if this is a plink set basename. Any of the files might be gzip or zstd compressed.
+    string bedFile = FindPlinkFile(file, ".bed");
+    string bimFile = FindPlinkFile(file, ".bim");
+    string famFile = FindPlinkFile(file, ".fam");
 
-    if (FileExists(bedFile.c_str()) && FileExists(bimFile.c_str()) && FileExists(famFile.c_str())) {
+    if (bedFile != "" && bimFile != "" && famFile != "") {
         *baseName = file;
-        fileType = GenoDatasetType::IS_PLINK;
+        bool isZipped = IsCompressedFile(bedFile) || IsCompressedFile(bimFile) || IsCompressedFile(famFile);
+        fileType = isZipped ? GenoDatasetType::IS_PLINK_GZ : GenoDatasetType::IS_PLINK;
         return fileType;
     }
 
+    // PLINK 2 set basename. The .pvar file might be zstd compressed.
+    string pgenFile = file + ".pgen";
+    string psamFile = file + ".psam";
+    if (FileExists(pgenFile.c_str()) && FileExists(psamFile.c_str()) && FindPvarFile(file) != "") {
+        *baseName = file;
+        return GenoDatasetType::IS_PGEN;
+    }
+
     // Check if file exists
     bool fileExists = false;
     if (FileExists(file.c_str())) {
@@ -73,15 +81,21 @@ GenoDatasetType CheckGenoDataFile(const string& file, string *baseName)
         fileType = GenoDatasetType::NOT_EXISTS;
     }
 
-    // Check if it is a .gz file
+    // Check if it is a .gz or .zst file
     int fileLen = file.length();
-    string gzFileBase = file; // File name. If it is .gz, stripped off ".gz"
+    string gzFileBase = file; // File name. If it is .gz or .zst, stripped off ".gz" or ".zst"
     bool isGz = false;
+    bool isZst = false;
     if (fileLen > 3 && file.substr(fileLen-3, 3).compare(".gz") == 0) {
         isGz = true;
         gzFileBase = file.substr(0, fileLen-3);
         fileLen -= 3;
     }
+    else if (fileLen > 4 && file.substr(fileLen-4, 4).compare(".zst") == 0) {
+        isZst = true;
+        gzFileBase = file.substr(0, fileLen-4);
+        fileLen -= 4;
+    }
 
     // Check if it is a vcf or PLINK
     string fileBase = gzFileBase;
@@ -94,24 +108,38 @@ GenoDatasetType CheckGenoDataFile(const string& file, string *baseName)
     }
 
     bool isVcf = false;
+    bool isBcf = false;
     bool isPlink = false;
+    bool isPgen = false;
     if (fileExt.compare("vcf") == 0) {
         isVcf = true;
     }
+    else if (fileExt.compare("bcf") == 0) {
+        isBcf = true;   // BCF files are BGZF compressed, but not named .gz
+    }
     else if (fileExt.compare("bed") == 0 ||
              fileExt.compare("bim") == 0 ||
              fileExt.compare("fam") == 0   ) {
         isPlink = true;
     }
+    else if (fileExt.compare("pgen") == 0 ||
+             fileExt.compare("pvar") == 0 ||
+             fileExt.compare("psam") == 0   ) {
+        isPgen = true;
+    }
     else {
         fileBase = gzFileBase;
     }
 
+    // Of a PLINK 2 set, only the .pvar file can be compressed (.pvar.zst)
+    bool isZipped = isGz || isZst;
     if (fileExists) {
-        if      (isPlink && !isGz) fileType = GenoDatasetType::IS_PLINK;
-        else if (isPlink &&  isGz) fileType = GenoDatasetType::IS_PLINK_GZ;
-        else if (isVcf   && !isGz) fileType = GenoDatasetType::IS_VCF;
-        else if (isVcf   &&  isGz) fileType = GenoDatasetType::IS_VCF_GZ;
+        if      (isPlink && !isZipped) fileType = GenoDatasetType::IS_PLINK;
+        else if (isPlink &&  isZipped) fileType = GenoDatasetType::IS_PLINK_GZ;
+        else if (isVcf   && !isZipped) fileType = GenoDatasetType::IS_VCF;
+        else if (isVcf   &&  isGz)     fileType = GenoDatasetType::IS_VCF_GZ;
+        else if (isBcf   && !isZipped) fileType = GenoDatasetType::IS_BCF;
+        else if (isPgen  && !isGz && (!isZst || fileExt.compare("pvar") == 0)) fileType = GenoDatasetType::IS_PGEN;
     }
 
     *baseName = fileBase;
@@ -119,19 +147,62 @@ GenoDatasetType CheckGenoDataFile(const string& file, string *baseName)
     return fileType;
 }
 
+// The file of a PLINK set with the extension, e.g., ".bed", or its gzip or zstd compressed version.
+// Returns "" if none exists.
+string FindPlinkFile(const string& fileBase, const string& ext)
+{
+    string plinkFile = fileBase + ext;
+    if (FileExists(plinkFile.c_str())) return plinkFile;
+
+    if (FileExists((plinkFile + ".gz").c_str())) return plinkFile + ".gz";
+    if (FileExists((plinkFile + ".zst").c_str())) return plinkFile + ".zst";
+
+    return "";
+}
+
+bool IsCompressedFile(const string& file)
+{
+    int fileLen = file.length();
+    return (fileLen > 3 && file.compare(fileLen - 3, 3, ".gz") == 0) || IsZstdFile(file);
+}
+
+bool IsZstdFile(const string& file)
+{
+    int fileLen = file.length();
+    return fileLen > 4 && file.compare(fileLen - 4, 4, ".zst") == 0;
+}
+
+// The .pvar file of a PLINK 2 set, or the zstd compressed .pvar.zst. Returns "" if neither exists.
+string FindPvarFile(const string& fileBase)
+{
+    string pvarFile = fileBase + ".pvar";
+    if (FileExists(pvarFile.c_str())) return pvarFile;
+
+    pvarFile += ".zst";
+    if (FileExists(pvarFile.c_str())) return pvarFile;
+
+    return "";
+}
+
 int GetChromosomeFromString(const char* chrStr)
+{
+    return GetChromosomeFromString(chrStr, strlen(chrStr));
+}
+
+// Same as above, but the string doesn't need to be null-terminated
+int GetChromosomeFromString(const char* chrStr, int strLen)
 {
     int chrNum = 0;
     int i = 0;
 
-    if (strlen(chrStr) > 3 &&
+    if (strLen > 3 &&
         (chrStr[0] == 'c' || chrStr[0] == 'C') &&
         (chrStr[1] == 'h' || chrStr[1] == 'H') &&
         (chrStr[2] == 'r' || chrStr[2] == 'R') ) {
         i = 3;
     }
 
-    while(chrStr[i] != 0) {
+    while(i < strLen) {
         int num = chrStr[i] - '0';
 
         if (num >= 0 && num < 10) {
@@ -151,15 +222,21 @@ int GetChromosomeFromString(const char* chrStr)
 }
 
 int GetRsNumFromString(const char* rsStr)
+{
+    return GetRsNumFromString(rsStr, strlen(rsStr));
+}
+
+// Same as above, but the string doesn't need to be null-terminated
+int GetRsNumFromString(const char* rsStr, int strLen)
 {
     int rsNum = 0;
 
-    if (strlen(rsStr) > 2 &&
+    if (strLen > 2 &&
         (rsStr[0] == 'r' || rsStr[0] == 'R') &&
         (rsStr[1] == 's' || rsStr[1] == 'S') ) {
         int i = 2;
 
-        while(rsStr[i] != 0) {
+        while(i < strLen) {
             int num = rsStr[i] - '0';
 
             if (num >= 0 && num < 10) {
@@ -207,6 +284,13 @@ vector<string> SplitString(const string& str, const string& delim)
     return tokens;
 }
 
+double GetWallSeconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
 void ShowTimeDiff(const struct timeval &t1, const struct timeval &t2)
 {
     int usec = t2.tv_usec - t1.tv_usec;
@@ -42,7 +42,9 @@ enum class GenoDatasetType
     IS_PLINK_GZ = 2,
     IS_VCF = 3,
     IS_VCF_GZ = 4,
-    IS_OTHER = 5
+    IS_OTHER = 5,
+    IS_BCF = 6,
+    IS_PGEN = 7
 };
 
 // Define Genetic Distances to the three reference populations
@@ -64,13 +66,20 @@ struct Point
 bool FileExists (const char*);
 bool FileWriteable (const char*);
 int GetChromosomeFromString(const char*);
+int GetChromosomeFromString(const char*, int);
 int GetRsNumFromString(const char*);
+int GetRsNumFromString(const char*, int);
 void ShowTimeDiff(const struct timeval&, const struct timeval&);
+double GetWallSeconds();
 char FlipAllele(char);
 vector<string> SplitString(const string&, const string&);
 string LowerString(const string&);
 string UpperString(const string&);
 GenoDatasetType CheckGenoDataFile(const string&, string*);
+string FindPvarFile(const string&);
+string FindPlinkFile(const string&, const string&);
+bool IsCompressedFile(const string&);
+bool IsZstdFile(const string&);
 
 
 #endif
@@ -0,0 +1,435 @@
+#include "VcfGtTokenizer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VCF_GT_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static SimdLevel DetectSimdLevel()
+{
+#ifdef VCF_GT_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))   return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return SimdLevel::SSE42;
+#endif
+    return SimdLevel::SCALAR;
+}
+
+SimdLevel VcfGtTokenizer::simdLevel = DetectSimdLevel();
+
+VcfGtTokenizer::VcfGtTokenizer(int refIdx, int altIdx)
+{
+    expRefIdx = refIdx;
+    expAltIdx = altIdx;
+
+    for (int i = 0; i < 16; i++) {
+        if      (i < 10 && i == expRefIdx) alleleClasses[i] = 0;
+        else if (i < 10 && i == expAltIdx) alleleClasses[i] = 1;
+        else                               alleleClasses[i] = 2;
+    }
+
+    for (int c1 = 0; c1 < 4; c1++) {
+        for (int c2 = 0; c2 < 4; c2++) {
+            int code = 3;
+            if (c1 < 2 && c2 < 2) code = c1 + c2;
+            pairCodes[c1 * 4 + c2] = code;
+        }
+    }
+}
+
+// Genotype is valid only if both alleles are valid, i.e., same as one of the expected alleles.
+// Returns the number of alt alleles, or 3 if the genotype is not valid.
+int VcfGtTokenizer::CodeGenotype(const int expRefIdx, const int expAltIdx, const int g1Num, const int g2Num)
+{
+    int genoInt = 3;
+    int numValidGenos = 0;
+    int numAlts = 0;
+
+    if (g1Num == expRefIdx || g1Num == expAltIdx) {
+        numValidGenos++;
+        if (g1Num == expAltIdx) numAlts++;
+    }
+
+    if (g2Num == expRefIdx || g2Num == expAltIdx) {
+        numValidGenos++;
+        if (g2Num == expAltIdx) numAlts++;
+    }
+
+    if (numValidGenos == 2) genoInt = numAlts;
+
+    return genoInt;
+}
+
+// Uses the instruction set of the level, or the best one the CPU supports if it's lower, e.g., to compare the
+// decoders in grafpop-bench. Returns the level used.
+SimdLevel VcfGtTokenizer::SetSimdLevel(SimdLevel level)
+{
+    SimdLevel maxLevel = DetectSimdLevel();
+    simdLevel = int(level) < int(maxLevel) ? level : maxLevel;
+    return simdLevel;
+}
+
+string VcfGtTokenizer::GetSimdName()
+{
+    if (simdLevel == SimdLevel::AVX2)  return "AVX2";
+    if (simdLevel == SimdLevel::SSE42) return "SSE4.2";
+    return "scalar";
+}
+
+// Parses one allele index of a GT subfield, which can have more than one digit.
+// Returns -1 for a missing ('.') or invalid allele.
+static inline int ParseAlleleIndex(const char **pos, const char *lineEnd)
+{
+    const char *p = *pos;
+    int alleleIdx = -1;
+
+    if (p < lineEnd && *p >= '0' && *p <= '9') {
+        alleleIdx = 0;
+        while (p < lineEnd && *p >= '0' && *p <= '9') {
+            if (alleleIdx < 1000000) alleleIdx = alleleIdx * 10 + (*p - '0');
+            p++;
+        }
+    }
+    else if (p < lineEnd && *p == '.') {
+        p++;
+    }
+
+    *pos = p;
+    return alleleIdx;
+}
+
+static inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Decodes the GT subfield at the start of a genotype column. Missing and haploid calls are unknown.
+// Returns the position after the GT subfield.
+const char* VcfGtTokenizer::DecodeColumn(const char *p, const char *lineEnd, char *geno)
+{
+    // Single-digit alleles, e.g., 0|1 or 1/1
+    if (lineEnd - p >= 3 && IsDigit(p[0]) && (p[1] == '|' || p[1] == '/') && IsDigit(p[2]) &&
+        (lineEnd - p == 3 || !IsDigit(p[3]))) {
+        *geno = pairCodes[alleleClasses[p[0] - '0'] * 4 + alleleClasses[p[2] - '0']];
+        return p + 3;
+    }
+
+    int g1Num = ParseAlleleIndex(&p, lineEnd);
+    int g2Num = -1;
+    if (p < lineEnd && (*p == '|' || *p == '/')) {
+        p++;
+        g2Num = ParseAlleleIndex(&p, lineEnd);
+    }
+
+    *geno = 3;
+    if (g1Num > -1 && g2Num > -1) *geno = CodeGenotype(expRefIdx, expAltIdx, g1Num, g2Num);
+
+    return p;
+}
+
+// Writes at most maxGenos genotypes, and returns the number of genotype columns in the line
+int VcfGtTokenizer::Decode(const char *genoStart, const char *lineEnd, char *smpGenos, int maxGenos)
+{
+#ifdef VCF_GT_X86_SIMD
+    if (simdLevel == SimdLevel::AVX2)  return DecodeAvx2(genoStart, lineEnd, smpGenos, maxGenos);
+    if (simdLevel == SimdLevel::SSE42) return DecodeSse42(genoStart, lineEnd, smpGenos, maxGenos);
+#endif
+    return DecodeScalar(genoStart, lineEnd, smpGenos, maxGenos);
+}
+
+int VcfGtTokenizer::DecodeScalar(const char *genoStart, const char *lineEnd, char *smpGenos, int maxGenos)
+{
+    int numCols = 0;
+    const char *p = genoStart;
+
+    while (true) {
+        char geno;
+        p = DecodeColumn(p, lineEnd, &geno);
+        if (numCols < maxGenos) smpGenos[numCols] = geno;
+        numCols++;
+
+        const char *tab = (const char*)memchr(p, '\t', lineEnd - p);
+        if (!tab) break;
+        p = tab + 1;
+    }
+
+    return numCols;
+}
+
+#ifdef VCF_GT_X86_SIMD
+
+__attribute__((target("sse4.2")))
+static inline const char* FindTabSse42(const char *p, const char *lineEnd)
+{
+    const __m128i tabs = _mm_set1_epi8('\t');
+    while (lineEnd - p >= 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), tabs));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return (const char*)memchr(p, '\t', lineEnd - p);
+}
+
+// Decodes 4 columns in 16 bytes if they all look like "a|b\t" or "a/b\t", with single-digit or missing alleles
+__attribute__((target("sse4.2")))
+static inline bool DecodeBulkSse42(const char *p, __m128i classLut, __m128i pairLut, char *genos)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+
+    unsigned tabMask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    if (tabMask != 0x8888) return false;
+
+    __m128i seps = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('|')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    if ((_mm_movemask_epi8(seps) & 0x2222) != 0x2222) return false;
+
+    __m128i digits = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i isAllele = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits),
+                                    _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    if ((_mm_movemask_epi8(isAllele) & 0x5555) != 0x5555) return false;
+
+    // Each 32-bit lane has the two allele classes in bytes 0 and 2. A missing allele ('.') is in class 2.
+    __m128i classes = _mm_shuffle_epi8(classLut, _mm_and_si128(digits, _mm_set1_epi8(0x0f)));
+    __m128i byteMask = _mm_set1_epi32(0xff);
+    __m128i pairIdx = _mm_add_epi32(_mm_slli_epi32(_mm_and_si128(classes, byteMask), 2),
+                                    _mm_and_si128(_mm_srli_epi32(classes, 16), byteMask));
+    __m128i codes = _mm_shuffle_epi8(pairLut, pairIdx);
+    codes = _mm_shuffle_epi8(codes, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+
+    int packed = _mm_cvtsi128_si32(codes);
+    memcpy(genos, &packed, 4);
+
+    return true;
+}
+
+__attribute__((target("sse4.2")))
+int VcfGtTokenizer::DecodeSse42(const char *genoStart, const char *lineEnd, char *smpGenos, int maxGenos)
+{
+    const __m128i classLut = _mm_loadu_si128((const __m128i*)alleleClasses);
+    const __m128i pairLut = _mm_loadu_si128((const __m128i*)pairCodes);
+
+    int numCols = 0;
+    bool gtOnly = true;   // Previous column has only a GT subfield with single-digit or missing alleles
+    const char *p = genoStart;
+
+    while (true) {
+        if (gtOnly) {
+            while (numCols + 4 <= maxGenos && lineEnd - p >= 16 &&
+                   DecodeBulkSse42(p, classLut, pairLut, smpGenos + numCols)) {
+                p += 16;
+                numCols += 4;
+            }
+        }
+
+        char geno;
+        const char *colStart = p;
+        p = DecodeColumn(p, lineEnd, &geno);
+        if (numCols < maxGenos) smpGenos[numCols] = geno;
+        numCols++;
+
+        const char *tab = FindTabSse42(p, lineEnd);
+        if (!tab) break;
+        gtOnly = tab - colStart == 3;
+        p = tab + 1;
+    }
+
+    return numCols;
+}
+
+__attribute__((target("avx2")))
+static inline const char* FindTabAvx2(const char *p, const char *lineEnd)
+{
+    const __m256i tabs = _mm256_set1_epi8('\t');
+    while (lineEnd - p >= 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), tabs));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return (const char*)memchr(p, '\t', lineEnd - p);
+}
+
+// Decodes 8 columns in 32 bytes if they all look like "a|b\t" or "a/b\t", with single-digit or missing alleles
+__attribute__((target("avx2")))
+static inline bool DecodeBulkAvx2(const char *p, __m256i classLut, __m256i pairLut, char *genos)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+
+    unsigned tabMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    if (tabMask != 0x88888888u) return false;
+
+    __m256i seps = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')),
+                                   _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    if (((unsigned)_mm256_movemask_epi8(seps) & 0x22222222u) != 0x22222222u) return false;
+
+    __m256i digits = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i isAllele = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(digits, _mm256_set1_epi8(9)), digits),
+                                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+    if (((unsigned)_mm256_movemask_epi8(isAllele) & 0x55555555u) != 0x55555555u) return false;
+
+    // Each 32-bit lane has the two allele classes in bytes 0 and 2. A missing allele ('.') is in class 2.
+    __m256i classes = _mm256_shuffle_epi8(classLut, _mm256_and_si256(digits, _mm256_set1_epi8(0x0f)));
+    __m256i byteMask = _mm256_set1_epi32(0xff);
+    __m256i pairIdx = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(classes, byteMask), 2),
+                                       _mm256_and_si256(_mm256_srli_epi32(classes, 16), byteMask));
+    __m256i codes = _mm256_shuffle_epi8(pairLut, pairIdx);
+    codes = _mm256_shuffle_epi8(codes, _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+
+    int lo = _mm256_extract_epi32(codes, 0);
+    int hi = _mm256_extract_epi32(codes, 4);
+    memcpy(genos, &lo, 4);
+    memcpy(genos + 4, &hi, 4);
+
+    return true;
+}
+
+__attribute__((target("avx2")))
+int VcfGtTokenizer::DecodeAvx2(const char *genoStart, const char *lineEnd, char *smpGenos, int maxGenos)
+{
+    const __m256i classLut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)alleleClasses));
+    const __m256i pairLut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)pairCodes));
+
+    int numCols = 0;
+    bool gtOnly = true;   // Previous column has only a GT subfield with single-digit or missing alleles
+    const char *p = genoStart;
+
+    while (true) {
+        if (gtOnly) {
+            while (numCols + 8 <= maxGenos && lineEnd - p >= 32 &&
+                   DecodeBulkAvx2(p, classLut, pairLut, smpGenos + numCols)) {
+                p += 32;
+                numCols += 8;
+            }
+        }
+
+        char geno;
+        const char *colStart = p;
+        p = DecodeColumn(p, lineEnd, &geno);
+        if (numCols < maxGenos) smpGenos[numCols] = geno;
+        numCols++;
+
+        const char *tab = FindTabAvx2(p, lineEnd);
+        if (!tab) break;
+        gtOnly = tab - colStart == 3;
+        p = tab + 1;
+    }
+
+    return numCols;
+}
+
+#else
+
+int VcfGtTokenizer::DecodeSse42(const char *genoStart, const char *lineEnd, char *smpGenos, int maxGenos)
+{
+    return DecodeScalar(genoStart, lineEnd, smpGenos, maxGenos);
+}
+
+int VcfGtTokenizer::DecodeAvx2(const char *genoStart, const char *lineEnd, char *smpGenos, int maxGenos)
+{
+    return DecodeScalar(genoStart, lineEnd, smpGenos, maxGenos);
+}
+
+#endif
+
+// Skips numTabs tabs. Returns the position after the last one, or NULL if the line has fewer tabs.
+// The number of tabs found is saved in numSkipped.
+static const char* SkipTabsScalar(const char *p, const char *lineEnd, int numTabs, int *numSkipped)
+{
+    int skipped = 0;
+    while (skipped < numTabs) {
+        const char *tab = (const char*)memchr(p, '\t', lineEnd - p);
+        if (!tab) break;
+        skipped++;
+        p = tab + 1;
+    }
+
+    *numSkipped = skipped;
+    return skipped == numTabs ? p : NULL;
+}
+
+#ifdef VCF_GT_X86_SIMD
+
+// Tabs are counted 16 or 32 bytes at a time, and the n-th tab is found in the last block
+__attribute__((target("sse4.2,popcnt")))
+static const char* SkipTabsSse42(const char *p, const char *lineEnd, int numTabs, int *numSkipped)
+{
+    const __m128i tabs = _mm_set1_epi8('\t');
+    int skipped = 0;
+
+    while (lineEnd - p >= 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), tabs));
+        int blockTabs = __builtin_popcount(mask);
+        if (skipped + blockTabs >= numTabs) {
+            for (; skipped < numTabs - 1; skipped++) mask &= mask - 1;   // Clear the tabs before the last one
+            *numSkipped = numTabs;
+            return p + __builtin_ctz(mask) + 1;
+        }
+        skipped += blockTabs;
+        p += 16;
+    }
+
+    const char *pos = SkipTabsScalar(p, lineEnd, numTabs - skipped, numSkipped);
+    *numSkipped += skipped;
+    return pos;
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char* SkipTabsAvx2(const char *p, const char *lineEnd, int numTabs, int *numSkipped)
+{
+    const __m256i tabs = _mm256_set1_epi8('\t');
+    int skipped = 0;
+
+    while (lineEnd - p >= 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), tabs));
+        int blockTabs = __builtin_popcount(mask);
+        if (skipped + blockTabs >= numTabs) {
+            for (; skipped < numTabs - 1; skipped++) mask &= mask - 1;
+            *numSkipped = numTabs;
+            return p + __builtin_ctz(mask) + 1;
+        }
+        skipped += blockTabs;
+        p += 32;
+    }
+
+    const char *pos = SkipTabsScalar(p, lineEnd, numTabs - skipped, numSkipped);
+    *numSkipped += skipped;
+    return pos;
+}
+
+#endif
+
+const char* VcfGtTokenizer::SkipTabs(const char *p, const char *lineEnd, int numTabs, int *numSkipped)
+{
+    if (numTabs <= 0) {
+        *numSkipped = 0;
+        return p;
+    }
+
+#ifdef VCF_GT_X86_SIMD
+    if (simdLevel == SimdLevel::AVX2)  return SkipTabsAvx2(p, lineEnd, numTabs, numSkipped);
+    if (simdLevel == SimdLevel::SSE42) return SkipTabsSse42(p, lineEnd, numTabs, numSkipped);
+#endif
+    return SkipTabsScalar(p, lineEnd, numTabs, numSkipped);
+}
+
+// Decodes the GT subfields of the selected columns only. Column numbers are 0-based and in increasing order,
+// and the genotype of the i-th selected column is saved in smpGenos[i]. The other columns are not parsed.
+// Returns the number of genotype columns in the line.
+int VcfGtTokenizer::DecodeSelected(const char *genoStart, const char *lineEnd, const int *colNos, int numSelCols,
+char *smpGenos)
+{
+    const char *p = genoStart;
+    int colNo = 0;    // Column at p
+    int numSkipped;
+
+    for (int i = 0; i < numSelCols; i++) {
+        p = SkipTabs(p, lineEnd, colNos[i] - colNo, &numSkipped);
+        colNo += numSkipped;
+        if (!p) return colNo + 1;
+
+        p = DecodeColumn(p, lineEnd, &smpGenos[i]);
+    }
+
+    SkipTabs(p, lineEnd, INT_MAX, &numSkipped);
+
+    return colNo + numSkipped + 1;
+}
@@ -0,0 +1,48 @@
+#ifndef VCF_GT_TOKENIZER_H
+#define VCF_GT_TOKENIZER_H
+
+#include "Util.h"
+
+enum class SimdLevel
+{
+    SCALAR = 0,
+    SSE42 = 1,
+    AVX2 = 2
+};
+
+// Decodes the GT subfields of the genotype columns of a vcf line into genotype codes, i.e.,
+// number of expected alt alleles: 0 = RR, 1 = RA, 2 = AA, 3 = unknown.
+// Tab delimiters are searched 16 (SSE4.2) or 32 (AVX2) bytes at a time, and runs of "a|b" or "a/b"
+// columns with single-digit alleles and no other FORMAT subfields are decoded 4 or 8 columns at a time.
+// The instruction set is picked at run time, with a scalar fallback that gives the same results.
+// When only some samples are used, the columns between the selected ones are skipped by counting tabs.
+class VcfGtTokenizer
+{
+private:
+    int expRefIdx;
+    int expAltIdx;
+    char alleleClasses[16];   // Allele index 0-9 to 0 = expected ref, 1 = expected alt, 2 = other
+    char pairCodes[16];       // Genotype code of (class of allele 1) * 4 + (class of allele 2)
+
+    static SimdLevel simdLevel;
+
+    const char* DecodeColumn(const char*, const char*, char*);
+    int DecodeScalar(const char*, const char*, char*, int);
+    int DecodeSse42(const char*, const char*, char*, int);
+    int DecodeAvx2(const char*, const char*, char*, int);
+
+public:
+    VcfGtTokenizer(int, int);
+
+    static int CodeGenotype(const int, const int, const int, const int);
+    static SimdLevel GetSimdLevel() { return simdLevel; };
+    static SimdLevel SetSimdLevel(SimdLevel);
+    static string GetSimdName();
+
+    static const char* SkipTabs(const char*, const char*, int, int*);
+
+    int Decode(const char*, const char*, char*, int);
+    int DecodeSelected(const char*, const char*, const int*, int, char*);
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "VcfIndex.h"
+
+static const int TBI_MIN_SHIFT = 14;
+static const int TBI_DEPTH = 5;
+
+// Little-endian readers with bounds checking
+static bool ReadInt32(const vector<char> &data, size_t *pos, int *val)
+{
+    if (*pos + 4 > data.size()) return false;
+    const unsigned char *p = (const unsigned char*)&data[*pos];
+    *val = int(p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24);
+    *pos += 4;
+    return true;
+}
+
+static bool ReadUint64(const vector<char> &data, size_t *pos, uint64_t *val)
+{
+    if (*pos + 8 > data.size()) return false;
+    const unsigned char *p = (const unsigned char*)&data[*pos];
+    *val = 0;
+    for (int i = 7; i >= 0; i--) *val = (*val << 8) | p[i];
+    *pos += 8;
+    return true;
+}
+
+VcfIndex::VcfIndex()
+{
+    filename = "";
+    isCsi = false;
+    minShift = TBI_MIN_SHIFT;
+    depth = TBI_DEPTH;
+    refs = {};
+}
+
+VcfIndex::~VcfIndex()
+{
+    refs.clear();
+    chrToRefIds.clear();
+}
+
+bool VcfIndex::ReadIndexFile(string indexFile)
+{
+    filename = indexFile;
+
+    // Both .tbi and .csi files are BGZF compressed
+    BgzfReader reader(indexFile);
+    if (!reader.Open()) return false;
+
+    vector<char> data;
+    const char *chunk;
+    int chunkLen;
+    while ((chunkLen = reader.ReadChunk(&chunk)) > 0) data.insert(data.end(), chunk, chunk + chunkLen);
+    reader.Close();
+
+    if (chunkLen < 0 || data.size() < 4) return false;
+
+    if (!ParseIndex(data)) {
+        cout << "\nWARNING: Failed to parse index file " << indexFile << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool VcfIndex::ParseIndex(const vector<char> &data)
+{
+    size_t pos = 4;
+    size_t binsPos = 0;  // Where the bins of the first sequence start
+    int numRefs = 0, namesLen = 0;
+
+    if (memcmp(&data[0], "TBI\1", 4) == 0) {
+        isCsi = false;
+        minShift = TBI_MIN_SHIFT;
+        depth = TBI_DEPTH;
+        if (!ReadInt32(data, &pos, &numRefs)) return false;
+        // format, col_seq, col_beg, col_end, meta, skip
+        pos += 24;
+        if (!ReadInt32(data, &pos, &namesLen)) return false;
+        binsPos = pos + namesLen;
+    }
+    else if (memcmp(&data[0], "CSI\1", 4) == 0) {
+        isCsi = true;
+        int auxLen = 0;
+        if (!ReadInt32(data, &pos, &minShift) || !ReadInt32(data, &pos, &depth) || !ReadInt32(data, &pos, &auxLen)) {
+            return false;
+        }
+
+        // Sequence names are saved in the tabix-style auxiliary data
+        if (auxLen < 28) {
+            cout << "\nWARNING: CSI index " << filename << " doesn't include sequence names\n";
+            return false;
+        }
+        size_t auxEnd = pos + auxLen;
+        pos += 24;
+        if (!ReadInt32(data, &pos, &namesLen)) return false;
+        if (pos + namesLen > auxEnd) return false;
+        size_t namesPos = pos;
+        pos = auxEnd;
+        if (!ReadInt32(data, &pos, &numRefs)) return false;
+        binsPos = pos;
+        pos = namesPos;
+    }
+    else {
+        return false;
+    }
+
+    if (numRefs < 0 || pos + namesLen > data.size()) return false;
+
+    // Sequence names are null-terminated strings
+    size_t namesEnd = pos + namesLen;
+    refs.resize(numRefs);
+    for (int refNo = 0; refNo < numRefs && pos < namesEnd; refNo++) {
+        refs[refNo].name = string(&data[pos]);
+        pos += refs[refNo].name.length() + 1;
+    }
+    pos = binsPos;
+
+    unsigned int pseudoBin = ((1 << (depth + 1) * 3) - 1) / 7 + 1;
+
+    for (int refNo = 0; refNo < numRefs; refNo++) {
+        VcfIndexRef *ref = &refs[refNo];
+        int numBins = 0;
+        if (!ReadInt32(data, &pos, &numBins)) return false;
+
+        for (int binNo = 0; binNo < numBins; binNo++) {
+            int bin = 0, numChunks = 0;
+            uint64_t loffset = 0;
+
+            if (!ReadInt32(data, &pos, &bin)) return false;
+            if (isCsi && !ReadUint64(data, &pos, &loffset)) return false;
+            if (!ReadInt32(data, &pos, &numChunks)) return false;
+
+            vector<VcfChunk> chunks(numChunks);
+            for (int i = 0; i < numChunks; i++) {
+                if (!ReadUint64(data, &pos, &chunks[i].beg) || !ReadUint64(data, &pos, &chunks[i].end)) return false;
+            }
+
+            // The pseudo-bin keeps meta data, not records
+            if ((unsigned int)bin == pseudoBin) continue;
+
+            ref->binChunks[bin] = chunks;
+            if (isCsi) ref->binLoffsets[bin] = loffset;
+        }
+
+        if (!isCsi) {
+            int numIntvs = 0;
+            if (!ReadInt32(data, &pos, &numIntvs)) return false;
+            ref->linearOffsets.resize(numIntvs);
+            for (int i = 0; i < numIntvs; i++) {
+                if (!ReadUint64(data, &pos, &ref->linearOffsets[i])) return false;
+            }
+        }
+
+        int chr = GetChromosomeFromString(ref->name.c_str());
+        if (chr > 0) chrToRefIds[chr] = refNo;
+    }
+
+    return true;
+}
+
+// Bins that overlap the 0-based, half-open region [beg, end)
+void VcfIndex::GetRegionBins(long beg, long end, vector<unsigned int> *bins)
+{
+    bins->clear();
+
+    int shift = minShift + depth * 3;
+    if (end > (1L << shift)) end = 1L << shift;
+    if (beg >= end) return;
+    end--;
+
+    unsigned int levelOffset = 0;
+    for (int level = 0; level <= depth; level++) {
+        unsigned int stBin = levelOffset + (beg >> shift);
+        unsigned int edBin = levelOffset + (end >> shift);
+        for (unsigned int bin = stBin; bin <= edBin; bin++) bins->push_back(bin);
+
+        levelOffset += 1 << (level * 3);
+        shift -= 3;
+    }
+}
+
+// Adds the chunks that might include a record at the given (1-based) chromosome position
+void VcfIndex::AddPositionChunks(int chr, int pos, vector<VcfChunk> *chunks)
+{
+    if (chrToRefIds.find(chr) == chrToRefIds.end() || pos < 1) return;
+    VcfIndexRef *ref = &refs[chrToRefIds[chr]];
+
+    long beg = pos - 1;
+    vector<unsigned int> bins;
+    GetRegionBins(beg, beg + 1, &bins);
+
+    // Records before minOffset end before the position
+    uint64_t minOffset = 0;
+    if (isCsi) {
+        unsigned int leafBin = bins.back();
+        if (ref->binLoffsets.find(leafBin) != ref->binLoffsets.end()) minOffset = ref->binLoffsets[leafBin];
+    }
+    else if (!ref->linearOffsets.empty()) {
+        long window = beg >> TBI_MIN_SHIFT;
+        long numWindows = ref->linearOffsets.size();
+        minOffset = ref->linearOffsets[window < numWindows ? window : numWindows - 1];
+    }
+
+    for (int i = 0; i < bins.size(); i++) {
+        auto binIt = ref->binChunks.find(bins[i]);
+        if (binIt == ref->binChunks.end()) continue;
+
+        for (const VcfChunk& chunk : binIt->second) {
+            if (chunk.end <= minOffset) continue;
+
+            VcfChunk posChunk = chunk;
+            if (posChunk.beg < minOffset) posChunk.beg = minOffset;
+            chunks->push_back(posChunk);
+        }
+    }
+}
+
+// Sorts the chunks and merges the ones that overlap or share a BGZF block
+void VcfIndex::MergeChunks(vector<VcfChunk> *chunks)
+{
+    if (chunks->empty()) return;
+
+    sort(chunks->begin(), chunks->end(),
+         [](const VcfChunk& c1, const VcfChunk& c2) { return c1.beg < c2.beg; });
+
+    int numMerged = 0;
+    for (int i = 1; i < chunks->size(); i++) {
+        VcfChunk *last = &(*chunks)[numMerged];
+        const VcfChunk& chunk = (*chunks)[i];
+
+        if (chunk.beg <= last->end || chunk.beg >> 16 == last->end >> 16) {
+            if (chunk.end > last->end) last->end = chunk.end;
+        }
+        else {
+            numMerged++;
+            (*chunks)[numMerged] = chunk;
+        }
+    }
+
+    chunks->resize(numMerged + 1);
+}
@@ -0,0 +1,52 @@
+#ifndef VCF_INDEX_H
+#define VCF_INDEX_H
+
+#include <stdint.h>
+#include <algorithm>
+#include "Util.h"
+#include "BgzfReader.h"
+
+// A range of virtual offsets in a BGZF file
+struct VcfChunk
+{
+    uint64_t beg;
+    uint64_t end;
+};
+
+// Bins and chunks of one sequence (chromosome) in the index
+class VcfIndexRef
+{
+public:
+    string name;
+    map<unsigned int, vector<VcfChunk>> binChunks;
+    map<unsigned int, uint64_t> binLoffsets; // CSI only: smallest virtual offset of the records in each bin
+    vector<uint64_t> linearOffsets;          // TBI only: smallest virtual offset in each 16 kb window
+};
+
+// Reads a tabix (.tbi) or CSI (.csi) index of a bgzipped VCF file, and finds the
+// regions of the file that might include records at given chromosome positions
+class VcfIndex
+{
+private:
+    string filename;
+    bool isCsi;
+    int minShift;
+    int depth;
+
+    vector<VcfIndexRef> refs;
+    map<int, int> chrToRefIds;    // Chromosome number (1-22) to index of refs
+
+    bool ParseIndex(const vector<char>&);
+    void GetRegionBins(long, long, vector<unsigned int>*);
+
+public:
+    VcfIndex();
+    ~VcfIndex();
+
+    bool ReadIndexFile(string);
+    void AddPositionChunks(int, int, vector<VcfChunk>*);
+    static void MergeChunks(vector<VcfChunk>*);
+    int GetNumRefs() { return refs.size(); };
+};
+
+#endif
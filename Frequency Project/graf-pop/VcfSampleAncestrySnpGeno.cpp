@@ -6,271 +6,792 @@ VcfSampleAncestrySnpGeno::VcfSampleAncestrySnpGeno(string file, AncestrySnps *aS
     vcfFile = file;
 
     vcfSamples = {};
-    vcfAncSnpGtRefs = {};
-    vcfAncSnpGtAlts = {};
-    vcfAncSnpChrs = {};
-    vcfAncSnpPoss = {};
-    vcfAncSnpSnps = {};
-    vcfAncSnpRefs = {};
-    vcfAncSnpAlts = {};
-    vcfRsIdAncSnpIds = {};
-    vcfGb37AncSnpIds = {};
-    vcfGb38AncSnpIds = {};
-    vcfAncSnpCodedGenos = {};
+    vcfPutativeSnps = {};
     vcfAncSnpIds = {};
+    vcfAncSnpLineOffsets = {};
 
     totAncSnps = ancSnps->GetNumAncestrySnps();
     numSamples = 0;
+    numFileSamples = 0;
     totVcfSnps = 0;
     putativeAncSnps = 0;
     numRsIdAncSnps = 0;
     numGb37AncSnps = 0;
     numGb38AncSnps = 0;
     numVcfAncSnps = 0;
+    numThreads = 1;
+    vcfLineNo = 0;
+    hasHeadRow = false;
+
+    usedIndex = false;
+    numIndexRegions = 0;
+    numBlocksRead = 0;
+    numBlocksSkipped = 0;
+    decodeBytes = 0;
+    decodeSecs = 0;
+
+    smpSubset = NULL;
+    selSmpNos = {};
+
+    saveLineOffsets = false;
+    readLineOffset = 0;
+    snpLineOffsets = {};
+
+    lineQueue = NULL;
+    parsedQueue = NULL;
+    readBatch = NULL;
+    numReadBatches = 0;
+    readLineNo = 0;
+    pipelineErr = false;
+    numParsers = 0;
+    readerBusySecs = 0;
+    parserBusySecs = 0;
+    collectorBusySecs = 0;
+    posIsSorted = true;
 }
 
 VcfSampleAncestrySnpGeno::~VcfSampleAncestrySnpGeno()
 {
     vcfSamples.clear();
-    vcfAncSnpChrs.clear();
-    vcfAncSnpPoss.clear();
-    vcfAncSnpSnps.clear();
-    vcfAncSnpRefs.clear();
-    vcfAncSnpAlts.clear();
-    vcfRsIdAncSnpIds.clear();
-    vcfGb37AncSnpIds.clear();
-    vcfGb38AncSnpIds.clear();
     vcfAncSnpIds.clear();
 
     DeleteAncSnpCodedGenos();
-    DeleteAncSnpGtValues();
+    DeletePutativeSnpGenos();
 }
 
 void VcfSampleAncestrySnpGeno::DeleteAncSnpCodedGenos()
 {
-    for (int i = 0; i < vcfAncSnpCodedGenos.size(); i++) {
-        if (vcfAncSnpCodedGenos[i]) delete vcfAncSnpCodedGenos[i];
-    }
-    vcfAncSnpCodedGenos.clear();
+    vcfAncSnpGenos.DeleteRows();
 }
 
-void VcfSampleAncestrySnpGeno::DeleteAncSnpGtValues()
+// Deletes the coded genotype rows of a putative SNP, except keepRow. One row can be shared by several ID types.
+void VcfSampleAncestrySnpGeno::DeletePutativeSnpRows(VcfPutativeSnp *putSnp, const uint64_t *keepRow)
 {
-    for (int i = 0; i < vcfAncSnpGtRefs.size(); i++) {
-        if (!vcfAncSnpGtRefs[i].empty()) vcfAncSnpGtRefs[i].clear();
-        if (!vcfAncSnpGtAlts[i].empty()) vcfAncSnpGtAlts[i].clear();
+    for (int typeNo = 0; typeNo < NUM_SNP_ID_TYPES; typeNo++) {
+        uint64_t *row = putSnp->codedGenos[typeNo];
+        if (!row) continue;
+
+        if (row != keepRow) delete[] row;
+        for (int i = typeNo; i < NUM_SNP_ID_TYPES; i++) {
+            if (putSnp->codedGenos[i] == row) putSnp->codedGenos[i] = NULL;
+        }
     }
-    vcfAncSnpGtRefs.clear();
-    vcfAncSnpGtAlts.clear();
+}
+
+void VcfSampleAncestrySnpGeno::DeletePutativeSnpGenos()
+{
+    for (int i = 0; i < vcfPutativeSnps.size(); i++) DeletePutativeSnpRows(&vcfPutativeSnps[i], NULL);
+    vcfPutativeSnps.clear();
 }
 
 bool VcfSampleAncestrySnpGeno::ReadDataFromFile()
 {
     cout << "Reading data from file " << vcfFile << "\n";
-    gzFile file = gzopen (vcfFile.c_str(), "r");
-
-    int lineNo = 0;
-    int numVcfSnps = 0;
-    char colValue[WORDLEN];
-
-    vector<int> ancSnpIds;
-    vector<string> chromosomes;
-    vector<string> positions;
-    vector<string> ids;
-    vector<string> refs;
-    vector<string> alts;
-    vector<vector<int>> snpGenoVals;
-
-    colValue[0] = 0;
-    int valPos = 0;
+    BgzfReader reader(vcfFile, numThreads);
+    if (!reader.Open()) {
+        cout << "\nERROR: Couldn't open file " << vcfFile << "\n";
+        return false;
+    }
+    if (reader.IsBgzf()) cout << "\tFile is BGZF compressed. Decompressing blocks with " << numThreads << " threads\n";
+
+    if (saveLineOffsets && !reader.CanSeek()) {
+        cout << "\tFile is not BGZF compressed. The whole file will be read again for each block of samples\n";
+        saveLineOffsets = false;
+    }
+
+    // With an index, read the header first, then only the regions that might include ancestry SNPs
+    vector<VcfChunk> indexChunks;
+    if (reader.IsBgzf() && snpLineOffsets.empty()) usedIndex = FindIndexChunks(&indexChunks);
+
+    vcfLineNo = 0;
+    hasHeadRow = false;
+
+    // Bounded queues keep at most a few batches per parser in memory
+    numParsers = numThreads;
+    BoundedQueue<VcfLineBatch*> lineBatchQueue(numParsers * 2);
+    BoundedQueue<VcfParsedBatch*> parsedBatchQueue(numParsers * 2);
+    lineQueue = &lineBatchQueue;
+    parsedQueue = &parsedBatchQueue;
+    readBatch = NULL;
+    numReadBatches = 0;
+    readLineNo = 0;
+    pipelineErr = false;
+
+    vector<thread> parsers;
+    for (int i = 0; i < numParsers; i++) parsers.push_back(thread(&VcfSampleAncestrySnpGeno::RunParser, this));
+    thread collector(&VcfSampleAncestrySnpGeno::RunCollector, this);
+
+    double t1 = GetWallSeconds();
+    bool readOk = ReadLines(&reader, indexChunks);
+    if (readOk) FlushBatch();
+    readerBusySecs = GetWallSeconds() - t1 - lineQueue->GetPushWaitSecs();
+
+    if (readBatch) delete readBatch;
+    readBatch = NULL;
+
+    lineQueue->Close();
+    for (auto& parser : parsers) parser.join();
+    parsedQueue->Close();
+    collector.join();
+
+    if (!readOk || pipelineErr) return false;
+
+    if (snpLineOffsets.empty()) {
+        cout << "Done. Checked " << vcfLineNo << " lines. Found " << putativeAncSnps << " lines with ancestry SNPs\n";
+    }
+    else {
+        cout << "Done. Read " << putativeAncSnps << " lines with ancestry SNPs at the offsets found in the first pass\n";
+    }
+    reader.ShowSummary();
+    ShowPipelineSummary();
+
+    if (usedIndex) {
+        // Estimate the number of blocks in the file with the mean size of the blocks that were read
+        numBlocksRead = reader.GetNumBlocksRead();
+        long compBytesRead = reader.GetCompressedBytesRead();
+        if (compBytesRead > 0) {
+            long estFileBlocks = long(double(reader.GetFileSize()) * numBlocksRead / compBytesRead + 0.5);
+            numBlocksSkipped = estFileBlocks > numBlocksRead ? estFileBlocks - numBlocksRead : 0;
+        }
+    }
+
+    reader.Close();
+
+    return true;
+}
+
+// Splits the decompressed data into lines. Lines before the #CHROM row are processed here,
+// and the data lines are passed to the parser threads.
+bool VcfSampleAncestrySnpGeno::ReadLines(BgzfReader *reader, const vector<VcfChunk>& indexChunks)
+{
+    int chunkNo = 0;
+
+    vector<char> lineBuffer;   // Lines that span two or more chunks are assembled here
+    bool skipLine = false;     // The rest of the current line is not needed
+    bool lineChecked = false;  // Site fields of the line in lineBuffer have been checked
     bool fileDone = false;
-    bool hasHeadRow = false;
-    int buffNo = 0;
-    int maxLineLen = 0;
-    int vcfColNo = 0;
-    int numSnpLines = 0;
-
-    string gtyStr, chrStr, posStr, snpStr, refStr, altStr;
-
-    vector<string> snpGts;
-
-    while (!fileDone) {
-        int err;
-        int bytesRead;
-        char buffer[BUFFERLEN];
-        bytesRead = gzread(file, buffer, BUFFERLEN);
-        buffer[bytesRead] = '\0';
-
-        if (bytesRead < BUFFERLEN - 1) {
-            if (gzeof(file)) {
-                fileDone = true;
-            }
-            else {
-                const char * errorString;
-                errorString = gzerror(file, & err);
-                if (err) {
-                    fprintf(stderr, "Error: %s.\n", errorString);
-                    return false;
-                }
+    AncSnpPosCursor posCursor(ancSnps);
+
+    while (!fileDone && !pipelineErr) {
+        const char *buffer;
+        int bytesRead = reader->ReadChunk(&buffer);
+
+        if (bytesRead < 0) return false;
+        if (bytesRead == 0) {
+            // End of the file, or end of the current indexed region
+            if (usedIndex && hasHeadRow && chunkNo < indexChunks.size()) {
+                reader->SetRegion(indexChunks[chunkNo].beg, indexChunks[chunkNo].end);
+                chunkNo++;
+                continue;
             }
+
+            fileDone = true;
+            break;
         }
 
-        int buffPos = 0;
-        while (buffPos < bytesRead) {
-            bool isNewLine = false;
-            if (buffer[buffPos] == '\t' || buffer[buffPos] == '\n') {
-                if (buffer[buffPos] == '\n') isNewLine = true;
+        const char *buffPos = buffer;
+        const char *buffEnd = buffer + bytesRead;
 
-                colValue[valPos] = 0;
+        while (buffPos < buffEnd) {
+            if (lineBuffer.empty() && !skipLine) readLineOffset = reader->GetChunkOffset() + (buffPos - buffer);
+            const char *lineEnd = (const char*)memchr(buffPos, '\n', buffEnd - buffPos);
 
-                if      (vcfColNo == 0) {
-                    chrStr = string(colValue);
-                    chromosomes.push_back(chrStr);
-                }
-                else if (vcfColNo == 1) {
-                    posStr = string(colValue);
-                    positions.push_back(posStr);
-                }
-                else if (vcfColNo == 2) {
-                    snpStr = string(colValue);
-                    ids.push_back(snpStr);
-                }
-                else if (vcfColNo == 3) {
-                    refStr = string(colValue);
-                    refs.push_back(refStr);
-                }
-                else if (vcfColNo == 4) {
-                    altStr = string(colValue);
-                    alts.push_back(altStr);
-                }
-                else if (vcfColNo == 8) {
-                    gtyStr = string(colValue);
-                }
-                else if (vcfColNo > 8)  {
-                    string gtStr = string(colValue);
-                    snpGts.push_back(gtStr);
+            if (skipLine) {
+                if (!lineEnd) break;
+                AddBatchLine(NULL, NULL);
+                skipLine = false;
+                buffPos = lineEnd + 1;
+                continue;
+            }
+
+            if (!lineEnd) {
+                lineBuffer.insert(lineBuffer.end(), buffPos, buffEnd);
+                buffPos = buffEnd;
+
+                // Skip the rest of a long line as soon as it is known not to be an ancestry SNP
+                if (!lineChecked && hasHeadRow && lineBuffer[0] != '#') {
+                    int rsSnpId, gb37SnpId, gb38SnpId;
+                    int check = CheckSiteFields(&lineBuffer[0], &lineBuffer[0] + lineBuffer.size(), &posCursor,
+                                                &rsSnpId, &gb37SnpId, &gb38SnpId);
+                    if (check == 0) {
+                        skipLine = true;
+                        lineBuffer.clear();
+                    }
+                    else if (check > 0) {
+                        lineChecked = true;
+                    }
                 }
+                break;
+            }
 
-                valPos = 0;
-                colValue[0] = 0;
-                vcfColNo++;
+            bool lineOk;
+            if (lineBuffer.empty()) {
+                lineOk = ReadLine(buffPos, lineEnd);
             }
             else {
-                if (buffer[buffPos] != '\r' && valPos < WORDLEN-1) {
-                    colValue[valPos] = buffer[buffPos];
-                    valPos++;
-                }
-                else {
-                    colValue[valPos] = 0;
-                }
+                lineBuffer.insert(lineBuffer.end(), buffPos, lineEnd);
+                lineOk = ReadLine(&lineBuffer[0], &lineBuffer[0] + lineBuffer.size());
+                lineBuffer.clear();
             }
 
-            if (buffer[buffPos] == '\n') {
-                vcfColNo = 0;
-                lineNo++;
+            if (!lineOk) return false;
+            lineChecked = false;
+            buffPos = lineEnd + 1;
 
-                bool isGt = false;
-                if (gtyStr.length() > 1 && gtyStr[0] == 'G' && gtyStr[1] == 'T') isGt = true;
-                int numCols = snpGts.size();
+            // The lines with ancestry SNPs are known from the first pass
+            if (!snpLineOffsets.empty() && hasHeadRow) return ReadSnpLines(reader);
 
-                if (strcmp(chrStr.c_str(), "#CHROM") == 0) {
-                    if (numSamples > 0) {
-                        assert(numCols == numSamples);
-                    }
-                    else {
-                        if (numCols > 0) {
-                            for (int smpNo = 0; smpNo < numCols; smpNo++) vcfSamples.push_back(snpGts[smpNo]);
-                            numSamples = numCols;
-                            cout << "\tVcf file has " << numSamples << " samples\n";
-                        }
-                        else {
-                            cout << "\nERROR: vcf file " << vcfFile << " doesn't include samples!\n";
-                            fileDone = true;
-                            return false;
-                        }
-                    }
+            // With an index, skip the rest of the file after the header and start reading the regions
+            if (usedIndex && hasHeadRow && chunkNo == 0) {
+                reader->SetRegion(indexChunks[0].beg, indexChunks[0].end);
+                chunkNo++;
+                break;
+            }
+        }
+    }
 
-                    hasHeadRow = true;
-                    snpGts.clear();
-                }
-                else if (chrStr[0] && chrStr[0] != '#') {
-                    if (!hasHeadRow) {
-                        cout << "\nERROR: didn't find #CHROM row in vcf file\n";
-                        return false;
-                    }
+    // The last line might not end with a new line
+    if (!lineBuffer.empty() && !skipLine) {
+        if (!ReadLine(&lineBuffer[0], &lineBuffer[0] + lineBuffer.size())) return false;
+    }
 
-                    if (numCols != numSamples) {
-                        cout << "\nERROR at line #" << lineNo << ": chr " << chrStr
-                             << ", pos " << posStr << ", snp " << snpStr
-                             << ". #genotypes (" << numCols << ") is different from #samples (" << numSamples << ").\n";
-                        return false;
-                    }
+    return true;
+}
 
-                    int chr = GetChromosomeFromString(chrStr.c_str());
-                    int rsNum = GetRsNumFromString(snpStr.c_str());
-                    int pos = 0;
-                    try { pos = stoi(posStr); }
-                    catch (exception &err) { pos = 0; }
-
-                    int rsSnpId = ancSnps->FindSnpIdGivenRs(rsNum);
-                    int gb37SnpId = ancSnps->FindSnpIdGivenChrPos(chr, pos, 37);
-                    int gb38SnpId = ancSnps->FindSnpIdGivenChrPos(chr, pos, 38);
-
-                    if (isGt && (rsSnpId > -1 || gb37SnpId > -1 || gb38SnpId > -1)) {
-                        putativeAncSnps++;
-                        if (rsSnpId > -1)   numRsIdAncSnps++;
-                        if (gb37SnpId > -1) numGb37AncSnps++;
-                        if (gb38SnpId > -1) numGb38AncSnps++;
-
-                        vcfAncSnpChrs.push_back(chr);
-                        vcfAncSnpPoss.push_back(pos);
-                        vcfAncSnpSnps.push_back(snpStr);
-                        vcfAncSnpRefs.push_back(refStr);
-                        vcfAncSnpAlts.push_back(altStr);
-
-                        vcfRsIdAncSnpIds.push_back(rsSnpId);
-                        vcfGb37AncSnpIds.push_back(gb37SnpId);
-                        vcfGb38AncSnpIds.push_back(gb38SnpId);
-
-                        vector<char> gtRefs;
-                        vector<char> gtAlts;
-                        for (int i = 0; i < numCols; i++) {
-                            string gtStr = snpGts[i];
-                            int gtLen = gtStr.length();
-                            char gRef = 0, gAlt = 0;
-                            if (gtLen > 2 && (gtStr[1] == '|' || gtStr[1] == '/')) {
-                                gRef = gtStr[0];
-                                gAlt = gtStr[2];
-                            }
-
-                            gtRefs.push_back(gRef);
-                            gtAlts.push_back(gAlt);
-                        }
-
-                        vcfAncSnpGtRefs.push_back(gtRefs);
-                        vcfAncSnpGtAlts.push_back(gtAlts);
-                    }
+// Reads the lines at the offsets saved in the first pass, and passes them to the parser threads. The offsets
+// are in the order of the file, so most lines are in the chunk already read, or shortly after it. The reader only
+// seeks to lines farther away. For BGZF files the distance is between the compressed blocks.
+bool VcfSampleAncestrySnpGeno::ReadSnpLines(BgzfReader *reader)
+{
+    vector<char> lineBuffer;
+    const char *chunk = NULL;
+    int chunkLen = 0;
+    uint64_t chunkOffset = 0;
+    bool isBgzf = reader->IsBgzf();
+
+    for (int i = 0; i < snpLineOffsets.size() && !pipelineErr; i++) {
+        uint64_t lineOffset = snpLineOffsets[i];
+
+        // Read forward while the line is close after the current chunk
+        while (chunk && lineOffset >= chunkOffset + chunkLen) {
+            uint64_t dist = isBgzf ? (lineOffset >> 16) - (chunkOffset >> 16) : lineOffset - chunkOffset - chunkLen;
+            if (dist > VCF_READ_AHEAD_BYTES) break;
+
+            chunkLen = reader->ReadChunk(&chunk);
+            if (chunkLen < 0) return false;
+            if (chunkLen == 0) chunk = NULL;
+            chunkOffset = reader->GetChunkOffset();
+        }
 
-                    numVcfSnps++;
-                    snpGts.clear();
-                }
+        if (!chunk || lineOffset < chunkOffset || lineOffset >= chunkOffset + chunkLen) {
+            if (!reader->Seek(lineOffset)) {
+                cout << "\nERROR: Couldn't move to offset " << lineOffset << " in file " << vcfFile << "\n";
+                return false;
+            }
+
+            chunkLen = reader->ReadChunk(&chunk);
+            if (chunkLen < 0) return false;
+            if (chunkLen == 0) chunk = NULL;
+            chunkOffset = lineOffset;
+        }
+
+        // Lines within the chunk are passed from it. Lines across chunks are joined in the buffer.
+        lineBuffer.clear();
+        const char *lineStart = chunk ? chunk + (lineOffset - chunkOffset) : NULL;
+        const char *lineEnd = NULL;
+        while (chunk) {
+            const char *chunkEnd = chunk + chunkLen;
+            lineEnd = (const char*)memchr(lineStart, '\n', chunkEnd - lineStart);
+            if (lineEnd) break;
+
+            lineBuffer.insert(lineBuffer.end(), lineStart, chunkEnd);
+            chunkLen = reader->ReadChunk(&chunk);
+            if (chunkLen < 0) return false;
+            if (chunkLen == 0) chunk = NULL;
+            chunkOffset = reader->GetChunkOffset();
+            lineStart = chunk;
+        }
 
-                if (lineNo % 1000000 == 0) {
-                    cout << "\tChecked " << lineNo << " lines. Found " << putativeAncSnps << " lines with ancestry SNPs\n";
+        if (!lineBuffer.empty()) {
+            if (lineEnd) lineBuffer.insert(lineBuffer.end(), lineStart, lineEnd);
+            lineStart = &lineBuffer[0];
+            lineEnd = lineStart + lineBuffer.size();
+        }
+
+        if (lineEnd && lineEnd > lineStart) {
+            readLineOffset = lineOffset;
+            AddBatchLine(lineStart, lineEnd);
+            continue;
+        }
+
+        cout << "\nERROR: No vcf line at offset " << lineOffset << " in file " << vcfFile << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool VcfSampleAncestrySnpGeno::ReadLine(const char *line, const char *lineEnd)
+{
+    if (hasHeadRow) {
+        AddBatchLine(line, lineEnd);
+        return true;
+    }
+
+    bool lineOk = ProcessLine(line, lineEnd);
+    readLineNo = vcfLineNo;
+
+    return lineOk;
+}
+
+// Adds a data line to the current batch, and passes the batch to the parsers when it is full.
+// A NULL line is a line skipped by the reader.
+void VcfSampleAncestrySnpGeno::AddBatchLine(const char *line, const char *lineEnd)
+{
+    if (!readBatch) {
+        readBatch = new VcfLineBatch;
+        readBatch->batchNo = numReadBatches;
+        readBatch->firstLineNo = readLineNo + 1;
+        readBatch->numLines = 0;
+        readBatch->numSkippedSnps = 0;
+        numReadBatches++;
+    }
+
+    if (line) {
+        readBatch->data.insert(readBatch->data.end(), line, lineEnd);
+    }
+    else {
+        readBatch->numSkippedSnps++;
+    }
+    readBatch->data.push_back('\n');
+    if (saveLineOffsets) readBatch->lineOffsets.push_back(readLineOffset);
+    readBatch->numLines++;
+    readLineNo++;
+
+    if (readBatch->data.size() >= VCF_BATCH_BYTES) FlushBatch();
+}
+
+void VcfSampleAncestrySnpGeno::FlushBatch()
+{
+    if (!readBatch) return;
+
+    lineQueue->Push(readBatch);
+    readBatch = NULL;
+}
+
+void VcfSampleAncestrySnpGeno::RunParser()
+{
+    double busySecs = 0;
+    VcfLineBatch *batch;
+
+    // Each parser gets the batches in the order of the file, so its lines are still sorted by position
+    AncSnpPosCursor posCursor(ancSnps);
+
+    while (lineQueue->Pop(&batch)) {
+        double t1 = GetWallSeconds();
+
+        VcfParsedBatch *parsed = new VcfParsedBatch;
+        parsed->batchNo = batch->batchNo;
+        parsed->numLines = batch->numLines;
+        parsed->numVcfSnps = batch->numSkippedSnps;
+        parsed->decodeBytes = 0;
+        parsed->decodeSecs = 0;
+        parsed->hasErr = false;
+
+        // Skip all lines after an error. They won't be used.
+        if (!pipelineErr) {
+            int lineNo = batch->firstLineNo;
+            const char *line = &batch->data[0];
+            const char *dataEnd = line + batch->data.size();
+
+            while (line < dataEnd) {
+                const char *lineEnd = (const char*)memchr(line, '\n', dataEnd - line);
+                uint64_t lineOffset = saveLineOffsets ? batch->lineOffsets[lineNo - batch->firstLineNo] : 0;
+                if (!ParseSnpLine(line, lineEnd, lineNo, lineOffset, &posCursor, parsed)) {
+                    parsed->hasErr = true;
+                    break;
                 }
+                line = lineEnd + 1;
+                lineNo++;
             }
+        }
 
-            buffPos++;
+        delete batch;
+        busySecs += GetWallSeconds() - t1;
+
+        parsedQueue->Push(parsed);
+    }
+
+    lock_guard<mutex> lock(statsMutex);
+    parserBusySecs += busySecs;
+    if (!posCursor.IsSorted()) posIsSorted = false;
+}
+
+// Batches might arrive out of order. Keeps them until all the previous ones have been added.
+void VcfSampleAncestrySnpGeno::RunCollector()
+{
+    map<long, VcfParsedBatch*> waitBatches;
+    long nextBatchNo = 0;
+    VcfParsedBatch *parsed;
+
+    while (parsedQueue->Pop(&parsed)) {
+        double t1 = GetWallSeconds();
+
+        waitBatches[parsed->batchNo] = parsed;
+        while (!waitBatches.empty() && waitBatches.begin()->first == nextBatchNo) {
+            AddParsedBatch(waitBatches.begin()->second);
+            waitBatches.erase(waitBatches.begin());
+            nextBatchNo++;
         }
 
-        buffNo++;
+        collectorBusySecs += GetWallSeconds() - t1;
     }
+}
 
-    lineNo++;
+void VcfSampleAncestrySnpGeno::AddParsedBatch(VcfParsedBatch *parsed)
+{
+    if (parsed->hasErr && !pipelineErr) {
+        cout << parsed->errMsg;
+        pipelineErr = true;
+    }
+
+    int prevLineNo = vcfLineNo;
+    vcfLineNo += parsed->numLines;
+    totVcfSnps += parsed->numVcfSnps;
+    decodeBytes += parsed->decodeBytes;
+    decodeSecs += parsed->decodeSecs;
+
+    for (const VcfPutativeSnp& putSnp : parsed->putSnps) AddPutativeSnp(putSnp);
+
+    delete parsed;
+
+    if (vcfLineNo / 1000000 > prevLineNo / 1000000) {
+        cout << "\tChecked " << vcfLineNo << " lines. Found " << putativeAncSnps << " lines with ancestry SNPs\n";
+    }
+}
+
+void VcfSampleAncestrySnpGeno::AddPutativeSnp(const VcfPutativeSnp& putSnp)
+{
+    putativeAncSnps++;
+    if (putSnp.ancSnpIds[int(AncestrySnpType::RSID)] > -1) numRsIdAncSnps++;
+    if (putSnp.ancSnpIds[int(AncestrySnpType::GB37)] > -1) numGb37AncSnps++;
+    if (putSnp.ancSnpIds[int(AncestrySnpType::GB38)] > -1) numGb38AncSnps++;
+    vcfPutativeSnps.push_back(putSnp);
+}
+
+void VcfSampleAncestrySnpGeno::ShowPipelineSummary()
+{
+    printf("\tBusy seconds: reader %.2f, %d parsers %.2f, collector %.2f\n",
+           readerBusySecs, numParsers, parserBusySecs, collectorBusySecs);
+    printf("\tLine batch queue: mean depth %.1f, max %d of %d. Parsed batch queue: mean depth %.1f, max %d of %d\n",
+           lineQueue->GetMeanDepth(), int(lineQueue->GetMaxDepth()), int(lineQueue->GetCapacity()),
+           parsedQueue->GetMeanDepth(), int(parsedQueue->GetMaxDepth()), int(parsedQueue->GetCapacity()));
+}
+
+void VcfSampleAncestrySnpGeno::CountLine()
+{
+    vcfLineNo++;
+    if (vcfLineNo % 1000000 == 0) {
+        cout << "\tChecked " << vcfLineNo << " lines. Found " << putativeAncSnps << " lines with ancestry SNPs\n";
+    }
+}
+
+// Finds ancestry SNP IDs using the CHROM, POS and ID fields, without copying them. Positions are matched with
+// the cursor of the calling thread. Returns -1 if the line is too short to include these fields, 1 if any of the
+// IDs is found, otherwise 0.
+int VcfSampleAncestrySnpGeno::CheckSiteFields(const char *line, const char *lineEnd, AncSnpPosCursor *posCursor,
+int *rsSnpId, int *gb37SnpId, int *gb38SnpId)
+{
+    const char *chrTab = (const char*)memchr(line, '\t', lineEnd - line);
+    if (!chrTab) return -1;
+    const char *posTab = (const char*)memchr(chrTab + 1, '\t', lineEnd - chrTab - 1);
+    if (!posTab) return -1;
+    const char *idTab = (const char*)memchr(posTab + 1, '\t', lineEnd - posTab - 1);
+    if (!idTab) return -1;
+
+    int chr = GetChromosomeFromString(line, chrTab - line);
+    int rsNum = GetRsNumFromString(posTab + 1, idTab - posTab - 1);
+
+    int pos = 0;
+    for (const char *p = chrTab + 1; p < posTab && *p >= '0' && *p <= '9'; p++) {
+        pos = pos * 10 + (*p - '0');
+        if (pos > 300000000) {
+            pos = 0;
+            break;
+        }
+    }
 
-    cout << "Done. Checked " << lineNo << " lines. Found " << putativeAncSnps << " lines with ancestry SNPs\n";
-    gzclose (file);
-    totVcfSnps += numVcfSnps;
+    *rsSnpId = ancSnps->FindSnpIdGivenRs(rsNum);
+    *gb37SnpId = posCursor->FindSnpIdGivenChrPos(chr, pos, 37);
+    *gb38SnpId = posCursor->FindSnpIdGivenChrPos(chr, pos, 38);
+
+    return *rsSnpId > -1 || *gb37SnpId > -1 || *gb38SnpId > -1 ? 1 : 0;
+}
+
+bool VcfSampleAncestrySnpGeno::ReadHeaderRow(const char *line, const char *lineEnd)
+{
+    vector<string> headCols;
+    const char *colStart = line;
+    while (colStart <= lineEnd) {
+        const char *tab = (const char*)memchr(colStart, '\t', lineEnd - colStart);
+        if (!tab) tab = lineEnd;
+        headCols.push_back(string(colStart, tab - colStart));
+        colStart = tab + 1;
+    }
+
+    int numCols = headCols.size() > 9 ? headCols.size() - 9 : 0;
+
+    if (numFileSamples > 0) {
+        assert(numCols == numFileSamples);
+    }
+    else {
+        if (numCols > 0) {
+            cout << "\tVcf file has " << numCols << " samples\n";
+            if (!SetSamples(vector<string>(headCols.begin() + 9, headCols.end()))) return false;
+        }
+        else {
+            cout << "\nERROR: vcf file " << vcfFile << " doesn't include samples!\n";
+            return false;
+        }
+    }
+
+    hasHeadRow = true;
+
+    return true;
+}
+
+// Keeps the samples selected by the keep/remove lists, or all the samples in the file
+bool VcfSampleAncestrySnpGeno::SetSamples(const vector<string>& fileSamples)
+{
+    numFileSamples = fileSamples.size();
+    selSmpNos.clear();
+
+    if (smpSubset) {
+        if (!smpSubset->SelectSamples(fileSamples, &selSmpNos)) return false;
+        for (int i = 0; i < selSmpNos.size(); i++) vcfSamples.push_back(fileSamples[selSmpNos[i]]);
+
+        // All samples are selected. Decode all the columns.
+        if (selSmpNos.size() == numFileSamples) selSmpNos.clear();
+    }
+    else {
+        vcfSamples = fileSamples;
+    }
+
+    numSamples = vcfSamples.size();
+    vcfAncSnpGenos.SetNumSamples(numSamples);
+
+    return true;
+}
+
+// Processes the lines up to the #CHROM row
+bool VcfSampleAncestrySnpGeno::ProcessLine(const char *line, const char *lineEnd)
+{
+    CountLine();
+
+    if (lineEnd > line && lineEnd[-1] == '\r') lineEnd--;
+    if (lineEnd == line) return true;
+
+    if (line[0] == '#') {
+        if (lineEnd - line >= 6 && strncmp(line, "#CHROM", 6) == 0) return ReadHeaderRow(line, lineEnd);
+        return true;
+    }
+
+    cout << "\nERROR: didn't find #CHROM row in vcf file\n";
+    return false;
+}
+
+// Called by the parser threads. Checks the site fields first, and only tokenizes the genotype columns of
+// the lines with ancestry SNPs. Results are saved in the parsed batch.
+bool VcfSampleAncestrySnpGeno::ParseSnpLine(const char *line, const char *lineEnd, int lineNo, uint64_t lineOffset,
+AncSnpPosCursor *posCursor, VcfParsedBatch *parsed)
+{
+    if (lineEnd > line && lineEnd[-1] == '\r') lineEnd--;
+    if (lineEnd == line || line[0] == '#') return true;
+
+    parsed->numVcfSnps++;
+
+    int rsSnpId, gb37SnpId, gb38SnpId;
+    if (CheckSiteFields(line, lineEnd, posCursor, &rsSnpId, &gb37SnpId, &gb38SnpId) < 1) return true;
+
+    // Fields up to FORMAT. Columns after the last one found start at lineEnd + 1.
+    const char *colStarts[VCF_GENO_COL + 1];
+    colStarts[0] = line;
+    bool hasGenoCols = true;
+    for (int colNo = 1; colNo <= VCF_GENO_COL; colNo++) {
+        const char *tab = NULL;
+        if (hasGenoCols) tab = (const char*)memchr(colStarts[colNo-1], '\t', lineEnd - colStarts[colNo-1]);
+        if (!tab) hasGenoCols = false;
+        colStarts[colNo] = tab ? tab + 1 : lineEnd + 1;
+    }
+
+    if (!hasGenoCols) {
+        parsed->errMsg = GetGenoCountError(colStarts, lineNo, 0);
+        return false;
+    }
+
+    // Only use lines with GT as the first FORMAT field
+    const char *fmtStart = colStarts[VCF_GENO_COL-1];
+    int fmtLen = colStarts[VCF_GENO_COL] - fmtStart - 1;
+    bool isGt = fmtLen > 1 && fmtStart[0] == 'G' && fmtStart[1] == 'T';
+    if (!isGt) return true;
+
+    // Resolve the expected allele indices for each ID type, and decode the genotypes straight into the final rows
+    string vcfRef = string(colStarts[3], colStarts[4] - colStarts[3] - 1);
+    string vcfAlt = string(colStarts[4], colStarts[5] - colStarts[4] - 1);
+
+    VcfPutativeSnp putSnp;
+    int expRefIdxs[NUM_SNP_ID_TYPES];
+    int expAltIdxs[NUM_SNP_ID_TYPES];
+    SetPutativeSnpRows(&putSnp, rsSnpId, gb37SnpId, gb38SnpId, vcfRef, vcfAlt, expRefIdxs, expAltIdxs);
+    putSnp.lineOffset = lineOffset;
+
+    int numCols = -1;
+    for (int typeNo = 0; typeNo < NUM_SNP_ID_TYPES; typeNo++) {
+        if (!OwnsPutativeSnpRow(putSnp, typeNo)) continue;
+        numCols = DecodeGenotypes(colStarts[VCF_GENO_COL], lineEnd,
+                                  expRefIdxs[typeNo], expAltIdxs[typeNo], putSnp.codedGenos[typeNo], parsed);
+    }
+
+    // None of the ID types has matched alleles. Only count the genotype columns.
+    if (numCols < 0) {
+        numCols = 1;
+        const char *colStart = colStarts[VCF_GENO_COL];
+        while (const char *tab = (const char*)memchr(colStart, '\t', lineEnd - colStart)) {
+            numCols++;
+            colStart = tab + 1;
+        }
+    }
+
+    if (numCols != numFileSamples) {
+        DeletePutativeSnpRows(&putSnp, NULL);
+        parsed->errMsg = GetGenoCountError(colStarts, lineNo, numCols);
+        return false;
+    }
+
+    parsed->putSnps.push_back(putSnp);
+
+    return true;
+}
+
+// Error message of a line whose number of genotype columns is different from the number of samples. Missing
+// site columns start at lineEnd + 1, and are shown as empty.
+string VcfSampleAncestrySnpGeno::GetGenoCountError(const char **colStarts, int lineNo, int numCols)
+{
+    string siteStrs[3];
+    for (int colNo = 0; colNo < 3; colNo++) {
+        long colLen = colStarts[colNo+1] - colStarts[colNo] - 1;
+        if (colLen > 0) siteStrs[colNo] = string(colStarts[colNo], colLen);
+    }
+
+    return "\nERROR at line #" + to_string(lineNo) + ": chr " + siteStrs[0] + ", pos " + siteStrs[1]
+           + ", snp " + siteStrs[2] + ". #genotypes (" + to_string(numCols)
+           + ") is different from #samples (" + to_string(numFileSamples) + ").\n";
+}
+
+// Resolves the expected allele indices of each ID type, and allocates the coded genotype rows.
+// Types with the same expected allele indices share one row. Returns the number of rows allocated.
+int VcfSampleAncestrySnpGeno::SetPutativeSnpRows(VcfPutativeSnp *putSnp, const int rsSnpId, const int gb37SnpId,
+const int gb38SnpId, const string& vcfRef, const string& vcfAlt, int *expRefIdxs, int *expAltIdxs)
+{
+    putSnp->ancSnpIds[int(AncestrySnpType::RSID)] = rsSnpId;
+    putSnp->ancSnpIds[int(AncestrySnpType::GB37)] = gb37SnpId;
+    putSnp->ancSnpIds[int(AncestrySnpType::GB38)] = gb38SnpId;
+    putSnp->lineOffset = 0;
+
+    int numRows = 0;
+
+    for (int typeNo = 0; typeNo < NUM_SNP_ID_TYPES; typeNo++) {
+        putSnp->codedGenos[typeNo] = NULL;
+        expRefIdxs[typeNo] = -1;
+        expAltIdxs[typeNo] = -1;
+
+        int ancSnpId = putSnp->ancSnpIds[typeNo];
+        if (ancSnpId < 0) continue;
+
+        char eRef = ancSnps->snpRefs[ancSnpId];
+        char eAlt = ancSnps->snpAlts[ancSnpId];
+        CompareAncestrySnpAlleles(vcfRef, vcfAlt, eRef, eAlt, &expRefIdxs[typeNo], &expAltIdxs[typeNo]);
+        if (expRefIdxs[typeNo] < 0 || expAltIdxs[typeNo] < 0) continue;
+
+        for (int prevNo = 0; prevNo < typeNo; prevNo++) {
+            if (putSnp->codedGenos[prevNo] &&
+                expRefIdxs[prevNo] == expRefIdxs[typeNo] && expAltIdxs[prevNo] == expAltIdxs[typeNo]) {
+                putSnp->codedGenos[typeNo] = putSnp->codedGenos[prevNo];
+                break;
+            }
+        }
+
+        if (!putSnp->codedGenos[typeNo]) {
+            putSnp->codedGenos[typeNo] = vcfAncSnpGenos.NewRow();
+            numRows++;
+        }
+    }
+
+    return numRows;
+}
+
+// True if the row of this ID type is allocated and not shared with a previous type, i.e., needs to be decoded
+bool VcfSampleAncestrySnpGeno::OwnsPutativeSnpRow(const VcfPutativeSnp& putSnp, int typeNo)
+{
+    uint64_t *row = putSnp.codedGenos[typeNo];
+    if (!row) return false;
+
+    for (int prevNo = 0; prevNo < typeNo; prevNo++) {
+        if (putSnp.codedGenos[prevNo] == row) return false;
+    }
+
+    return true;
+}
+
+// Decodes the GT subfields of the genotype columns into the number of expected alt alleles, i.e.,
+// 0 = RR, 1 = RA, 2 = AA, 3 = unknown. Missing and haploid calls are unknown.
+// Decodes the genotypes of the selected samples, or at most numSamples genotypes if all samples are used,
+// and packs them into the row. Returns the number of genotype columns in the line.
+int VcfSampleAncestrySnpGeno::DecodeGenotypes(const char *genoStart, const char *lineEnd,
+const int expRefIdx, const int expAltIdx, uint64_t *row, VcfParsedBatch *parsed)
+{
+    double t1 = GetWallSeconds();
+
+    if (parsed->smpGenos.size() < numSamples) parsed->smpGenos.resize(numSamples);
+    char *smpGenos = &parsed->smpGenos[0];
+
+    VcfGtTokenizer tokenizer(expRefIdx, expAltIdx);
+    int numCols;
+    if (selSmpNos.empty()) numCols = tokenizer.Decode(genoStart, lineEnd, smpGenos, numSamples);
+    else numCols = tokenizer.DecodeSelected(genoStart, lineEnd, &selSmpNos[0], numSamples, smpGenos);
+    vcfAncSnpGenos.PackRow(smpGenos, row);
+
+    parsed->decodeSecs += GetWallSeconds() - t1;
+    parsed->decodeBytes += lineEnd - genoStart;
+
+    return numCols;
+}
+
+// Finds the regions of the BGZF file that might include ancestry SNPs, at either GRCh37 or GRCh38 positions.
+// Returns false if there is no usable .tbi or .csi file next to the vcf file.
+bool VcfSampleAncestrySnpGeno::FindIndexChunks(vector<VcfChunk> *chunks)
+{
+    string indexFile = vcfFile + ".tbi";
+    if (!FileExists(indexFile.c_str())) indexFile = vcfFile + ".csi";
+    if (!FileExists(indexFile.c_str())) return false;
+
+    VcfIndex index;
+    if (!index.ReadIndexFile(indexFile)) return false;
+
+    for (int i = 0; i < totAncSnps; i++) {
+        index.AddPositionChunks(ancSnps->snpChrs[i], ancSnps->snpPos37s[i], chunks);
+        index.AddPositionChunks(ancSnps->snpChrs[i], ancSnps->snpPos38s[i], chunks);
+    }
+
+    VcfIndex::MergeChunks(chunks);
+    numIndexRegions = chunks->size();
+
+    if (chunks->empty()) {
+        cout << "\tIndex file " << indexFile << " doesn't include chromosomes 1-22. Reading the whole file\n";
+        return false;
+    }
+
+    cout << "\tUsing index file " << indexFile << " to read " << numIndexRegions << " regions with ancestry SNPs\n";
 
     return true;
 }
@@ -291,46 +812,32 @@ void VcfSampleAncestrySnpGeno::RecodeSnpGenotypes()
         maxVcfAncSnps = numGb38AncSnps;
     }
 
-    int saveSnpNo = 0; // Putative SNPs saved after vcf file was read
-    int ancSnpNo = 0;  // Final list of ancestry SNPs to be used for ancestry inference
-
-    for (saveSnpNo = 0; saveSnpNo < putativeAncSnps; saveSnpNo++) {
-        int ancSnpId = -1;
-        if      (ancSnpType == AncestrySnpType::RSID) ancSnpId = vcfRsIdAncSnpIds[saveSnpNo];
-        else if (ancSnpType == AncestrySnpType::GB37) ancSnpId = vcfGb37AncSnpIds[saveSnpNo];
-        else if (ancSnpType == AncestrySnpType::GB38) ancSnpId = vcfGb38AncSnpIds[saveSnpNo];
-
-        if (ancSnpId > -1) {
-            char eRef = ancSnps->snps[ancSnpId].ref;
-            char eAlt = ancSnps->snps[ancSnpId].alt;
-
-            string vcfRef = vcfAncSnpRefs[saveSnpNo];
-            string vcfAlt = vcfAncSnpAlts[saveSnpNo];
-
-            int expRefIdx = -1;
-            int expAltIdx = -1;
-
-            CompareAncestrySnpAlleles(vcfRef, vcfAlt, eRef, eAlt, &expRefIdx, &expAltIdx);
-
-            if (expRefIdx > -1 && expAltIdx > -1) {
-                char* smpGenos = new char[numSamples];
-                vector<char> gtRefVal = vcfAncSnpGtRefs[saveSnpNo];
-                vector<char> gtAltVal = vcfAncSnpGtAlts[saveSnpNo];
+    RecodeSnpGenotypes(ancSnpType);
+}
 
-                for (int smpNo = 0; smpNo < numSamples; smpNo++) {
-                    int refGval = gtRefVal[smpNo] - '0';
-                    int altGval = gtAltVal[smpNo] - '0';
-                    char geno = RecodeGenotypeGivenIntegers(expRefIdx, expAltIdx, refGval, altGval);
-                    smpGenos[smpNo] = geno;
-                }
-                vcfAncSnpIds.push_back(ancSnpId);
-                vcfAncSnpCodedGenos.push_back(smpGenos);
-                ancSnpNo++;
-            }
+// Genotypes were coded when the vcf file was read. Keeps the rows of the given ID type.
+void VcfSampleAncestrySnpGeno::RecodeSnpGenotypes(AncestrySnpType snpType)
+{
+    ancSnpType = snpType;
+    int typeNo = int(ancSnpType);
+
+    for (int saveSnpNo = 0; saveSnpNo < vcfPutativeSnps.size(); saveSnpNo++) {
+        VcfPutativeSnp *putSnp = &vcfPutativeSnps[saveSnpNo];
+        int ancSnpId = putSnp->ancSnpIds[typeNo];
+        uint64_t *smpGenos = putSnp->codedGenos[typeNo];
+
+        if (ancSnpId > -1 && smpGenos) {
+            vcfAncSnpIds.push_back(ancSnpId);
+            vcfAncSnpGenos.rows.push_back(smpGenos);
+            if (saveLineOffsets) vcfAncSnpLineOffsets.push_back(putSnp->lineOffset);
+            DeletePutativeSnpRows(putSnp, smpGenos);
+        }
+        else {
+            DeletePutativeSnpRows(putSnp, NULL);
         }
     }
 
-    DeleteAncSnpGtValues();
+    vcfPutativeSnps.clear();
 }
 
 void VcfSampleAncestrySnpGeno::CompareAncestrySnpAlleles(const string refStr, const string altsStr,
@@ -378,52 +885,28 @@ const char eRef, const char eAlt, int* expRefIdx, int* expAltIdx)
     }
 }
 
-int VcfSampleAncestrySnpGeno::RecodeGenotypeGivenString(const int expRefIdx, const int expAltIdx, const string genoStr)
-{
-    int genoInt = 3;
-
-    if (genoStr.length() == 3 && (genoStr[1] == '|' || genoStr[1] == '/') && expRefIdx > -1 && expAltIdx > -1) {
-        int g1Num = genoStr[0] - '0';
-        int g2Num = genoStr[2] - '0';
-        genoInt = RecodeGenotypeGivenIntegers(expRefIdx, expAltIdx, g1Num, g2Num);
-    }
-
-    cout << "exp " << expRefIdx << expAltIdx << " geno " << genoStr << " => " << genoInt << "\n";
-
-    return genoInt;
-}
-
-int VcfSampleAncestrySnpGeno::RecodeGenotypeGivenIntegers(const int expRefIdx, const int expAltIdx, const int g1Num, const int g2Num)
-{
-    int genoInt = 3; // number of alt alleles, valid counts are 0, 1, 2
-
-    // Genotype is valid only if both alleles are valid, i.e., same as one of the expected alleles
-    int numValidGenos = 0;
-    int numAlts = 0;
-
-    if (g1Num == expRefIdx || g1Num == expAltIdx) {
-        numValidGenos++;
-        if (g1Num == expAltIdx) numAlts++;
-    }
-
-    if (g2Num == expRefIdx || g2Num == expAltIdx) {
-        numValidGenos++;
-        if (g2Num == expAltIdx) numAlts++;
-    }
-
-    if (numValidGenos == 2) genoInt = numAlts;
-
-    return genoInt;
-}
-
 void VcfSampleAncestrySnpGeno::ShowSummary()
 {
     cout << "\nTotal " << totAncSnps << " ancestry SNPs used by GrafPop\n";
 
-    cout << "Number of samples found in the vcf file: " << numSamples << "\n";
+    cout << "Number of samples found in the vcf file: " << numFileSamples << "\n";
+    if (numSamples < numFileSamples) cout << "Number of samples selected: " << numSamples << "\n";
     cout << "Total " << putativeAncSnps << " ancestry SNPs found from "	<< totVcfSnps << " SNPs\n";
 
     cout << "\n#RSID Ancs: " << numRsIdAncSnps << "\n"
     << "#GB37 Ancs: " << numGb37AncSnps << "\n"
     << "#GB38 Ancs: " << numGb38AncSnps << "\n";
+    if (!posIsSorted) cout << "SNPs are not sorted by position. Positions were matched with hash lookups.\n";
+
+    if (decodeBytes > 0) {
+        cout << "\nDecoded " << long(decodeBytes / 1048576.0) << " MB of genotype columns using "
+             << VcfGtTokenizer::GetSimdName() << " instructions";
+        if (decodeSecs > 0) printf(", %.2f GB/second", decodeBytes / 1073741824.0 / decodeSecs);
+        cout << "\n";
+    }
+
+    if (usedIndex) {
+        cout << "\nIndex used to read " << numIndexRegions << " regions: "
+             << numBlocksRead << " BGZF blocks read, about " << numBlocksSkipped << " blocks skipped\n";
+    }
 }
@@ -3,68 +3,169 @@
 
 #include <zlib.h>
 #include <errno.h>
+#include <atomic>
 #include "Util.h"
+#include "BoundedQueue.h"
 #include "AncestrySnps.h"
+#include "BgzfReader.h"
+#include "VcfIndex.h"
+#include "VcfGtTokenizer.h"
+#include "SampleSubset.h"
+#include "PackedGenoMatrix.h"
 
-#define BUFFERLEN 0x0010
-#define WORDLEN 10000
+#define VCF_GENO_COL 9   // Genotype columns start after the 9 fixed columns (CHROM ... FORMAT)
+#define NUM_SNP_ID_TYPES 3
+#define VCF_BATCH_BYTES 0x100000   // Lines are passed to the parser threads in batches of about 1 MB
+#define VCF_READ_AHEAD_BYTES 0x20000   // Lines this close after the chunk read are read forward instead of seeking
+
+// A vcf line with putative ancestry SNPs. The line might match different ancestry SNPs (or the same SNP
+// with different alleles) by RS ID, Build 37 and Build 38 positions, so the genotypes are coded for each
+// ID type when the line is read. Types with the same expected allele indices share the same row.
+// The rows are packed as in PackedGenoMatrix.
+struct VcfPutativeSnp
+{
+    int ancSnpIds[NUM_SNP_ID_TYPES];      // Indexed by AncestrySnpType. -1 if not found.
+    uint64_t *codedGenos[NUM_SNP_ID_TYPES];   // NULL if the alleles don't match the ancestry SNP
+    uint64_t lineOffset;                  // Where the line starts, if the line offsets are saved
+};
+
+// Complete data lines passed from the reader to the parser threads
+struct VcfLineBatch
+{
+    long batchNo;
+    int firstLineNo;
+    int numLines;
+    int numSkippedSnps;     // Long lines the reader already found not to be ancestry SNPs. Kept as empty lines.
+    vector<char> data;      // Each line ends with '\n'
+    vector<uint64_t> lineOffsets;   // Offset of each line in the file, if the line offsets are saved
+};
+
+// Putative ancestry SNPs found in a batch, passed from the parser threads to the collector
+struct VcfParsedBatch
+{
+    long batchNo;
+    int numLines;
+    int numVcfSnps;
+    vector<VcfPutativeSnp> putSnps;
+    long decodeBytes;
+    double decodeSecs;
+    vector<char> smpGenos;  // Genotype codes of one line, before they are packed
+    bool hasErr;
+    string errMsg;
+};
 
 class VcfSampleAncestrySnpGeno
 {
-private:
+protected:
     string vcfFile;
     AncestrySnps *ancSnps;
 
-    // For all the following arrays:
     // One record for each putative ancestry SNP (checked using rs ID, Build 37 and 38 positions)
-
-    // Saves the two coded alleles (two GT integers like 1/0, 1|1, etc.) for each sample
-    // It is more readable to save the refs and alts in two arrays than in one array
-    vector<vector<char>> vcfAncSnpGtRefs;
-    vector<vector<char>> vcfAncSnpGtAlts;
-
-    vector<int> vcfAncSnpChrs;      // chr value from The CHROM string
-    vector<int> vcfAncSnpPoss;      // pos value from  POS string
-    vector<string> vcfAncSnpSnps;   // The ID string
-    vector<string> vcfAncSnpRefs;   // The REF string
-    vector<string> vcfAncSnpAlts;   // The ALT string
-    vector<int> vcfRsIdAncSnpIds;   // Ancestry SNP ID derived using RS ID
-    vector<int> vcfGb37AncSnpIds;   // Ancestry SNP ID derived using Build 37 chr + pos
-    vector<int> vcfGb38AncSnpIds;   // Ancestry SNP ID derived using Build 38 chr + pos
+    vector<VcfPutativeSnp> vcfPutativeSnps;
 
     int totAncSnps;
-    int numSamples;
+    int numSamples;                // Samples whose genotypes are decoded
+    int numFileSamples;            // Genotype columns in the file
     int totVcfSnps;
     int putativeAncSnps;
     int numRsIdAncSnps;
     int numGb37AncSnps;
     int numGb38AncSnps;
     int numVcfAncSnps;
+    int numThreads;                // Number of threads used to decompress BGZF blocks, and to parse lines
+    int vcfLineNo;
+    bool hasHeadRow;
+
+    // Pipeline: this thread reads and inflates the file, and passes batches of lines to the parser threads.
+    // The collector thread appends the parsed SNPs in the original order.
+    BoundedQueue<VcfLineBatch*> *lineQueue;
+    BoundedQueue<VcfParsedBatch*> *parsedQueue;
+    VcfLineBatch *readBatch;       // Batch being filled by the reader
+    long numReadBatches;
+    int readLineNo;
+    atomic<bool> pipelineErr;
+    mutex statsMutex;
+    int numParsers;
+    double readerBusySecs;
+    double parserBusySecs;         // Total of all parser threads
+    double collectorBusySecs;
+    bool posIsSorted;              // False if positions were matched with hash lookups since the file isn't sorted
+
+    // When a .tbi or .csi index exists, only the BGZF blocks with ancestry SNP positions are read
+    bool usedIndex;
+    int numIndexRegions;
+    long numBlocksRead;
+    long numBlocksSkipped;
+    long decodeBytes;              // Bytes of genotype columns decoded, and the time used by all parsers
+    double decodeSecs;
     AncestrySnpType ancSnpType;
 
+    // With keep/remove lists, only the genotypes of the selected columns are decoded
+    const SampleSubset *smpSubset;
+    vector<int> selSmpNos;
+
+    // In the sample-block mode, the first pass saves the offsets of the lines with ancestry SNPs, and
+    // the later passes only read those lines. Only BGZF and uncompressed files support this.
+    bool saveLineOffsets;
+    uint64_t readLineOffset;       // Offset of the line being read
+    vector<uint64_t> snpLineOffsets;
+
+    bool FindIndexChunks(vector<VcfChunk>*);
+    void CountLine();
+    int CheckSiteFields(const char*, const char*, AncSnpPosCursor*, int*, int*, int*);
+    bool ReadHeaderRow(const char*, const char*);
+    bool SetSamples(const vector<string>&);
+    bool ReadLines(BgzfReader*, const vector<VcfChunk>&);
+    bool ReadSnpLines(BgzfReader*);
+    bool ReadLine(const char*, const char*);
+    void AddBatchLine(const char*, const char*);
+    void FlushBatch();
+    void RunParser();
+    void RunCollector();
+    void AddParsedBatch(VcfParsedBatch*);
+    void ShowPipelineSummary();
+    bool ProcessLine(const char*, const char*);
+    bool ParseSnpLine(const char*, const char*, int, uint64_t, AncSnpPosCursor*, VcfParsedBatch*);
+    int DecodeGenotypes(const char*, const char*, const int, const int, uint64_t*, VcfParsedBatch*);
+    string GetGenoCountError(const char**, int, int);
+    int SetPutativeSnpRows(VcfPutativeSnp*, const int, const int, const int, const string&, const string&, int*, int*);
+    void AddPutativeSnp(const VcfPutativeSnp&);
     void CompareAncestrySnpAlleles(const string, const string, const char, const char, int*, int*);
-    int RecodeGenotypeGivenString(const int, const int, const string);
-    int RecodeGenotypeGivenIntegers(const int, const int, const int, const int);
 
 public:
     // Each enotype (per SNP and sample) is coded with number of alts, i.e., 0 = RR, 1 = RA, 2 = AA, 3 = unknown
-    // Each row in the array is the genotypes of one SNP, coded as  an array of integers for all samples
+    // Each row in the matrix is the genotypes of one SNP, packed at 2 bits per sample
     // Ancestry SNP ID of each row is saved in the array of vcfAncSnpIds
     vector<string> vcfSamples;
     vector<int> vcfAncSnpIds;
-    vector<char*> vcfAncSnpCodedGenos; // Use char, instead of int, to save space
+    PackedGenoMatrix vcfAncSnpGenos;
+    vector<uint64_t> vcfAncSnpLineOffsets;   // Offset of the line of each row, if the line offsets are saved
 
     VcfSampleAncestrySnpGeno(string, AncestrySnps*);
-    ~VcfSampleAncestrySnpGeno();
+    virtual ~VcfSampleAncestrySnpGeno();
+
+    static bool OwnsPutativeSnpRow(const VcfPutativeSnp&, int);
+    static void DeletePutativeSnpRows(VcfPutativeSnp*, const uint64_t*);
 
     int GetNumVcfSnps() { return totVcfSnps; };
     int GetNumSamples() { return numSamples; };
+    int GetNumFileSamples() { return numFileSamples; };
     int GetNumVcfAncestrySnps() { return numVcfAncSnps; };
-    bool ReadDataFromFile();
+    int GetNumRsIdAncestrySnps() { return numRsIdAncSnps; };
+    int GetNumGb37AncestrySnps() { return numGb37AncSnps; };
+    int GetNumGb38AncestrySnps() { return numGb38AncSnps; };
+    void SetNumThreads(int threads) { numThreads = threads > 0 ? threads : 1; };
+    void SetSampleSubset(const SampleSubset *subset) { smpSubset = subset; };
+    void SetSaveLineOffsets(bool save) { saveLineOffsets = save; };
+    void SetSnpLineOffsets(const vector<uint64_t>& offsets) { snpLineOffsets = offsets; };
+    bool HasAncSnpLineOffsets() { return saveLineOffsets; };
+    AncestrySnpType GetAncestrySnpType() { return ancSnpType; };
+    virtual bool ReadDataFromFile();
     void RecodeSnpGenotypes();
+    void RecodeSnpGenotypes(AncestrySnpType);
 
-    void ShowSummary();
-    void DeleteAncSnpGtValues();
+    virtual void ShowSummary();
+    void DeletePutativeSnpGenos();
     void DeleteAncSnpCodedGenos();
 };
 